@@ -64,6 +64,7 @@ static int disk_submit_request(gbd_t *gbd, gbd_request_t *request);
 static void disk_next_request(gbd_t *gbd);
 static uint32_t disk_block_size(gbd_t *gbd);
 static uint32_t disk_total_blocks(gbd_t *gbd);
+static uint32_t disk_blocks_per_cylinder(gbd_t *gbd);
 
 
 /**
@@ -98,6 +99,7 @@ device_t *disk_init(io_descriptor_t *desc)
     gbd->write_block = disk_write_block;
     gbd->block_size = disk_block_size;
     gbd->total_blocks = disk_total_blocks;
+    gbd->blocks_per_cylinder = disk_blocks_per_cylinder;
 
     spinlock_reset(&real_dev->slock);
     real_dev->request_queue = NULL;
@@ -366,4 +368,31 @@ static uint32_t disk_total_blocks(gbd_t *gbd)
     return ret;
 }
 
+/**
+ * Returns number of blocks in one cylinder of disk pointed by
+ * gbd. Implements gbd's blocks_per_cylinder() function.
+ *
+ * @param gbd Pointer to the gbd data structure.
+ *
+ * @return Number of blocks per cylinder of the disk.
+ */
+static uint32_t disk_blocks_per_cylinder(gbd_t *gbd)
+{
+    interrupt_status_t intr_status;
+    disk_real_device_t *real_dev = gbd->device->real_device;
+    disk_io_area_t *io = (disk_io_area_t *)gbd->device->io_address;
+    uint32_t ret;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&real_dev->slock);
+
+    io->command = DISK_COMMAND_BLOCKSPERCYL;
+    ret = io->data;
+
+    spinlock_release(&real_dev->slock);
+    _interrupt_set_state(intr_status);
+
+    return ret;
+}
+
 /** @} */
@@ -125,6 +125,11 @@ typedef struct gbd_struct {
     /* A pointer to a function which returns the total number of 
        blocks in this device. */
     uint32_t (*total_blocks)(struct gbd_struct *gbd);
+
+    /* A pointer to a function which returns the number of blocks in
+       one cylinder of this device, or 0 if the geometry is unknown.
+       Blocks on the same cylinder are read without seeking. */
+    uint32_t (*blocks_per_cylinder)(struct gbd_struct *gbd);
 } gbd_t;
 
 
@@ -40,6 +40,7 @@
 #include "kernel/assert.h"
 #include "kernel/kmalloc.h"
 #include "kernel/interrupt.h"
+#include "vm/tlb.h"
 
 /**@name Metadevices
  *
@@ -233,9 +234,8 @@ void cpustatus_generate_irq(device_t *dev)
 }
 
 /**
- * Interrupt handler for the CPU status device. Currently the CPU
- * status device driver only supports ping-ponging interrupts between
- * CPUs.
+ * Interrupt handler for the CPU status device. Inter-CPU interrupts
+ * are used for TLB shootdowns (see tlb_shootdown).
  *
  * @param device Pointer to the CPU status device
  */
@@ -257,13 +257,14 @@ void cpustatus_interrupt_handle(device_t *dev){
 
     spinlock_acquire(&cpu->slock);
 
-    /* If you really want to do something with inter-cpu interrupts,
-       do it here. */
-
     /* Clear the interrupt */
     iobase->command = CPU_COMMAND_CLEAR_IRQ;
     
     spinlock_release(&cpu->slock);
+
+    /* Inter-CPU interrupts are used for TLB shootdowns. The interrupt
+       is cleared first, so that the next request is not lost. */
+    tlb_shootdown_interrupt();
 }
 
 /** 
@@ -45,6 +45,7 @@
 
 /* import assembler function for clock handling */
 extern void _timer_set_ticks(uint32_t ticks);
+extern uint32_t _timer_get_ticks(void);
 
 /**
  * Sets timer interrupt (hw interrupt 5) to fire after ticks.
@@ -62,4 +63,16 @@ void timer_set_ticks(uint32_t ticks)
     _interrupt_set_state(intr_status);
 }
 
+/**
+ * Returns the number of ticks (CPU cycles) counted by this CPU. The
+ * counter wraps around, so only differences are meaningful.
+ *
+ * @return The tick counter
+ */
+
+uint32_t timer_get_ticks(void)
+{
+    return _timer_get_ticks();
+}
+
 /** @} */
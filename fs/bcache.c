@@ -0,0 +1,1024 @@
+/*
+ * Block buffer cache
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include "fs/bcache.h"
+#include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "kernel/kmalloc.h"
+#include "kernel/semaphore.h"
+#include "kernel/sleepq.h"
+#include "kernel/spinlock.h"
+#include "kernel/thread.h"
+#include "drivers/bootargs.h"
+#include "drivers/metadev.h"
+#include "lib/libc.h"
+#include "vm/pagepool.h"
+
+/** @name Block buffer cache
+ *
+ * The buffer cache keeps recently used disk blocks in memory. Blocks
+ * are identified by their disk and block number and found through a
+ * hash table. A buffer is pinned while somebody uses it; unpinned
+ * buffers are reused for other blocks in least recently used order.
+ * The number of buffers can be given with the boot argument
+ * "bcache".
+ *
+ * Modified buffers are written back later, in block order, by a
+ * flusher thread. The flusher sleeps with a timeout until the oldest
+ * modification is CONFIG_BCACHE_FLUSH_DELAY milliseconds old, so a
+ * single write is also written back, and is woken early when a
+ * quarter of the buffers are dirty. bcache_flush writes the buffers
+ * immediately, for sync and unmount.
+ *
+ * Blocks can also be read ahead with bcache_prefetch, which starts an
+ * asynchronous read and returns. The read is completed by the first
+ * thread wanting the block, or by anyone needing the buffer after the
+ * disk is done.
+ *
+ * The spinlock protects the hash table, the LRU list and the fields
+ * of the buffers except the data. The data of a pinned buffer is
+ * protected by the filesystem using it.
+ *
+ * @{
+ */
+
+/* All buffers and their number */
+static bcache_buf_t *bcache_buffers;
+static int bcache_num_buffers;
+
+/* Hash table of the buffers in use */
+static bcache_buf_t *bcache_hash[BCACHE_HASH_SIZE];
+
+/* LRU list of all buffers, least recently used first */
+static bcache_buf_t *bcache_lru_head;
+static bcache_buf_t *bcache_lru_tail;
+
+/* Number of threads waiting for an unpinned buffer */
+static int bcache_waiting;
+
+/* Number of dirty buffers and the time when the first of them was
+   modified, in milliseconds */
+static int bcache_dirty;
+static uint32_t bcache_dirty_since;
+
+/* Whether the flusher has been asked to flush before the delay and
+   not started flushing yet. The flusher sleeps on bcache_dirty. */
+static int bcache_flush_pending;
+
+static spinlock_t bcache_slock;
+
+/* Serializes the flushes, which share the list of buffers to write
+   and the requests */
+static semaphore_t *bcache_flush_sem;
+static bcache_buf_t **bcache_flush_list;
+
+/* Limits of the number of buffers given with the boot argument, see
+   CONFIG_BCACHE_BUFFERS */
+#define BCACHE_MIN_BUFFERS 16
+#define BCACHE_MAX_BUFFERS 4096
+
+/* Maximum number of writes of a flush in progress at once */
+#define BCACHE_FLUSH_BATCH 16
+
+/* Requests of the writes in progress and the semaphore signaled when
+   each of them completes */
+static gbd_request_t bcache_flush_req[BCACHE_FLUSH_BATCH];
+static semaphore_t *bcache_flush_done;
+
+/* Maximum number of asynchronous reads in progress */
+#define BCACHE_IO_SLOTS 16
+
+/* An asynchronous read started by bcache_prefetch */
+typedef struct bcache_io_struct {
+    /* The request, whose semaphore is signaled by the disk driver */
+    gbd_request_t req;
+    semaphore_t *sem;
+    /* The buffer read to, NULL if the slot is free */
+    bcache_buf_t *buf;
+    /* Whether somebody is waiting for the read to complete */
+    int claimed;
+} bcache_io_t;
+
+static bcache_io_t bcache_io[BCACHE_IO_SLOTS];
+
+#define BCACHE_HASH(disk, block) \
+    ((((uint32_t)(disk) >> 4) + (block)) & (BCACHE_HASH_SIZE - 1))
+
+/**
+ * Removes a buffer from the LRU list.
+ *
+ * @param buf The buffer
+ */
+static void bcache_lru_remove(bcache_buf_t *buf)
+{
+    if (buf->lru_prev != NULL)
+        buf->lru_prev->lru_next = buf->lru_next;
+    else
+        bcache_lru_head = buf->lru_next;
+
+    if (buf->lru_next != NULL)
+        buf->lru_next->lru_prev = buf->lru_prev;
+    else
+        bcache_lru_tail = buf->lru_prev;
+}
+
+/**
+ * Adds a buffer to the end (most recently used) of the LRU list.
+ *
+ * @param buf The buffer
+ */
+static void bcache_lru_append(bcache_buf_t *buf)
+{
+    buf->lru_prev = bcache_lru_tail;
+    buf->lru_next = NULL;
+
+    if (bcache_lru_tail != NULL)
+        bcache_lru_tail->lru_next = buf;
+    else
+        bcache_lru_head = buf;
+    bcache_lru_tail = buf;
+}
+
+/**
+ * Removes a buffer from the hash table.
+ *
+ * @param buf The buffer, which must be in the hash table
+ */
+static void bcache_hash_remove(bcache_buf_t *buf)
+{
+    bcache_buf_t **prev;
+
+    prev = &bcache_hash[BCACHE_HASH(buf->disk, buf->block)];
+    while (*prev != buf) {
+        KERNEL_ASSERT(*prev != NULL);
+        prev = &(*prev)->hash_next;
+    }
+    *prev = buf->hash_next;
+}
+
+/**
+ * Initializes the buffer cache. Memory for the buffers is allocated
+ * with kmalloc, so this must be called before virtual memory is
+ * initialized.
+ */
+void bcache_init(void)
+{
+    uint8_t *data;
+    int i;
+
+    spinlock_reset(&bcache_slock);
+
+    bcache_num_buffers = CONFIG_BCACHE_BUFFERS;
+    if (bootargs_get("bcache") != NULL) {
+        bcache_num_buffers = atoi(bootargs_get("bcache"));
+        if (bcache_num_buffers < BCACHE_MIN_BUFFERS) {
+            kprintf("BCache: %s buffers is too few, using %d\n",
+                    bootargs_get("bcache"), BCACHE_MIN_BUFFERS);
+            bcache_num_buffers = BCACHE_MIN_BUFFERS;
+        } else if (bcache_num_buffers > BCACHE_MAX_BUFFERS) {
+            kprintf("BCache: %s buffers is too many, using %d\n",
+                    bootargs_get("bcache"), BCACHE_MAX_BUFFERS);
+            bcache_num_buffers = BCACHE_MAX_BUFFERS;
+        }
+    }
+
+    bcache_buffers = (bcache_buf_t *)kmalloc(bcache_num_buffers *
+                                             sizeof(bcache_buf_t));
+    data = (uint8_t *)kmalloc(bcache_num_buffers * BCACHE_BLOCK_SIZE);
+    bcache_flush_list = (bcache_buf_t **)kmalloc(bcache_num_buffers *
+                                                 sizeof(bcache_buf_t *));
+
+    bcache_flush_sem  = semaphore_create(1);
+    bcache_flush_done = semaphore_create(0);
+    KERNEL_ASSERT(bcache_flush_sem != NULL && bcache_flush_done != NULL);
+
+    for (i = 0; i < BCACHE_IO_SLOTS; i++) {
+        bcache_io[i].sem = semaphore_create(0);
+        bcache_io[i].buf = NULL;
+        KERNEL_ASSERT(bcache_io[i].sem != NULL);
+    }
+
+    for (i = 0; i < BCACHE_HASH_SIZE; i++)
+        bcache_hash[i] = NULL;
+
+    bcache_lru_head = NULL;
+    bcache_lru_tail = NULL;
+    for (i = 0; i < bcache_num_buffers; i++) {
+        bcache_buffers[i].disk      = NULL;
+        bcache_buffers[i].block     = 0;
+        bcache_buffers[i].data      = data + i * BCACHE_BLOCK_SIZE;
+        bcache_buffers[i].refcount  = 0;
+        bcache_buffers[i].flags     = 0;
+        bcache_buffers[i].io        = NULL;
+        bcache_buffers[i].hash_next = NULL;
+        bcache_lru_append(&bcache_buffers[i]);
+    }
+
+    bcache_waiting       = 0;
+    bcache_dirty         = 0;
+    bcache_flush_pending = 0;
+
+    kprintf("BCache: %d buffers of %d bytes\n", bcache_num_buffers,
+            BCACHE_BLOCK_SIZE);
+}
+
+/**
+ * Sleeps until the given resource is woken up. The spinlock must be
+ * held and the interrupts disabled; the spinlock is held again when
+ * this returns.
+ *
+ * @param resource The resource to sleep on
+ */
+static void bcache_sleep(void *resource)
+{
+    sleepq_add(resource);
+    spinlock_release(&bcache_slock);
+    thread_switch();
+    spinlock_acquire(&bcache_slock);
+}
+
+/**
+ * Unpins a buffer. The spinlock must be held.
+ *
+ * @param buf The buffer
+ *
+ * @param used Whether the buffer becomes the most recently used
+ */
+static void bcache_unpin(bcache_buf_t *buf, int used)
+{
+    KERNEL_ASSERT(buf->refcount > 0);
+
+    if (--buf->refcount == 0) {
+        if (used) {
+            bcache_lru_remove(buf);
+            bcache_lru_append(buf);
+        }
+        if (bcache_waiting > 0)
+            sleepq_wake_all(&bcache_waiting);
+    }
+}
+
+/**
+ * Writes a dirty buffer to the disk. The buffer is busy meanwhile, so
+ * nobody else pins it; if it is modified while being written, it is
+ * marked dirty again. The caller must have pinned the buffer and hold
+ * the spinlock, which is released for the write.
+ *
+ * @param buf The buffer
+ *
+ * @param intr_status Interrupt state to restore for the write
+ *
+ * @return 0 on success, negative if the block could not be written.
+ * The buffer is left dirty on failure.
+ */
+static int bcache_write_back(bcache_buf_t *buf,
+                             interrupt_status_t intr_status)
+{
+    gbd_request_t req;
+    int r;
+
+    KERNEL_ASSERT(buf->refcount > 0);
+
+    if (!(buf->flags & BCACHE_DIRTY))
+        return 0;
+
+    buf->flags &= ~BCACHE_DIRTY;
+    buf->flags |= BCACHE_BUSY;
+    bcache_dirty--;
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    req.block = buf->block;
+    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)buf->data);
+    req.sem   = NULL;
+    r = buf->disk->write_block(buf->disk, &req);
+
+    _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    buf->flags &= ~BCACHE_BUSY;
+    sleepq_wake_all(buf);
+
+    if (r == 0) {
+        if (!(buf->flags & BCACHE_DIRTY) && bcache_dirty++ == 0)
+            bcache_dirty_since = rtc_get_msec();
+        buf->flags |= BCACHE_DIRTY;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Finds the buffer of a block in the hash table. The spinlock must be
+ * held.
+ *
+ * @param disk The disk
+ *
+ * @param block Block number on the disk
+ *
+ * @return The buffer, NULL if the block is not cached.
+ */
+static bcache_buf_t *bcache_find(gbd_t *disk, uint32_t block)
+{
+    bcache_buf_t *buf;
+
+    buf = bcache_hash[BCACHE_HASH(disk, block)];
+    while (buf != NULL && (buf->disk != disk || buf->block != block))
+        buf = buf->hash_next;
+
+    return buf;
+}
+
+/**
+ * Finds the least recently used clean unpinned buffer. Buffers being
+ * read or written are pinned by the thread doing the I/O. The
+ * spinlock must be held.
+ *
+ * @param dirty The least recently used dirty unpinned buffer is
+ * returned here, if there is no clean one. May be NULL.
+ *
+ * @return The buffer, NULL if there is none.
+ */
+static bcache_buf_t *bcache_find_clean(bcache_buf_t **dirty)
+{
+    bcache_buf_t *buf;
+
+    if (dirty != NULL)
+        *dirty = NULL;
+
+    buf = bcache_lru_head;
+    while (buf != NULL &&
+           (buf->refcount > 0 || (buf->flags & BCACHE_DIRTY))) {
+        if (dirty != NULL && *dirty == NULL && buf->refcount == 0)
+            *dirty = buf;
+        buf = buf->lru_next;
+    }
+
+    return buf;
+}
+
+/**
+ * Reuses an unpinned clean buffer for another block. The buffer is
+ * pinned and not valid. The spinlock must be held.
+ *
+ * @param buf The buffer
+ *
+ * @param disk The disk
+ *
+ * @param block Block number on the disk
+ */
+static void bcache_assign(bcache_buf_t *buf, gbd_t *disk, uint32_t block)
+{
+    if (buf->disk != NULL)
+        bcache_hash_remove(buf);
+
+    buf->disk      = disk;
+    buf->block     = block;
+    buf->flags     = 0;
+    buf->refcount  = 1;
+    buf->hash_next = bcache_hash[BCACHE_HASH(disk, block)];
+    bcache_hash[BCACHE_HASH(disk, block)] = buf;
+}
+
+/**
+ * Waits for an asynchronous read started by bcache_prefetch to
+ * complete and makes the buffer usable. Nobody else may be waiting
+ * for the read. The spinlock must be held; it is released while
+ * waiting.
+ *
+ * @param io The read
+ *
+ * @param intr_status Interrupt state to restore while waiting
+ */
+static void bcache_complete(bcache_io_t *io, interrupt_status_t intr_status)
+{
+    bcache_buf_t *buf = io->buf;
+
+    KERNEL_ASSERT(!io->claimed);
+    io->claimed = 1;
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    semaphore_P(io->sem);
+
+    _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    buf->flags &= ~BCACHE_BUSY;
+    if (io->req.return_value == 0)
+        buf->flags |= BCACHE_VALID;
+    buf->io = NULL;
+    io->buf = NULL;
+    sleepq_wake_all(buf);
+
+    /* Give back the pin of the read. Read ahead blocks are about to
+       be used, so they become the most recently used. */
+    bcache_unpin(buf, 1);
+}
+
+/**
+ * Completes the asynchronous reads which the disk has finished, so
+ * that their buffers and slots can be reused. The spinlock must be
+ * held; it may be released meanwhile.
+ *
+ * @param intr_status Interrupt state to restore while waiting
+ */
+static void bcache_reap(interrupt_status_t intr_status)
+{
+    int i;
+
+    /* The disk driver sets the return value before signaling the
+       semaphore, so waiting for the semaphore takes no time. */
+    for (i = 0; i < BCACHE_IO_SLOTS; i++) {
+        if (bcache_io[i].buf != NULL && !bcache_io[i].claimed &&
+            bcache_io[i].req.return_value == 0)
+            bcache_complete(&bcache_io[i], intr_status);
+    }
+}
+
+/**
+ * Pins the buffer of the given block, waiting for a read or write of
+ * the block in progress to finish. If the block is not cached and
+ * claim is set, the least recently used clean unpinned buffer is
+ * taken for it, waiting for one to become unpinned if necessary. If
+ * all unpinned buffers are dirty, the least recently used of them is
+ * written back first. A claimed buffer is not valid. The spinlock
+ * must be held.
+ *
+ * @param disk The disk
+ *
+ * @param block Block number on the disk
+ *
+ * @param claim Whether to take a buffer for a block not cached
+ *
+ * @param intr_status Interrupt state to restore while waiting for
+ * I/O
+ *
+ * @return The pinned buffer, NULL if the block is not cached and
+ * claim is not set.
+ */
+static bcache_buf_t *bcache_pin(gbd_t *disk, uint32_t block, int claim,
+                                interrupt_status_t intr_status)
+{
+    bcache_buf_t *buf;
+    bcache_buf_t *dirty;
+
+    while (1) {
+        buf = bcache_find(disk, block);
+
+        if (buf != NULL) {
+            if (buf->flags & BCACHE_BUSY) {
+                /* The first one to want a read ahead block waits for
+                   the read, the rest are woken by it. */
+                if (buf->io != NULL && !buf->io->claimed)
+                    bcache_complete(buf->io, intr_status);
+                else
+                    bcache_sleep(buf);
+                continue;
+            }
+            buf->refcount++;
+            return buf;
+        }
+
+        if (!claim)
+            return NULL;
+
+        buf = bcache_find_clean(&dirty);
+
+        if (buf == NULL && dirty != NULL) {
+            /* The block is lost if it cannot be written, rather than
+               retrying it forever. */
+            dirty->refcount++;
+            if (bcache_write_back(dirty, intr_status) < 0) {
+                kprintf("BCache: Writing back block %d failed\n",
+                        dirty->block);
+                dirty->flags &= ~BCACHE_DIRTY;
+                bcache_dirty--;
+            }
+            bcache_unpin(dirty, 0);
+            continue;
+        }
+
+        if (buf == NULL) {
+            /* Finished read ahead may hold the buffers. */
+            bcache_reap(intr_status);
+            if (bcache_find_clean(NULL) != NULL)
+                continue;
+
+            bcache_waiting++;
+            bcache_sleep(&bcache_waiting);
+            bcache_waiting--;
+            continue;
+        }
+
+        bcache_assign(buf, disk, block);
+        return buf;
+    }
+}
+
+/**
+ * Gets a block from the cache, reading it from the disk if it is not
+ * cached. The buffer is pinned and must be given back with
+ * bcache_release.
+ *
+ * @param disk The disk, whose block size must be at most
+ * BCACHE_BLOCK_SIZE
+ *
+ * @param block Block number on the disk
+ *
+ * @param read Whether the block is read from the disk. If not set,
+ * the caller must overwrite the whole block.
+ *
+ * @return The pinned buffer, NULL if the block could not be read.
+ */
+bcache_buf_t *bcache_get(gbd_t *disk, uint32_t block, int read)
+{
+    interrupt_status_t intr_status;
+    bcache_buf_t *buf;
+    gbd_request_t req;
+    int r;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    buf = bcache_pin(disk, block, 1, intr_status);
+
+    if (!(buf->flags & BCACHE_VALID)) {
+        if (read) {
+            /* Others wanting the block wait until it has been read. */
+            buf->flags |= BCACHE_BUSY;
+            spinlock_release(&bcache_slock);
+            _interrupt_set_state(intr_status);
+
+            req.block = block;
+            req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)buf->data);
+            req.sem   = NULL;
+            r = disk->read_block(disk, &req);
+
+            intr_status = _interrupt_disable();
+            spinlock_acquire(&bcache_slock);
+
+            buf->flags &= ~BCACHE_BUSY;
+            sleepq_wake_all(buf);
+            if (r == 0) {
+                bcache_unpin(buf, 1);
+                buf = NULL;
+            } else {
+                buf->flags |= BCACHE_VALID;
+            }
+        } else {
+            buf->flags |= BCACHE_VALID;
+        }
+    }
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    return buf;
+}
+
+/**
+ * Gets a block from the cache only if it is cached.
+ *
+ * @param disk The disk
+ *
+ * @param block Block number on the disk
+ *
+ * @return The pinned buffer, which must be given back with
+ * bcache_release, or NULL if the block is not cached.
+ */
+bcache_buf_t *bcache_lookup(gbd_t *disk, uint32_t block)
+{
+    interrupt_status_t intr_status;
+    bcache_buf_t *buf;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    buf = bcache_pin(disk, block, 0, intr_status);
+    if (buf != NULL && !(buf->flags & BCACHE_VALID)) {
+        bcache_unpin(buf, 1);
+        buf = NULL;
+    }
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    return buf;
+}
+
+/**
+ * Starts reading a block to the cache in the background, if it is not
+ * cached yet. Nothing is done if there is no clean unpinned buffer or
+ * no free I/O slot, so that read ahead never waits.
+ *
+ * @param disk The disk, whose block size must be at most
+ * BCACHE_BLOCK_SIZE
+ *
+ * @param block Block number on the disk
+ */
+void bcache_prefetch(gbd_t *disk, uint32_t block)
+{
+    interrupt_status_t intr_status;
+    bcache_io_t *io = NULL;
+    bcache_buf_t *buf = NULL;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    for (i = 0; i < BCACHE_IO_SLOTS && io == NULL; i++) {
+        if (bcache_io[i].buf == NULL)
+            io = &bcache_io[i];
+    }
+    if (io == NULL) {
+        bcache_reap(intr_status);
+        for (i = 0; i < BCACHE_IO_SLOTS && io == NULL; i++) {
+            if (bcache_io[i].buf == NULL)
+                io = &bcache_io[i];
+        }
+    }
+
+    if (io != NULL && bcache_find(disk, block) == NULL)
+        buf = bcache_find_clean(NULL);
+
+    if (buf == NULL) {
+        spinlock_release(&bcache_slock);
+        _interrupt_set_state(intr_status);
+        return;
+    }
+
+    /* The read holds a pin until it is completed. */
+    bcache_assign(buf, disk, block);
+    buf->flags = BCACHE_BUSY;
+    buf->io    = io;
+
+    io->buf              = buf;
+    io->claimed          = 0;
+    io->req.block        = block;
+    io->req.buf          = ADDR_KERNEL_TO_PHYS((uint32_t)buf->data);
+    io->req.sem          = io->sem;
+    io->req.return_value = -1;
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    /* A request which could not be submitted is completed as failed. */
+    if (disk->read_block(disk, &io->req) == 0)
+        semaphore_V(io->sem);
+}
+
+/**
+ * Marks a buffer modified. It is written to the disk later by the
+ * flusher thread or bcache_flush.
+ *
+ * @param buf The buffer, which must be pinned
+ */
+void bcache_mark_dirty(bcache_buf_t *buf)
+{
+    interrupt_status_t intr_status;
+
+    KERNEL_ASSERT(buf->refcount > 0 && (buf->flags & BCACHE_VALID));
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    if (!(buf->flags & BCACHE_DIRTY)) {
+        buf->flags |= BCACHE_DIRTY;
+        /* The first dirty buffer starts the flusher's timeout */
+        if (bcache_dirty++ == 0) {
+            bcache_dirty_since = rtc_get_msec();
+            sleepq_wake(&bcache_dirty);
+        }
+    }
+
+    if (!bcache_flush_pending && bcache_dirty >= bcache_num_buffers / 4) {
+        bcache_flush_pending = 1;
+        sleepq_wake(&bcache_dirty);
+    }
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Gives back a buffer pinned by bcache_get or bcache_lookup.
+ *
+ * @param buf The buffer
+ */
+void bcache_release(bcache_buf_t *buf)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    bcache_unpin(buf, 1);
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Writes pinned buffers to the disk in parallel. Buffers which are
+ * not dirty anymore are skipped. The buffers are unpinned. The caller
+ * must hold bcache_flush_sem.
+ *
+ * @param bufs The buffers
+ *
+ * @param count Number of buffers, at most BCACHE_FLUSH_BATCH
+ *
+ * @return 0 on success, negative if some block could not be written.
+ * Those buffers are left dirty.
+ */
+static int bcache_flush_batch(bcache_buf_t **bufs, int count)
+{
+    interrupt_status_t intr_status;
+    gbd_request_t *req;
+    int writing[BCACHE_FLUSH_BATCH];
+    int ret = 0;
+    int i;
+
+    KERNEL_ASSERT(count <= BCACHE_FLUSH_BATCH);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    /* Buffers being written are busy, see bcache_write_back. */
+    for (i = 0; i < count; i++) {
+        writing[i] = (bufs[i]->flags & BCACHE_DIRTY) != 0;
+        if (writing[i]) {
+            bufs[i]->flags &= ~BCACHE_DIRTY;
+            bufs[i]->flags |= BCACHE_BUSY;
+            bcache_dirty--;
+        }
+    }
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    for (i = 0; i < count; i++) {
+        if (!writing[i])
+            continue;
+
+        req = &bcache_flush_req[i];
+        req->block = bufs[i]->block;
+        req->buf   = ADDR_KERNEL_TO_PHYS((uint32_t)bufs[i]->data);
+        req->sem   = bcache_flush_done;
+
+        /* A request which could not be submitted is completed as
+           failed. */
+        if (bufs[i]->disk->write_block(bufs[i]->disk, req) == 0) {
+            req->return_value = -1;
+            semaphore_V(bcache_flush_done);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (writing[i])
+            semaphore_P(bcache_flush_done);
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    for (i = 0; i < count; i++) {
+        if (writing[i]) {
+            bufs[i]->flags &= ~BCACHE_BUSY;
+            sleepq_wake_all(bufs[i]);
+
+            if (bcache_flush_req[i].return_value != 0) {
+                kprintf("BCache: Writing back block %d failed\n",
+                        bufs[i]->block);
+                if (!(bufs[i]->flags & BCACHE_DIRTY) && bcache_dirty++ == 0)
+                    bcache_dirty_since = rtc_get_msec();
+                bufs[i]->flags |= BCACHE_DIRTY;
+                ret = -1;
+            }
+        }
+        bcache_unpin(bufs[i], 0);
+    }
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    return ret;
+}
+
+/**
+ * Writes the dirty buffers of a disk, or of all disks, to the disk.
+ * The buffers are written in block order.
+ *
+ * @param disk The disk, NULL for all disks
+ *
+ * @return 0 on success, negative if some block could not be written.
+ */
+int bcache_flush(gbd_t *disk)
+{
+    interrupt_status_t intr_status;
+    bcache_buf_t *buf;
+    int count = 0;
+    int ret = 0;
+    int gap, i, j;
+
+    semaphore_P(bcache_flush_sem);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    bcache_flush_pending = 0;
+
+    /* Buffers being read are never dirty and buffers being written
+       are clean until the write is done. */
+    for (i = 0; i < bcache_num_buffers; i++) {
+        buf = &bcache_buffers[i];
+        if ((buf->flags & BCACHE_DIRTY) && !(buf->flags & BCACHE_BUSY) &&
+            (disk == NULL || buf->disk == disk)) {
+            buf->refcount++;
+            bcache_flush_list[count++] = buf;
+        }
+    }
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+
+    /* Shell sort by disk and block number */
+    for (gap = count / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < count; i++) {
+            buf = bcache_flush_list[i];
+            for (j = i; j >= gap &&
+                     (bcache_flush_list[j - gap]->disk > buf->disk ||
+                      (bcache_flush_list[j - gap]->disk == buf->disk &&
+                       bcache_flush_list[j - gap]->block > buf->block));
+                 j -= gap)
+                bcache_flush_list[j] = bcache_flush_list[j - gap];
+            bcache_flush_list[j] = buf;
+        }
+    }
+
+    /* The writes of a batch are submitted together, so the disk
+       driver queues them while the previous ones are written. */
+    for (i = 0; i < count; i += BCACHE_FLUSH_BATCH) {
+        if (bcache_flush_batch(&bcache_flush_list[i],
+                               MIN(count - i, BCACHE_FLUSH_BATCH)) < 0)
+            ret = -1;
+    }
+
+    semaphore_V(bcache_flush_sem);
+
+    return ret;
+}
+
+/**
+ * The flusher thread. Sleeps until a buffer is modified, then until
+ * the oldest modification is CONFIG_BCACHE_FLUSH_DELAY milliseconds
+ * old, rechecking the age whenever it wakes, and writes back the
+ * dirty buffers. bcache_mark_dirty wakes it early when many buffers
+ * are dirty.
+ *
+ * @param dummy Unused
+ */
+static void bcache_flusher(uint32_t dummy)
+{
+    interrupt_status_t intr_status;
+    uint32_t age;
+
+    dummy = dummy;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    while (1) {
+        if (bcache_dirty == 0) {
+            sleepq_add(&bcache_dirty);
+        } else {
+            age = rtc_get_msec() - bcache_dirty_since;
+            if (!bcache_flush_pending && age < CONFIG_BCACHE_FLUSH_DELAY) {
+                sleepq_add_timeout(&bcache_dirty,
+                                   CONFIG_BCACHE_FLUSH_DELAY - age);
+            } else {
+                spinlock_release(&bcache_slock);
+                _interrupt_set_state(intr_status);
+
+                bcache_flush(NULL);
+
+                intr_status = _interrupt_disable();
+                spinlock_acquire(&bcache_slock);
+
+                /* Buffers modified during the flush, or which could
+                   not be written, get a new delay. */
+                if (bcache_dirty > 0)
+                    bcache_dirty_since = rtc_get_msec();
+                continue;
+            }
+        }
+
+        spinlock_release(&bcache_slock);
+        thread_switch();
+        spinlock_acquire(&bcache_slock);
+    }
+}
+
+/**
+ * Starts the flusher thread. Called when threads can be run.
+ */
+void bcache_start(void)
+{
+    TID_t tid;
+
+    tid = thread_create(&bcache_flusher, 0);
+    KERNEL_ASSERT(tid >= 0);
+    thread_run(tid);
+}
+
+/**
+ * Drops all blocks of a disk from the cache, when the filesystem on
+ * the disk is unmounted. The blocks must have been flushed first;
+ * blocks which could not be written are lost. No buffer of the disk
+ * may be pinned.
+ *
+ * @param disk The disk
+ */
+void bcache_invalidate(gbd_t *disk)
+{
+    interrupt_status_t intr_status;
+    bcache_buf_t *buf;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&bcache_slock);
+
+    /* Read ahead still in progress must finish first. */
+    for (i = 0; i < BCACHE_IO_SLOTS; i++) {
+        while (bcache_io[i].buf != NULL && bcache_io[i].buf->disk == disk) {
+            if (!bcache_io[i].claimed)
+                bcache_complete(&bcache_io[i], intr_status);
+            else
+                bcache_sleep(bcache_io[i].buf);
+        }
+    }
+
+    for (i = 0; i < bcache_num_buffers; i++) {
+        buf = &bcache_buffers[i];
+        if (buf->disk != disk)
+            continue;
+
+        KERNEL_ASSERT(buf->refcount == 0);
+        if (buf->flags & BCACHE_DIRTY)
+            bcache_dirty--;
+        bcache_hash_remove(buf);
+        buf->disk  = NULL;
+        buf->flags = 0;
+
+        /* Free buffers are reused first. */
+        bcache_lru_remove(buf);
+        buf->lru_prev = NULL;
+        buf->lru_next = bcache_lru_head;
+        if (bcache_lru_head != NULL)
+            bcache_lru_head->lru_prev = buf;
+        else
+            bcache_lru_tail = buf;
+        bcache_lru_head = buf;
+    }
+
+    spinlock_release(&bcache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
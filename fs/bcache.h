@@ -0,0 +1,88 @@
+/*
+ * Block buffer cache
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#ifndef BUENOS_FS_BCACHE_H
+#define BUENOS_FS_BCACHE_H
+
+#include "lib/types.h"
+#include "drivers/gbd.h"
+
+/* Size of a cached block. Disks with larger blocks cannot be cached. */
+#define BCACHE_BLOCK_SIZE 512
+
+/* Number of buckets in the hash table, a power of two */
+#define BCACHE_HASH_SIZE 256
+
+/* Buffer flags */
+#define BCACHE_VALID 1 /* The data has been read from the disk */
+#define BCACHE_BUSY  2 /* The block is being read or written */
+#define BCACHE_DIRTY 4 /* The data must be written to the disk */
+
+/* A cached disk block. The buffer is pinned (cannot be evicted or
+   reused for another block) as long as its reference count is
+   positive. */
+typedef struct bcache_buf_struct {
+    /* Disk of the block, NULL if the buffer is unused */
+    gbd_t *disk;
+    /* Block number on the disk */
+    uint32_t block;
+    /* Contents of the block, word aligned in unmapped memory */
+    void *data;
+
+    /* Number of pins */
+    int refcount;
+    /* BCACHE_VALID, BCACHE_BUSY, BCACHE_DIRTY */
+    int flags;
+    /* Asynchronous read of the block in progress, NULL if none */
+    struct bcache_io_struct *io;
+
+    /* Next buffer in the same hash bucket */
+    struct bcache_buf_struct *hash_next;
+    /* Neighbours in the LRU list, least recently used first */
+    struct bcache_buf_struct *lru_prev;
+    struct bcache_buf_struct *lru_next;
+} bcache_buf_t;
+
+void bcache_init(void);
+void bcache_start(void);
+bcache_buf_t *bcache_get(gbd_t *disk, uint32_t block, int read);
+bcache_buf_t *bcache_lookup(gbd_t *disk, uint32_t block);
+void bcache_prefetch(gbd_t *disk, uint32_t block);
+void bcache_mark_dirty(bcache_buf_t *buf);
+void bcache_release(bcache_buf_t *buf);
+int bcache_flush(gbd_t *disk);
+void bcache_invalidate(gbd_t *disk);
+
+#endif /* BUENOS_FS_BCACHE_H */
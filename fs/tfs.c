@@ -36,10 +36,17 @@
 
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "kernel/semaphore.h"
+#include "kernel/sleepq.h"
+#include "kernel/spinlock.h"
+#include "kernel/thread.h"
 #include "vm/pagepool.h"
 #include "drivers/gbd.h"
 #include "fs/vfs.h"
 #include "fs/tfs.h"
+#include "fs/bcache.h"
 #include "lib/libc.h"
 #include "lib/bitmap.h"
 
@@ -50,35 +57,957 @@
  * @{
  */
 
+/* Whether the disk can transfer a block directly to or from the given
+   buffer. The buffer must be word aligned and in the directly mapped
+   kernel segment, so that it is contiguous in physical memory. Page
+   fills and the page cache pass such buffers. */
+#define TFS_DIRECT_IO(buf) ((((uint32_t)(buf)) & 0xe0000003) == 0x80000000)
+
+/* Maximum number of direct block transfers in progress at once */
+#define TFS_BATCH_SIZE 16
+
+/* Direct block transfers started together and waited for at once */
+typedef struct {
+    /* The requests in progress */
+    gbd_request_t req[TFS_BATCH_SIZE];
+    /* Signaled once for each completed request, NULL if the
+       transfers are synchronous */
+    semaphore_t   *sem;
+    /* Number of requests in progress */
+    int           count;
+    /* Whether some transfer failed */
+    int           error;
+} tfs_batch_t;
+
+/* Number of inode locks. A thread holds at most one inode lock at a
+   time, so the table never runs out. */
+#define TFS_INODE_LOCKS CONFIG_MAX_THREADS
+
+/* Readers-writer lock of an inode. The entry is in use if users is
+   positive. */
+typedef struct {
+    /* Block number of the inode */
+    uint32_t inode;
+    /* Number of threads holding or waiting for the lock */
+    int      users;
+    /* Number of threads reading the file */
+    int      readers;
+    /* Whether a thread is writing or removing the file */
+    int      writer;
+    /* Number of threads waiting to lock exclusively */
+    int      writers_waiting;
+} tfs_inodelock_t;
+
+/* Size of the directory hash table (prime number) */
+#define TFS_DIR_HASH_SIZE 127
+
+/* In-memory copy of a directory entry. */
+typedef struct {
+    /* File's inode block number, zero if the entry is free */
+    uint32_t inode;
+    /* File name, always terminated */
+    char     name[TFS_FILENAME_MAX + 1];
+    /* Next entry in the same hash chain or in the free list, -1 if
+       this is the last one */
+    int      next;
+} tfs_dirslot_t;
+
+/* Number of directory entries in one page of memory */
+#define TFS_DIRSLOTS_PER_PAGE (PAGE_SIZE/sizeof(tfs_dirslot_t))
+
+/* Number of pages needed for the largest directory */
+#define TFS_DIR_PAGES ((TFS2_DIR_BLOCKS_MAX*TFS_MAX_FILES + \
+			TFS_DIRSLOTS_PER_PAGE - 1) / TFS_DIRSLOTS_PER_PAGE)
+
 
 /* Data structure used internally by TFS filesystem. This data structure 
-   is used by tfs-functions. it is initialized during tfs_init(). Also
-   memory for the buffers is reserved _dynamically_ during init.
+   is used by tfs-functions. it is initialized during tfs_init().
 
-   Buffers are used when reading/writing system or data blocks from/to 
-   disk.
+   All blocks are read and written through the block buffer cache.
+   Operations on different files run in parallel: reads and writes
+   lock only the inode of the file, and the directory and allocation
+   blocks have a lock of their own. When both are needed, the
+   directory lock is taken first.
+
+   The directory is kept in memory with a hash table from file names
+   to entries, so that files are looked up without disk I/O. Changes
+   are written to the cached directory blocks as they are made.
+
+   Both version 1 and version 2 volumes are supported. A version 1
+   volume is handled as a version 2 volume with one bitmap block, one
+   directory block and inodes without indirect blocks.
 */
 typedef struct {
-    /* Total number of blocks of the disk */ 
+    /* Total number of blocks of the volume */ 
     uint32_t       totalblocks;
 
     /* Pointer to gbd device performing tfs */
     gbd_t          *disk;
 
-    /* lock for mutual exclusion of fs-operations (we support only
-       one operation at a time in any case) */
-    semaphore_t    *lock;
+    /* Format version of the volume, 1 or 2 */
+    int            version;
+
+    /* Number of allocation bitmap blocks, starting from
+       TFS_ALLOCATION_BLOCK */
+    uint32_t       bitmapblocks;
+
+    /* First block and number of blocks of the directory */
+    uint32_t       dirstart;
+    uint32_t       dirblocks;
+
+    /* Number of entries in the directory */
+    int            maxfiles;
+
+    /* Maximum number of data blocks of a file */
+    uint32_t       maxblocks;
+
+    /* Number of free blocks */
+    uint32_t       freeblocks;
 
-    /* Buffers for read/write operations on disk. */       
-    tfs_inode_t    *buffer_inode;   /* buffer for inode blocks */
-    bitmap_t       *buffer_bat;     /* buffer for allocation block */
-    tfs_direntry_t *buffer_md;      /* buffer for directory block */
+    /* Number of blocks in one cylinder of the disk, and the block
+       after the previously created file, where allocation of the next
+       file starts */
+    uint32_t       cylblocks;
+    uint32_t       allocnext;
+
+    /* lock for the directory and the allocation bitmap, held while
+       files are looked up, created or removed */
+    semaphore_t    *dirlock;
+
+    /* the entries of the directory blocks, in pages of memory */
+    tfs_dirslot_t  *dirpage[TFS_DIR_PAGES];
+
+    /* first entry of each hash chain, -1 if the chain is empty */
+    int            dirhash[TFS_DIR_HASH_SIZE];
+
+    /* first free entry, -1 if the directory is full */
+    int            dirfree;
+
+    /* spinlock protecting the inode lock table */
+    spinlock_t     slock;
+
+    /* locks of the inodes in use */
+    tfs_inodelock_t inodelock[TFS_INODE_LOCKS];
 } tfs_t;
 
+/* Whether a fileid can be an inode block number, that is, it is
+   neither a system block nor outside the volume */
+#define TFS_VALID_FILEID(tfs, fileid) \
+    ((uint32_t)(fileid) >= (tfs)->dirstart + (tfs)->dirblocks && \
+     (uint32_t)(fileid) < (tfs)->totalblocks)
+
+/* Blocks reserved for a file being created. The blocks are reserved
+   as runs of contiguous blocks, one run at a time, and handed out in
+   order, so that the blocks of the file follow each other on disk. */
+typedef struct {
+    /* next reserved block and the number of reserved blocks left in
+       the current run */
+    uint32_t next;
+    uint32_t count;
+
+    /* number of blocks which are still to be reserved */
+    uint32_t left;
+} tfs_extent_t;
+
+
+/**
+ * Locks an inode. Any number of threads may hold the lock of an
+ * inode shared, but only one exclusively. Sleeps until the lock is
+ * available. New shared lockers wait while an exclusive locker is
+ * waiting, so that a stream of readers cannot starve the writers.
+ *
+ * @param tfs The filesystem
+ * @param inode Block number of the inode
+ * @param exclusive Whether the file is modified or removed
+ *
+ * @return The lock, which is given to tfs_inode_unlock.
+ */
+static tfs_inodelock_t *tfs_inode_lock(tfs_t *tfs, uint32_t inode,
+				       int exclusive)
+{
+    interrupt_status_t intr_status;
+    tfs_inodelock_t *lock = NULL;
+    tfs_inodelock_t *unused = NULL;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    for(i=0; i<TFS_INODE_LOCKS; i++) {
+	if(tfs->inodelock[i].users == 0) {
+	    if(unused == NULL)
+		unused = &tfs->inodelock[i];
+	} else if(tfs->inodelock[i].inode == inode) {
+	    lock = &tfs->inodelock[i];
+	    break;
+	}
+    }
+
+    if(lock == NULL) {
+	KERNEL_ASSERT(unused != NULL);
+	lock = unused;
+	lock->inode   = inode;
+	lock->readers = 0;
+	lock->writer  = 0;
+	lock->writers_waiting = 0;
+    }
+    lock->users++;
+
+    if(exclusive) {
+	lock->writers_waiting++;
+	while(lock->writer || lock->readers > 0) {
+	    sleepq_add(lock);
+	    spinlock_release(&tfs->slock);
+	    thread_switch();
+	    spinlock_acquire(&tfs->slock);
+	}
+	lock->writers_waiting--;
+	lock->writer = 1;
+    } else {
+	while(lock->writer || lock->writers_waiting > 0) {
+	    sleepq_add(lock);
+	    spinlock_release(&tfs->slock);
+	    thread_switch();
+	    spinlock_acquire(&tfs->slock);
+	}
+	lock->readers++;
+    }
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+    return lock;
+}
+
+/**
+ * Unlocks an inode locked with tfs_inode_lock and wakes up the
+ * threads waiting for it.
+ *
+ * @param tfs The filesystem
+ * @param lock The lock
+ */
+static void tfs_inode_unlock(tfs_t *tfs, tfs_inodelock_t *lock)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&tfs->slock);
+
+    if(lock->writer)
+	lock->writer = 0;
+    else
+	lock->readers--;
+
+    lock->users--;
+    if(lock->users > 0)
+	sleepq_wake_all(lock);
+
+    spinlock_release(&tfs->slock);
+    _interrupt_set_state(intr_status);
+}
+
+
+/**
+ * Returns an entry of the in-memory directory.
+ *
+ * @param tfs The filesystem
+ * @param index Index of the entry
+ *
+ * @return The entry
+ */
+static tfs_dirslot_t *tfs_dir_slot(tfs_t *tfs, int index)
+{
+    return &tfs->dirpage[index / TFS_DIRSLOTS_PER_PAGE]
+	[index % TFS_DIRSLOTS_PER_PAGE];
+}
+
+/**
+ * Computes the hash table index of a file name.
+ *
+ * @param name The file name
+ *
+ * @return Index of the hash chain of the name
+ */
+static int tfs_dir_hash(const char *name)
+{
+    uint32_t hash = 0;
+
+    while(*name != '\0')
+	hash = hash * 31 + (uint8_t)*name++;
+
+    return hash % TFS_DIR_HASH_SIZE;
+}
+
+/**
+ * Builds the in-memory directory from the directory blocks.
+ *
+ * @param tfs The filesystem
+ *
+ * @return 0 on success, negative if a block could not be read.
+ */
+static int tfs_dir_load(tfs_t *tfs)
+{
+    bcache_buf_t *dir;
+    tfs_direntry_t *md;
+    tfs_dirslot_t *slot;
+    int i, hash;
+
+    for(i=0; i<TFS_DIR_HASH_SIZE; i++)
+	tfs->dirhash[i] = -1;
+    tfs->dirfree = -1;
+
+    /* Backwards, so that the free list is in the order of the
+       entries. */
+    dir = NULL;
+    for(i=tfs->maxfiles-1; i>=0; i--) {
+	if(dir == NULL || i % TFS_MAX_FILES == TFS_MAX_FILES - 1) {
+	    if(dir != NULL)
+		bcache_release(dir);
+	    dir = bcache_get(tfs->disk, tfs->dirstart + i / TFS_MAX_FILES, 1);
+	    if(dir == NULL)
+		return -1;
+	}
+	md   = &((tfs_direntry_t *)dir->data)[i % TFS_MAX_FILES];
+	slot = tfs_dir_slot(tfs, i);
+
+	slot->inode = md->inode;
+	stringcopy(slot->name, md->name, TFS_FILENAME_MAX + 1);
+
+	if(md->inode == 0) {
+	    slot->next = tfs->dirfree;
+	    tfs->dirfree = i;
+	} else {
+	    hash = tfs_dir_hash(slot->name);
+	    slot->next = tfs->dirhash[hash];
+	    tfs->dirhash[hash] = i;
+	}
+    }
+
+    if(dir != NULL)
+	bcache_release(dir);
+    return 0;
+}
+
+/**
+ * Finds a file from the in-memory directory. The directory lock must
+ * be held.
+ *
+ * @param tfs The filesystem
+ * @param filename Name of the file
+ *
+ * @return Index of the directory entry of the file, -1 if there is no
+ * such file.
+ */
+static int tfs_dir_find(tfs_t *tfs, const char *filename)
+{
+    int i;
+
+    for(i = tfs->dirhash[tfs_dir_hash(filename)]; i != -1;
+	i = tfs_dir_slot(tfs, i)->next) {
+	if(stringcmp(tfs_dir_slot(tfs, i)->name, filename) == 0)
+	    return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Writes an entry of the in-memory directory to its directory block.
+ *
+ * @param tfs The filesystem
+ * @param index Index of the entry
+ *
+ * @return 0 on success, negative if the block could not be read.
+ */
+static int tfs_dir_store(tfs_t *tfs, int index)
+{
+    bcache_buf_t *dir;
+    tfs_direntry_t *md;
+    tfs_dirslot_t *slot = tfs_dir_slot(tfs, index);
+
+    dir = bcache_get(tfs->disk, tfs->dirstart + index / TFS_MAX_FILES, 1);
+    if(dir == NULL)
+	return -1;
+
+    md = &((tfs_direntry_t *)dir->data)[index % TFS_MAX_FILES];
+    md->inode = slot->inode;
+    if(slot->inode != 0)
+	stringcopy(md->name, slot->name, TFS_FILENAME_MAX);
+    else
+	md->name[0] = 0;
+
+    bcache_mark_dirty(dir);
+    bcache_release(dir);
+    return 0;
+}
+
+/**
+ * Takes the first free entry of the directory into use for a file.
+ * The directory lock must be held and the directory must not be
+ * full.
+ *
+ * @param tfs The filesystem
+ * @param filename Name of the file, at most TFS_FILENAME_MAX-1
+ * characters
+ * @param inode Inode block number of the file
+ *
+ * @return 0 on success, negative if the directory block could not be
+ * read.
+ */
+static int tfs_dir_add(tfs_t *tfs, const char *filename, uint32_t inode)
+{
+    tfs_dirslot_t *slot;
+    int index, hash;
+
+    index = tfs->dirfree;
+    KERNEL_ASSERT(index != -1);
+    slot = tfs_dir_slot(tfs, index);
+
+    slot->inode = inode;
+    stringcopy(slot->name, filename, TFS_FILENAME_MAX);
+    if(tfs_dir_store(tfs, index) < 0) {
+	slot->inode   = 0;
+	slot->name[0] = 0;
+	return -1;
+    }
+
+    tfs->dirfree = slot->next;
+    hash = tfs_dir_hash(slot->name);
+    slot->next = tfs->dirhash[hash];
+    tfs->dirhash[hash] = index;
+    return 0;
+}
+
+/**
+ * Frees an entry of the directory. The directory lock must be held.
+ *
+ * @param tfs The filesystem
+ * @param index Index of the entry
+ *
+ * @return 0 on success, negative if the directory block could not be
+ * read.
+ */
+static int tfs_dir_remove(tfs_t *tfs, int index)
+{
+    tfs_dirslot_t *slot = tfs_dir_slot(tfs, index);
+    uint32_t inode;
+    int *prev;
+
+    inode = slot->inode;
+    slot->inode = 0;
+    if(tfs_dir_store(tfs, index) < 0) {
+	slot->inode = inode;
+	return -1;
+    }
+
+    prev = &tfs->dirhash[tfs_dir_hash(slot->name)];
+    while(*prev != index) {
+	KERNEL_ASSERT(*prev != -1);
+	prev = &tfs_dir_slot(tfs, *prev)->next;
+    }
+    *prev = slot->next;
+
+    slot->name[0] = 0;
+    slot->next    = tfs->dirfree;
+    tfs->dirfree  = index;
+    return 0;
+}
+
+/**
+ * Finds free blocks starting in the given range of blocks. A run may
+ * continue past the end of the range. The directory lock must be
+ * held.
+ *
+ * @param tfs The filesystem
+ * @param from First block of the range
+ * @param to Block after the range
+ * @param want Number of contiguous free blocks wanted
+ * @param start Set to the first block of the run found
+ *
+ * @return Length of the first run of at least want free blocks,
+ * limited to want. If there is no such run, length of the longest run
+ * in the range. 0 if there are no free blocks in the range or the
+ * allocation bitmap could not be read.
+ */
+static uint32_t tfs_find_run(tfs_t *tfs, uint32_t from, uint32_t to,
+			     uint32_t want, uint32_t *start)
+{
+    bcache_buf_t *bat = NULL;
+    uint32_t block, bit;
+    uint32_t runstart = 0, runlen = 0, bestlen = 0;
+
+    for(block = from; block < tfs->totalblocks && runlen < want &&
+	    (block < to || runlen > 0); block++) {
+	bit = block % TFS2_BITMAP_BITS;
+	if(bat == NULL || bit == 0) {
+	    if(bat != NULL)
+		bcache_release(bat);
+	    bat = bcache_get(tfs->disk,
+			     TFS_ALLOCATION_BLOCK + block / TFS2_BITMAP_BITS, 1);
+	    if(bat == NULL)
+		return 0;
+	}
+
+	/* Skip the words with all blocks reserved. */
+	if(bit % 32 == 0 && block + 32 <= tfs->totalblocks &&
+	   ((uint32_t *)bat->data)[bit / 32] == 0xffffffff) {
+	    block += 31;
+	    bit = 1;
+	} else {
+	    bit = bitmap_get(bat->data, bit);
+	}
+
+	if(bit == 0) {
+	    if(runlen == 0)
+		runstart = block;
+	    runlen++;
+	} else {
+	    if(runlen > bestlen) {
+		bestlen = runlen;
+		*start  = runstart;
+	    }
+	    runlen = 0;
+	}
+    }
+
+    if(bat != NULL)
+	bcache_release(bat);
+
+    if(runlen > bestlen) {
+	bestlen = runlen;
+	*start  = runstart;
+    }
+    return MIN(bestlen, want);
+}
+
+/**
+ * Reserves a run of contiguous free blocks. A run as long as wanted
+ * is searched first from the cylinder of the goal block, starting at
+ * the goal, and then from the rest of the volume. If there is no such
+ * run, the longest run of the volume is reserved. The directory lock
+ * must be held.
+ *
+ * @param tfs The filesystem
+ * @param goal Block where the run should preferably start
+ * @param want Number of blocks wanted
+ * @param start Set to the first block of the run
+ *
+ * @return Number of blocks reserved, at most want. 0 if the volume is
+ * full or the allocation bitmap could not be read.
+ */
+static uint32_t tfs_reserve_run(tfs_t *tfs, uint32_t goal, uint32_t want,
+				uint32_t *start)
+{
+    uint32_t first = tfs->dirstart + tfs->dirblocks;
+    uint32_t cylstart, cylend;
+    uint32_t from[4], to[4];
+    uint32_t i, len, runstart, count = 0;
+    bcache_buf_t *bat;
+
+    if(goal < first || goal >= tfs->totalblocks)
+	goal = first;
+    cylstart = MAX(goal - goal % tfs->cylblocks, first);
+    cylend   = MIN(goal - goal % tfs->cylblocks + tfs->cylblocks,
+		   tfs->totalblocks);
+
+    /* The cylinder of the goal from the goal on, the start of that
+       cylinder, the rest of the volume after it and before it. */
+    from[0] = goal;     to[0] = cylend;
+    from[1] = cylstart; to[1] = goal;
+    from[2] = cylend;   to[2] = tfs->totalblocks;
+    from[3] = first;    to[3] = cylstart;
+
+    for(i=0; i<4 && count < want; i++) {
+	len = tfs_find_run(tfs, from[i], to[i], want, &runstart);
+	if(len > count) {
+	    count  = len;
+	    *start = runstart;
+	}
+    }
+
+    /* Mark the run reserved. If a bitmap block can not be read, only
+       the part of the run before it is reserved. */
+    for(i=0; i<count; ) {
+	bat = bcache_get(tfs->disk, TFS_ALLOCATION_BLOCK +
+			 (*start + i) / TFS2_BITMAP_BITS, 1);
+	if(bat == NULL)
+	    break;
+	do {
+	    bitmap_set(bat->data, (*start + i) % TFS2_BITMAP_BITS, 1);
+	    i++;
+	} while(i < count && (*start + i) % TFS2_BITMAP_BITS != 0);
+	bcache_mark_dirty(bat);
+	bcache_release(bat);
+    }
+
+    tfs->freeblocks -= i;
+    return i;
+}
+
+/**
+ * Allocates the next block for a file being created, reserving a new
+ * run of blocks when the previous one is used up. A new run is
+ * preferably started right after the previous one. The directory lock
+ * must be held.
+ *
+ * @param tfs The filesystem
+ * @param ext The blocks reserved for the file
+ *
+ * @return Number of the block, 0 if the volume is full or the
+ * allocation bitmap could not be read.
+ */
+static uint32_t tfs_alloc_block(tfs_t *tfs, tfs_extent_t *ext)
+{
+    uint32_t start;
+
+    if(ext->count == 0) {
+	if(ext->left == 0)
+	    return 0;
+	ext->count = tfs_reserve_run(tfs, ext->next, ext->left, &start);
+	if(ext->count == 0)
+	    return 0;
+	ext->next  = start;
+	ext->left -= ext->count;
+    }
+
+    ext->count--;
+    return ext->next++;
+}
+
+/**
+ * Frees a block. The directory lock must be held.
+ *
+ * @param tfs The filesystem
+ * @param block Number of the block
+ */
+static void tfs_free_block(tfs_t *tfs, uint32_t block)
+{
+    bcache_buf_t *bat;
+    uint32_t i = block / TFS2_BITMAP_BITS;
+
+    if(block >= tfs->totalblocks)
+	return;
+
+    bat = bcache_get(tfs->disk, TFS_ALLOCATION_BLOCK + i, 1);
+    if(bat == NULL) {
+	kprintf("tfs: Could not free block %d.\n", block);
+	return;
+    }
+
+    bitmap_set(bat->data, block % TFS2_BITMAP_BITS, 0);
+    bcache_mark_dirty(bat);
+    bcache_release(bat);
+
+    tfs->freeblocks++;
+}
+
+/**
+ * Frees the reserved blocks of a file being created which were not
+ * used. The directory lock must be held.
+ *
+ * @param tfs The filesystem
+ * @param ext The blocks reserved for the file
+ */
+static void tfs_extent_release(tfs_t *tfs, tfs_extent_t *ext)
+{
+    for(; ext->count > 0; ext->count--)
+	tfs_free_block(tfs, ext->next + ext->count - 1);
+}
+
+/**
+ * Counts the free blocks of the volume from the allocation bitmap.
+ *
+ * @param tfs The filesystem
+ *
+ * @return 0 on success, negative if the bitmap could not be read.
+ */
+static int tfs_count_free(tfs_t *tfs)
+{
+    bcache_buf_t *bat;
+    uint32_t i, bit, bits;
+
+    tfs->freeblocks = 0;
+    tfs->allocnext  = tfs->dirstart + tfs->dirblocks;
+
+    for(i = 0; i < tfs->bitmapblocks; i++) {
+	bat = bcache_get(tfs->disk, TFS_ALLOCATION_BLOCK + i, 1);
+	if(bat == NULL)
+	    return -1;
+
+	bits = MIN(tfs->totalblocks - i*TFS2_BITMAP_BITS, TFS2_BITMAP_BITS);
+	for(bit = 0; bit < bits; bit++) {
+	    /* Skip the words with all blocks reserved. */
+	    if(bit % 32 == 0 && ((uint32_t *)bat->data)[bit / 32] == 0xffffffff) {
+		bit += 31;
+		continue;
+	    }
+	    if(bitmap_get(bat->data, bit) == 0)
+		tfs->freeblocks++;
+	}
+
+	bcache_release(bat);
+    }
+
+    return 0;
+}
+
+/**
+ * Reads a block pointer from an indirect block.
+ *
+ * @param tfs The filesystem
+ * @param block Number of the indirect block
+ * @param n Index of the pointer
+ *
+ * @return The block pointer, 0 if the block could not be read.
+ */
+static uint32_t tfs_indirect_get(tfs_t *tfs, uint32_t block, uint32_t n)
+{
+    bcache_buf_t *ind;
+    uint32_t ptr;
+
+    if(block == 0)
+	return 0;
+
+    ind = bcache_get(tfs->disk, block, 1);
+    if(ind == NULL)
+	return 0;
+
+    ptr = ((uint32_t *)ind->data)[n];
+    bcache_release(ind);
+    return ptr;
+}
+
+/**
+ * Allocates a block for an indirect block, or for a block pointed to
+ * by an indirect block. The indirect block is allocated first if it
+ * does not exist yet, so that it precedes the blocks it points to on
+ * disk. The directory lock must be held.
+ *
+ * @param tfs The filesystem
+ * @param block Pointer to the number of the indirect block, which is
+ * zero if it does not exist
+ * @param n Index of the pointer
+ * @param ext The blocks reserved for the file
+ *
+ * @return The block allocated and recorded in the indirect block, 0 if
+ * a block could not be allocated or read.
+ */
+static uint32_t tfs_indirect_alloc(tfs_t *tfs, uint32_t *block, uint32_t n,
+				   tfs_extent_t *ext)
+{
+    bcache_buf_t *ind;
+    uint32_t ptr;
+
+    if(*block == 0) {
+	*block = tfs_alloc_block(tfs, ext);
+	if(*block == 0)
+	    return 0;
+	ind = bcache_get(tfs->disk, *block, 0);
+	memoryset(ind->data, 0, TFS_BLOCK_SIZE);
+    } else {
+	ind = bcache_get(tfs->disk, *block, 1);
+	if(ind == NULL)
+	    return 0;
+    }
+
+    ptr = tfs_alloc_block(tfs, ext);
+    ((uint32_t *)ind->data)[n] = ptr;
+    bcache_mark_dirty(ind);
+    bcache_release(ind);
+    return ptr;
+}
+
+/**
+ * Frees an indirect block and the blocks it points to.
+ *
+ * @param tfs The filesystem
+ * @param block Number of the indirect block
+ * @param depth 1 for a single and 2 for a double indirect block
+ */
+static void tfs_indirect_free(tfs_t *tfs, uint32_t block, int depth)
+{
+    bcache_buf_t *ind;
+    uint32_t i, ptr;
+
+    ind = bcache_get(tfs->disk, block, 1);
+    if(ind != NULL) {
+	for(i=0; i<TFS2_POINTERS; i++) {
+	    ptr = ((uint32_t *)ind->data)[i];
+	    if(ptr == 0)
+		continue;
+	    if(depth > 1)
+		tfs_indirect_free(tfs, ptr, depth - 1);
+	    else
+		tfs_free_block(tfs, ptr);
+	}
+	bcache_release(ind);
+    } else {
+	kprintf("tfs: Could not read indirect block %d.\n", block);
+    }
+
+    tfs_free_block(tfs, block);
+}
+
+/**
+ * Finds the disk block containing a block of a file.
+ *
+ * @param tfs The filesystem
+ * @param node Inode of the file
+ * @param n Block number within the file
+ *
+ * @return The disk block, 0 if an indirect block could not be read.
+ */
+static uint32_t tfs_bmap(tfs_t *tfs, tfs_inode_t *node, uint32_t n)
+{
+    tfs2_inode_t *node2 = (tfs2_inode_t *)node;
+
+    if(tfs->version == 1)
+	return node->block[n];
+
+    if(n < TFS2_DIRECT_BLOCKS)
+	return node2->block[n];
+    n -= TFS2_DIRECT_BLOCKS;
+
+    if(n < TFS2_POINTERS)
+	return tfs_indirect_get(tfs, node2->indirect, n);
+    n -= TFS2_POINTERS;
+
+    return tfs_indirect_get(tfs,
+			    tfs_indirect_get(tfs, node2->dindirect,
+					     n / TFS2_POINTERS),
+			    n % TFS2_POINTERS);
+}
+
+/**
+ * Allocates the disk block containing a block of a file, allocating
+ * indirect blocks as needed. The directory lock must be held.
+ *
+ * @param tfs The filesystem
+ * @param node Inode of the file
+ * @param n Block number within the file
+ * @param ext The blocks reserved for the file
+ *
+ * @return The disk block, 0 if a block could not be allocated or
+ * read.
+ */
+static uint32_t tfs_bmap_alloc(tfs_t *tfs, tfs_inode_t *node, uint32_t n,
+			       tfs_extent_t *ext)
+{
+    tfs2_inode_t *node2 = (tfs2_inode_t *)node;
+    bcache_buf_t *dind;
+    uint32_t block;
+
+    if(tfs->version == 1) {
+	node->block[n] = tfs_alloc_block(tfs, ext);
+	return node->block[n];
+    }
+
+    if(n < TFS2_DIRECT_BLOCKS) {
+	node2->block[n] = tfs_alloc_block(tfs, ext);
+	return node2->block[n];
+    }
+    n -= TFS2_DIRECT_BLOCKS;
+
+    if(n < TFS2_POINTERS)
+	return tfs_indirect_alloc(tfs, &node2->indirect, n, ext);
+    n -= TFS2_POINTERS;
+
+    /* Make sure the double indirect block exists, then allocate
+       through the indirect block it points to. */
+    if(node2->dindirect == 0) {
+	node2->dindirect = tfs_alloc_block(tfs, ext);
+	if(node2->dindirect == 0)
+	    return 0;
+	dind = bcache_get(tfs->disk, node2->dindirect, 0);
+	memoryset(dind->data, 0, TFS_BLOCK_SIZE);
+    } else {
+	dind = bcache_get(tfs->disk, node2->dindirect, 1);
+	if(dind == NULL)
+	    return 0;
+    }
+
+    block = tfs_indirect_alloc(tfs,
+			       &((uint32_t *)dind->data)[n / TFS2_POINTERS],
+			       n % TFS2_POINTERS, ext);
+    bcache_mark_dirty(dind);
+    bcache_release(dind);
+    return block;
+}
+
+/**
+ * Frees the blocks of a file, including indirect blocks but not the
+ * inode. The directory lock must be held.
+ *
+ * @param tfs The filesystem
+ * @param node Inode of the file
+ */
+static void tfs_free_blocks(tfs_t *tfs, tfs_inode_t *node)
+{
+    tfs2_inode_t *node2 = (tfs2_inode_t *)node;
+    uint32_t i;
+
+    if(tfs->version == 1) {
+	for(i=0; i<TFS_BLOCKS_MAX && node->block[i] != 0; i++)
+	    tfs_free_block(tfs, node->block[i]);
+	return;
+    }
+
+    for(i=0; i<TFS2_DIRECT_BLOCKS && node2->block[i] != 0; i++)
+	tfs_free_block(tfs, node2->block[i]);
+    if(node2->indirect != 0)
+	tfs_indirect_free(tfs, node2->indirect, 1);
+    if(node2->dindirect != 0)
+	tfs_indirect_free(tfs, node2->dindirect, 2);
+}
+
+/**
+ * Computes the number of blocks needed for a file, including the
+ * inode and indirect blocks.
+ *
+ * @param tfs The filesystem
+ * @param numblocks Number of data blocks of the file
+ *
+ * @return Number of blocks needed
+ */
+static uint32_t tfs_blocks_needed(tfs_t *tfs, uint32_t numblocks)
+{
+    uint32_t needed = 1 + numblocks;
+
+    if(tfs->version == 1 || numblocks <= TFS2_DIRECT_BLOCKS)
+	return needed;
+    numblocks -= TFS2_DIRECT_BLOCKS;
+
+    /* single indirect block */
+    needed++;
+    if(numblocks <= TFS2_POINTERS)
+	return needed;
+    numblocks -= TFS2_POINTERS;
+
+    /* double indirect block and the indirect blocks it points to */
+    return needed + 1 + (numblocks + TFS2_POINTERS - 1) / TFS2_POINTERS;
+}
+
+/**
+ * Frees the memory of the filesystem.
+ *
+ * @param fs The filesystem
+ */
+static void tfs_free_memory(fs_t *fs)
+{
+    tfs_t *tfs = (tfs_t *)fs->internal;
+    uint32_t i;
+
+    for(i=0; i<TFS_DIR_PAGES; i++) {
+	if(tfs->dirpage[i] != NULL)
+	    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)tfs->dirpage[i]));
+    }
+    semaphore_destroy(tfs->dirlock);
+    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)fs));
+}
 
 /** 
  * Initialize trivial filesystem. Allocates 1 page of memory dynamically for
- * filesystem data structure, tfs data structure and buffers needed.
+ * filesystem data structure and tfs data structure, and pages for the
+ * directory. Both version 1 and version 2 volumes are recognized.
  * Sets fs_t and tfs_t fields. If initialization is succesful, returns
  * pointer to fs_t data structure. Else NULL pointer is returned.
  *
@@ -90,16 +1019,59 @@ typedef struct {
 fs_t * tfs_init(gbd_t *disk) 
 {
     uint32_t addr;
-    gbd_request_t req;
+    bcache_buf_t *header;
+    tfs2_header_t *hdr;
     char name[TFS_VOLUMENAME_MAX];
     fs_t *fs;
     tfs_t *tfs;
-    int r;
     semaphore_t *sem;
+    int version, i;
+    uint32_t totalblocks, bitmapblocks, dirblocks;
 
     if(disk->block_size(disk) != TFS_BLOCK_SIZE)
 	return NULL;
 
+    KERNEL_ASSERT(TFS_BLOCK_SIZE <= BCACHE_BLOCK_SIZE);
+
+    /* Read header block, and make sure this is tfs drive */
+    header = bcache_get(disk, TFS_HEADER_BLOCK, 1);
+    if(header == NULL) {
+	kprintf("tfs_init: Error during disk read. Initialization failed.\n");
+	return NULL; 
+    }
+    hdr = (tfs2_header_t *)header->data;
+
+    if(hdr->magic == TFS_MAGIC) {
+	/* Version 1 volumes have a fixed layout. */
+	version      = 1;
+	totalblocks  = MIN(disk->total_blocks(disk), 8*TFS_BLOCK_SIZE);
+	bitmapblocks = 1;
+	dirblocks    = 1;
+    } else if(hdr->magic == TFS2_MAGIC) {
+	version      = 2;
+	totalblocks  = MIN(disk->total_blocks(disk), hdr->totalblocks);
+	bitmapblocks = hdr->bitmapblocks;
+	dirblocks    = hdr->dirblocks;
+
+	if(bitmapblocks * TFS2_BITMAP_BITS < totalblocks ||
+	   dirblocks == 0 || dirblocks > TFS2_DIR_BLOCKS_MAX ||
+	   totalblocks < TFS_ALLOCATION_BLOCK + bitmapblocks + dirblocks) {
+	    kprintf("tfs_init: Invalid version 2 header.\n");
+	    bcache_release(header);
+	    bcache_invalidate(disk);
+	    return NULL;
+	}
+    } else {
+	/* Not ours, so do not keep the header cached. */
+	bcache_release(header);
+	bcache_invalidate(disk);
+	return NULL;
+    }
+
+    /* Copy volume name from header block. */
+    stringcopy(name, hdr->volumename, TFS_VOLUMENAME_MAX);
+    bcache_release(header);
+
     /* check semaphore availability before memory allocation */
     sem = semaphore_create(1);
     if (sem == NULL) {
@@ -117,47 +1089,55 @@ fs_t * tfs_init(gbd_t *disk)
 
 
     /* Assert that one page is enough */
-    KERNEL_ASSERT(PAGE_SIZE >= (3*TFS_BLOCK_SIZE+sizeof(tfs_t)+sizeof(fs_t)));
-    
-    /* Read header block, and make sure this is tfs drive */
-    req.block = 0;
-    req.sem = NULL;
-    req.buf = ADDR_KERNEL_TO_PHYS(addr);   /* disk needs physical addr */
-    r = disk->read_block(disk, &req);
-    if(r == 0) {
-        semaphore_destroy(sem);
-	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
-	kprintf("tfs_init: Error during disk read. Initialization failed.\n");
-	return NULL; 
-    }
-
-    if(((uint32_t *)addr)[0] != TFS_MAGIC) {
-        semaphore_destroy(sem);
-	pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
-	return NULL;
-    }
-
-    /* Copy volume name from header block. */
-    stringcopy(name, (char *)(addr+4), TFS_VOLUMENAME_MAX);
+    KERNEL_ASSERT(PAGE_SIZE >= (sizeof(tfs_t)+sizeof(fs_t)));
 
-    /* fs_t, tfs_t and all buffers in tfs_t fit in one page, so obtain
-       addresses for each structure and buffer inside the allocated
-       memory page. */
+    /* fs_t and tfs_t fit in one page, so obtain addresses for each
+       structure inside the allocated memory page. */
     fs  = (fs_t *)addr;
     tfs = (tfs_t *)(addr + sizeof(fs_t));
-    tfs->buffer_inode = (tfs_inode_t *)((uint32_t)tfs + sizeof(tfs_t));
-    tfs->buffer_bat  = (bitmap_t *)((uint32_t)tfs->buffer_inode + 
-				    TFS_BLOCK_SIZE);
-    tfs->buffer_md   = (tfs_direntry_t *)((uint32_t)tfs->buffer_bat + 
-					TFS_BLOCK_SIZE);
 
-    tfs->totalblocks = MIN(disk->total_blocks(disk), 8*TFS_BLOCK_SIZE);
-    tfs->disk        = disk;
+    fs->internal = (void *)tfs;
+
+    tfs->totalblocks  = totalblocks;
+    tfs->disk         = disk;
+    tfs->version      = version;
+    tfs->bitmapblocks = bitmapblocks;
+    tfs->dirstart     = TFS_ALLOCATION_BLOCK + bitmapblocks;
+    tfs->dirblocks    = dirblocks;
+    tfs->maxfiles     = dirblocks * TFS_MAX_FILES;
+    tfs->maxblocks    = (version == 1) ? TFS_BLOCKS_MAX : TFS2_BLOCKS_MAX;
+
+    /* Without the geometry of the disk, consider the blocks one
+       bitmap block covers to be close to each other. */
+    tfs->cylblocks    = 0;
+    if(disk->blocks_per_cylinder != NULL)
+	tfs->cylblocks = disk->blocks_per_cylinder(disk);
+    if(tfs->cylblocks == 0)
+	tfs->cylblocks = TFS2_BITMAP_BITS;
 
     /* save the semaphore to the tfs_t */
-    tfs->lock = sem;
+    tfs->dirlock = sem;
+    spinlock_reset(&tfs->slock);
+    memoryset(tfs->inodelock, 0, sizeof(tfs->inodelock));
+
+    /* Keep the directory in memory. */
+    memoryset(tfs->dirpage, 0, sizeof(tfs->dirpage));
+    for(i=0; i * (int)TFS_DIRSLOTS_PER_PAGE < tfs->maxfiles; i++) {
+	addr = pagepool_get_phys_page();
+	if(addr == 0) {
+	    tfs_free_memory(fs);
+	    kprintf("tfs_init: could not allocate memory.\n");
+	    return NULL;
+	}
+	tfs->dirpage[i] = (tfs_dirslot_t *)ADDR_PHYS_TO_KERNEL(addr);
+    }
+
+    if(tfs_dir_load(tfs) < 0 || tfs_count_free(tfs) < 0) {
+	tfs_free_memory(fs);
+	kprintf("tfs_init: Error during disk read. Initialization failed.\n");
+	return NULL;
+    }
 
-    fs->internal = (void *)tfs;
     stringcopy(fs->volume_name, name, VFS_NAME_LENGTH);
 
     fs->unmount = tfs_unmount;
@@ -168,6 +1148,7 @@ fs_t * tfs_init(gbd_t *disk)
     fs->read    = tfs_read;
     fs->write   = tfs_write;
     fs->getfree  = tfs_getfree;
+    fs->readahead = tfs_readahead;
 
     return fs;
 }
@@ -176,7 +1157,8 @@ fs_t * tfs_init(gbd_t *disk)
 /**
  * Unmounts tfs filesystem from gbd device. After this TFS-driver and
  * gbd-device are no longer linked together. Implements
- * fs.unmount(). Waits for the current operation(s) to finish, frees
+ * fs.unmount(). Waits for the current operation(s) to finish, writes
+ * back and drops the blocks of the device in the buffer cache, frees
  * reserved memory and returns OK.
  *
  * @param fs Pointer to fs data structure of the device.
@@ -189,20 +1171,23 @@ int tfs_unmount(fs_t *fs)
 
     tfs = (tfs_t *)fs->internal;
 
-    semaphore_P(tfs->lock); /* The semaphore should be free at this
+    semaphore_P(tfs->dirlock); /* The semaphore should be free at this
       point, we get it just in case something has gone wrong. */
 
+    if(bcache_flush(tfs->disk) < 0)
+	kprintf("tfs_unmount: Some blocks could not be written.\n");
+    bcache_invalidate(tfs->disk);
+
     /* free semaphore and allocated memory */
-    semaphore_destroy(tfs->lock);
-    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)fs));
+    tfs_free_memory(fs);
     return VFS_OK;
 }
 
 
 /**
- * Opens file. Implements fs.open(). Reads directory block of tfs
- * device and finds given file. Returns file's inode block number or
- * VFS_NOT_FOUND, if file not found.
+ * Opens file. Implements fs.open(). Finds given file from the
+ * in-memory directory, so no disk I/O is needed. Returns file's inode
+ * block number or VFS_NOT_FOUND, if file not found.
  * 
  * @param fs Pointer to fs data structure of the device.
  * @param filename Name of the file to be opened.
@@ -213,33 +1198,19 @@ int tfs_unmount(fs_t *fs)
 int tfs_open(fs_t *fs, char *filename)
 {
     tfs_t *tfs;
-    gbd_request_t req;
-    uint32_t i;
-    int r;
+    int index;
+    int fileid = VFS_NOT_FOUND;
 
     tfs = (tfs_t *)fs->internal;
 
-    semaphore_P(tfs->lock);
-    
-    req.block     = TFS_DIRECTORY_BLOCK;
-    req.buf       = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem       = NULL;
-    r = tfs->disk->read_block(tfs->disk,&req);
-    if(r == 0) {
-	/* An error occured during read. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
+    semaphore_P(tfs->dirlock);
 
-    for(i=0;i < TFS_MAX_FILES;i++) {
-	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    semaphore_V(tfs->lock);
-	    return tfs->buffer_md[i].inode;
-	}
-    }
-    
-    semaphore_V(tfs->lock);
-    return VFS_NOT_FOUND;
+    index = tfs_dir_find(tfs, filename);
+    if(index != -1)
+	fileid = tfs_dir_slot(tfs, index)->inode;
+
+    semaphore_V(tfs->dirlock);
+    return fileid;
 }
 
 
@@ -263,9 +1234,10 @@ int tfs_close(fs_t *fs, int fileid)
 
 /**
  * Creates file of given size. Implements fs.create(). Checks that
- * file name doesn't allready exist in directory block.Allocates
- * enough blocks from the allocation block for the file (1 for inode
- * and then enough for the file of given size). Reserved blocks are zeroed.
+ * file name doesn't allready exist in directory. Allocates enough
+ * blocks from the allocation bitmap for the file (1 for inode, then
+ * enough for the file of given size, and on version 2 volumes the
+ * indirect blocks). Reserved blocks are zeroed.
  *
  * @param fs Pointer to fs data structure of the device.
  * @param filename File name of the file to be created
@@ -277,135 +1249,81 @@ int tfs_close(fs_t *fs, int fileid)
 int tfs_create(fs_t *fs, char *filename, int size) 
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
-    uint32_t i;
+    bcache_buf_t *inode, *data;
+    tfs_inode_t *node;
+    uint32_t i, block;
     uint32_t numblocks = (size + TFS_BLOCK_SIZE - 1)/TFS_BLOCK_SIZE; 
-    int index = -1;
-    int r;
+    uint32_t inodeblock;
+    tfs_extent_t ext;
+    char name[TFS_FILENAME_MAX];
 
-    semaphore_P(tfs->lock);
-
-    if(numblocks > (TFS_BLOCK_SIZE / 4 - 1)) {
-	semaphore_V(tfs->lock);
+    if(size < 0)
 	return VFS_ERROR;
-    }
-    
-    /* Read directory block. Check that file doesn't allready exist and
-       there is space left for the file in directory block. */
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
-
-    for(i=0;i<TFS_MAX_FILES;i++) {
-	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
-	}
 
-	if(tfs->buffer_md[i].inode == 0) {
-	    /* found free slot from directory */
-	    index = i;
-	}
-    }
+    semaphore_P(tfs->dirlock);
 
-    if(index == -1) {
-	/* there was no space in directory, because index is not set */
-	semaphore_V(tfs->lock);
+    if(numblocks > tfs->maxblocks ||
+       tfs_blocks_needed(tfs, numblocks) > tfs->freeblocks) {
+	semaphore_V(tfs->dirlock);
 	return VFS_ERROR;
     }
-
-    stringcopy(tfs->buffer_md[index].name,filename, TFS_FILENAME_MAX);
-
-    /* Read allocation block and... */
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
+    
+    /* Names are stored truncated, so check the truncated name. Check
+       that file doesn't allready exist and there is space left for
+       the file in directory. */
+    stringcopy(name, filename, TFS_FILENAME_MAX);
+    if(tfs_dir_find(tfs, name) != -1 || tfs->dirfree == -1) {
+	semaphore_V(tfs->dirlock);
 	return VFS_ERROR;
     }
 
-
-    /* ...find space for inode... */
-    tfs->buffer_md[index].inode = bitmap_findnset(tfs->buffer_bat,
-						  tfs->totalblocks);
-    if((int)tfs->buffer_md[index].inode == -1) {
-	semaphore_V(tfs->lock);
+    /* Reserve the blocks of the file as contiguous runs, starting
+       after the previously created file. The inode comes first, so
+       that the data follows it on the same cylinder if there is room. */
+    ext.next  = tfs->allocnext;
+    ext.count = 0;
+    ext.left  = tfs_blocks_needed(tfs, numblocks);
+
+    inodeblock = tfs_alloc_block(tfs, &ext);
+    if(inodeblock == 0) {
+	tfs_extent_release(tfs, &ext);
+	semaphore_V(tfs->dirlock);
 	return VFS_ERROR;
     }
 
-    /* ...and the rest of the blocks. Mark found block numbers in
-       inode.*/
-    tfs->buffer_inode->filesize = size;
+    /* Mark the block numbers in inode. The inode is written
+       completely, so it is not read. */
+    inode = bcache_get(tfs->disk, inodeblock, 0);
+    node  = (tfs_inode_t *)inode->data;
+    memoryset(node, 0, TFS_BLOCK_SIZE);
+    node->filesize = size;
     for(i=0; i<numblocks; i++) {
-	tfs->buffer_inode->block[i] = bitmap_findnset(tfs->buffer_bat,
-						      tfs->totalblocks);
-	if((int)tfs->buffer_inode->block[i] == -1) {
-	    /* Disk full. No free block found. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
-	}
-    }
-    
-    /* Mark rest of the blocks in inode as unused. */
-    while(i < (TFS_BLOCK_SIZE / 4 - 1))
-	tfs->buffer_inode->block[i++] = 0;
-
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
+	block = tfs_bmap_alloc(tfs, node, i, &ext);
+	if(block == 0)
+	    break;
 
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
+	/* Write zeros to the reserved block. */
+	data = bcache_get(tfs->disk, block, 0);
+	memoryset(data->data, 0, TFS_BLOCK_SIZE);
+	bcache_mark_dirty(data);
+	bcache_release(data);
     }
 
-    req.block = tfs->buffer_md[index].inode;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r==0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
+    /* The allocation bitmap could not be read or the directory could
+       not be written. Free what was allocated. */
+    tfs_extent_release(tfs, &ext);
+    if(i < numblocks || tfs_dir_add(tfs, name, inodeblock) < 0) {
+	tfs_free_blocks(tfs, node);
+	tfs_free_block(tfs, inodeblock);
+	bcache_release(inode);
+	semaphore_V(tfs->dirlock);
 	return VFS_ERROR;
     }
 
-    /* Write zeros to the reserved blocks. Buffer for allocation block
-       is no longer needed, so lets use it as zero buffer. */ 
-    memoryset(tfs->buffer_bat, 0, TFS_BLOCK_SIZE);
-    for(i=0;i<numblocks;i++) {
-	req.block = tfs->buffer_inode->block[i];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-	req.sem   = NULL;
-	r = tfs->disk->write_block(tfs->disk, &req);
-	if(r==0) {
-	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
-	}
-       
-    }
-
-    semaphore_V(tfs->lock);
+    tfs->allocnext = ext.next;
+    bcache_mark_dirty(inode);
+    bcache_release(inode);
+    semaphore_V(tfs->dirlock);
     return VFS_OK;
 }
 
@@ -422,101 +1340,166 @@ int tfs_create(fs_t *fs, char *filename, int size)
 int tfs_remove(fs_t *fs, char *filename) 
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
-    uint32_t i;
-    int index = -1;
-    int r;
+    bcache_buf_t *inode;
+    tfs_inodelock_t *lock;
+    uint32_t inodeblock;
+    int index;
 
-    semaphore_P(tfs->lock);
+    semaphore_P(tfs->dirlock);
 
-    /* Find file and inode block number from directory block.
+    /* Find file and inode block number from directory.
        If not found return VFS_NOT_FOUND. */
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
-
-    for(i=0;i<TFS_MAX_FILES;i++) {
-	if(stringcmp(tfs->buffer_md[i].name, filename) == 0) {
-	    index = i;
-	    break;
-	}
-    }
+    index = tfs_dir_find(tfs, filename);
     if(index == -1) {
-	semaphore_V(tfs->lock);
+	semaphore_V(tfs->dirlock);
 	return VFS_NOT_FOUND;
     }
+    inodeblock = tfs_dir_slot(tfs, index)->inode;
 
-    /* Read allocation block of the device and inode block of the file.
-       Free reserved blocks (marked in inode) from allocation block. */
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
+    /* Wait for the reads and writes of the file to finish. */
+    lock = tfs_inode_lock(tfs, inodeblock, 1);
 
-    req.block = tfs->buffer_md[index].inode;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
+    inode = bcache_get(tfs->disk, inodeblock, 1);
+    if(inode == NULL || tfs_dir_remove(tfs, index) < 0) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	if(inode != NULL)
+	    bcache_release(inode);
+	tfs_inode_unlock(tfs, lock);
+	semaphore_V(tfs->dirlock);
 	return VFS_ERROR;
     }
 
+    /* Free reserved blocks (marked in inode) from allocation
+       bitmap. */
+    tfs_free_blocks(tfs, (tfs_inode_t *)inode->data);
+    tfs_free_block(tfs, inodeblock);
 
-    bitmap_set(tfs->buffer_bat,tfs->buffer_md[index].inode,0);
-    i=0;
-    while(tfs->buffer_inode->block[i] != 0 && 
-	  i < (TFS_BLOCK_SIZE / 4 - 1)) {
-	bitmap_set(tfs->buffer_bat,tfs->buffer_inode->block[i],0);
-	i++;
-    }
-    
-    /* Free directory entry. */ 
-    tfs->buffer_md[index].inode   = 0;
-    tfs->buffer_md[index].name[0] = 0;
-    
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
+    bcache_release(inode);
+    tfs_inode_unlock(tfs, lock);
+    semaphore_V(tfs->dirlock);
+    return VFS_OK;
+}
 
-    req.block = TFS_DIRECTORY_BLOCK;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_md);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
+/**
+ * Waits for all transfers of a batch to complete.
+ *
+ * @param batch The batch
+ */
+static void tfs_batch_wait(tfs_batch_t *batch)
+{
+    int i;
+
+    for(i=0; i<batch->count; i++)
+	semaphore_P(batch->sem);
+
+    for(i=0; i<batch->count; i++) {
+	if(batch->req[i].return_value != 0)
+	    batch->error = 1;
     }
 
-    semaphore_V(tfs->lock);
-    return VFS_OK;
+    batch->count = 0;
+}
+
+/**
+ * Starts a transfer of a whole block directly between the disk and
+ * the buffer. The transfers of a batch run in parallel and are waited
+ * for together with tfs_batch_wait. If the batch has no semaphore,
+ * the transfer is done synchronously.
+ *
+ * @param tfs The filesystem
+ * @param batch The batch
+ * @param block Block number
+ * @param buffer The buffer, for which TFS_DIRECT_IO holds
+ * @param write Whether the block is written instead of read
+ */
+static void tfs_batch_add(tfs_t *tfs, tfs_batch_t *batch, uint32_t block,
+			  void *buffer, int write)
+{
+    gbd_request_t *req;
+    int r;
+
+    if(batch->count == TFS_BATCH_SIZE)
+	tfs_batch_wait(batch);
+
+    req = &batch->req[batch->count];
+    req->block = block;
+    req->buf   = ADDR_KERNEL_TO_PHYS((uint32_t)buffer);
+    req->sem   = batch->sem;
+    if(write)
+	r = tfs->disk->write_block(tfs->disk, req);
+    else
+	r = tfs->disk->read_block(tfs->disk, req);
+
+    if(r == 0)
+	batch->error = 1;
+    else if(batch->sem != NULL)
+	batch->count++;
 }
 
+/**
+ * Reads a part of a data block to the buffer through the buffer
+ * cache.
+ *
+ * @param tfs The filesystem
+ * @param block Block number of the data block
+ * @param buffer Pointer to the buffer the data is read into
+ * @param pos Start position in the block
+ * @param len Number of bytes to read
+ *
+ * @return 0 on success, negative if the block could not be read.
+ */
+static int tfs_read_block(tfs_t *tfs, uint32_t block, void *buffer,
+			  int pos, int len)
+{
+    bcache_buf_t *data;
+
+    data = bcache_get(tfs->disk, block, 1);
+    if(data == NULL)
+	return -1;
+
+    memcopy(len, buffer, (const uint8_t *)data->data + pos);
+    bcache_release(data);
+    return 0;
+}
+
+/**
+ * Writes a part of a data block from the buffer to the buffer cache.
+ * The block is written back later. Partial blocks are read before
+ * they are modified.
+ *
+ * @param tfs The filesystem
+ * @param block Block number of the data block
+ * @param buffer Pointer to the buffer the data is written from
+ * @param pos Start position in the block
+ * @param len Number of bytes to write
+ *
+ * @return 0 on success, negative if the block could not be read.
+ */
+static int tfs_write_block(tfs_t *tfs, uint32_t block, void *buffer,
+			   int pos, int len)
+{
+    bcache_buf_t *data;
+
+    data = bcache_get(tfs->disk, block, len < TFS_BLOCK_SIZE);
+    if(data == NULL)
+	return -1;
+
+    memcopy(len, (uint8_t *)data->data + pos, buffer);
+    bcache_mark_dirty(data);
+    bcache_release(data);
+    return 0;
+}
 
 /**
  * Reads at most bufsize bytes from file to the buffer starting from
  * the offset. bufsize bytes is always read if possible. Returns
  * number of bytes read. Buffer size must be atleast bufsize.
  * Implements fs.read().
+ *
+ * All reads are started before waiting for any of them. Whole blocks
+ * which are not cached are transferred by the disk directly into the
+ * buffer if it can address the buffer, other blocks are read ahead
+ * to the buffer cache and copied from there.
  * 
  * @param fs  Pointer to fs data structure of the device.
  * @param fileid Fileid of the file. 
@@ -530,113 +1513,161 @@ int tfs_remove(fs_t *fs, char *filename)
 int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
-    int b1, b2;
-    int read=0;
-    int r;
-
-    semaphore_P(tfs->lock);
+    bcache_buf_t *inode, *data;
+    tfs_inode_t *node;
+    tfs_inodelock_t *lock;
+    tfs_batch_t batch;
+    uint32_t block;
+    uint8_t *dest;
+    int b1, pos, len;
+    int read;
 
     /* fileid is blocknum so ensure that we don't read system blocks
        or outside the disk */
-    if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-	semaphore_V(tfs->lock);
+    if(!TFS_VALID_FILEID(tfs, fileid)) {
 	return VFS_ERROR;
     }
 
-    req.block = fileid;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
+    lock = tfs_inode_lock(tfs, fileid, 0);
+
+    inode = bcache_get(tfs->disk, fileid, 1);
+    if(inode == NULL) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	tfs_inode_unlock(tfs, lock);
 	return VFS_ERROR;
     }   
+    node = (tfs_inode_t *)inode->data;
 
     /* Check that offset is inside the file */
-    if(offset < 0 || offset > (int)tfs->buffer_inode->filesize) {
-	semaphore_V(tfs->lock);
+    if(offset < 0 || offset > (int)node->filesize) {
+	bcache_release(inode);
+	tfs_inode_unlock(tfs, lock);
 	return VFS_ERROR;
     }
 
     /* Read at most what is left from the file. */ 
-    bufsize = MIN(bufsize,((int)tfs->buffer_inode->filesize) - offset);
+    bufsize = MIN(bufsize,((int)node->filesize) - offset);
+
+    /* Without a semaphore the direct transfers are synchronous. */
+    batch.sem   = semaphore_create(0);
+    batch.count = 0;
+    batch.error = 0;
+
+    /* Start all reads. First and last block are special cases
+       because whole block might not be written to the buffer. */
+    for(read=0; read < bufsize; read += len) {
+	b1   = (offset + read) / TFS_BLOCK_SIZE;
+	pos  = (offset + read) % TFS_BLOCK_SIZE;
+	len  = MIN(TFS_BLOCK_SIZE - pos, bufsize - read);
+	dest = (uint8_t *)buffer + read;
+
+	block = tfs_bmap(tfs, node, b1);
+	if(block == 0) {
+	    batch.error = 1;
+	    break;
+	}
 
-    if(bufsize==0) {
-	semaphore_V(tfs->lock);
-	return 0;
+	if(len == TFS_BLOCK_SIZE && TFS_DIRECT_IO(dest)) {
+	    data = bcache_lookup(tfs->disk, block);
+	    if(data != NULL) {
+		memcopy(len, dest, data->data);
+		bcache_release(data);
+	    } else {
+		tfs_batch_add(tfs, &batch, block, dest, 0);
+	    }
+	} else {
+	    bcache_prefetch(tfs->disk, block);
+	}
     }
+    tfs_batch_wait(&batch);
 
-    /* first block to be read from the disk */
-    b1 = offset / TFS_BLOCK_SIZE;
-    
-    /* last block to be read from the disk */
-    b2 = (offset+bufsize-1) / TFS_BLOCK_SIZE;
-
-    /* Read blocks from b1 to b2. First and last are
-       special cases because whole block might not be written
-       to the buffer. */
-    req.block = tfs->buffer_inode->block[b1];
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
+    /* Copy the blocks read to the buffer cache. */
+    for(read=0; read < bufsize && !batch.error; read += len) {
+	b1   = (offset + read) / TFS_BLOCK_SIZE;
+	pos  = (offset + read) % TFS_BLOCK_SIZE;
+	len  = MIN(TFS_BLOCK_SIZE - pos, bufsize - read);
+	dest = (uint8_t *)buffer + read;
+
+	if(len == TFS_BLOCK_SIZE && TFS_DIRECT_IO(dest))
+	    continue;
+
+	block = tfs_bmap(tfs, node, b1);
+	if(block == 0 || tfs_read_block(tfs, block, dest, pos, len) < 0)
+	    batch.error = 1;
+    }
+
+    if(batch.sem != NULL)
+	semaphore_destroy(batch.sem);
+    bcache_release(inode);
+    tfs_inode_unlock(tfs, lock);
+
+    if(batch.error) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
 	return VFS_ERROR;
     }
+    return bufsize;
+}
 
-    /* Count the number of the bytes to be read from the block and
-       written to the buffer from the first block. */
-    read = MIN(TFS_BLOCK_SIZE - (offset % TFS_BLOCK_SIZE),bufsize);
-    memcopy(read,
-	    buffer,
-	    (const uint32_t *)(((uint32_t)tfs->buffer_bat) + 
-			       (offset % TFS_BLOCK_SIZE)));   
-    
-    buffer = (void *)((uint32_t)buffer + read);
-    b1++;
-    while(b1 <= b2) {
-	req.block = tfs->buffer_inode->block[b1];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-	req.sem   = NULL;
-	r = tfs->disk->read_block(tfs->disk, &req);
-	if(r == 0) {
-	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
-	}
 
-	if(b1 == b2) {
-	    /* Last block. Whole block might not be read.*/
-	    memcopy(bufsize - read,
-		    buffer,
-		    (const uint32_t *)tfs->buffer_bat);
-	    read += (bufsize - read);
-	}
-	else {
-	    /* Read whole block */
-	    memcopy(TFS_BLOCK_SIZE,
-		    buffer,
-		    (const uint32_t *)tfs->buffer_bat);
-	    read += TFS_BLOCK_SIZE;
-	    buffer = (void *)((uint32_t)buffer + TFS_BLOCK_SIZE);
-	}
-	b1++;
+
+/**
+ * Starts reading the blocks containing the given part of the file to
+ * the buffer cache in the background. Blocks already cached and
+ * blocks past the end of the file are skipped. Implements
+ * fs.readahead().
+ *
+ * @param fs  Pointer to fs data structure of the device.
+ * @param fileid Fileid of the file. 
+ * @param offset Start position of the data.
+ * @param length Number of bytes to read ahead.
+ */
+void tfs_readahead(fs_t *fs, int fileid, int offset, int length)
+{
+    tfs_t *tfs = (tfs_t *)fs->internal;
+    bcache_buf_t *inode;
+    tfs_inode_t *node;
+    tfs_inodelock_t *lock;
+    uint32_t block;
+    int b1, b2;
+
+    if(!TFS_VALID_FILEID(tfs, fileid) || offset < 0) {
+	return;
     }
 
-    semaphore_V(tfs->lock);
-    return read;
-}
+    lock = tfs_inode_lock(tfs, fileid, 0);
 
+    /* The inode was cached by the read before. */
+    inode = bcache_get(tfs->disk, fileid, 1);
+    if(inode == NULL) {
+	tfs_inode_unlock(tfs, lock);
+	return;
+    }
+    node = (tfs_inode_t *)inode->data;
+
+    length = MIN(length, (int)node->filesize - offset);
+    if(length > 0) {
+	b2 = (offset + length - 1) / TFS_BLOCK_SIZE;
+	for(b1 = offset / TFS_BLOCK_SIZE; b1 <= b2; b1++) {
+	    block = tfs_bmap(tfs, node, b1);
+	    if(block != 0)
+		bcache_prefetch(tfs->disk, block);
+	}
+    }
 
+    bcache_release(inode);
+    tfs_inode_unlock(tfs, lock);
+}
 
 /**
  * Write at most datasize bytes from buffer to the file starting from
  * the offset. datasize bytes is always written if possible. Returns
  * number of bytes written. Buffer size must be atleast datasize.
  * Implements fs.read().
+ *
+ * Whole blocks which are not cached are transferred by the disk
+ * directly from the buffer if it can address the buffer; these
+ * writes are started together and waited for once. Other blocks are
+ * written to the buffer cache and written back later.
  * 
  * @param fs  Pointer to fs data structure of the device.
  * @param fileid Fileid of the file. 
@@ -650,140 +1681,108 @@ int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
-    int b1, b2;
-    int written=0;
-    int r;
-
-    semaphore_P(tfs->lock);
+    bcache_buf_t *inode, *data;
+    tfs_inode_t *node;
+    tfs_inodelock_t *lock;
+    tfs_batch_t batch;
+    uint32_t block;
+    uint8_t *src;
+    int b1, pos, len;
+    int written;
 
     /* fileid is blocknum so ensure that we don't read system blocks
        or outside the disk */
-    if(fileid < 2 || fileid > (int)tfs->totalblocks) {
-	semaphore_V(tfs->lock);
+    if(!TFS_VALID_FILEID(tfs, fileid)) {
 	return VFS_ERROR;
     }
+
+    lock = tfs_inode_lock(tfs, fileid, 1);
  
-    req.block = fileid;
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
-    req.sem   = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
+    inode = bcache_get(tfs->disk, fileid, 1);
+    if(inode == NULL) {
 	/* An error occured. */
-	semaphore_V(tfs->lock);
+	tfs_inode_unlock(tfs, lock);
 	return VFS_ERROR;
     }
+    node = (tfs_inode_t *)inode->data;
 
     /* check that start position is inside the disk */
-    if(offset < 0 || offset > (int)tfs->buffer_inode->filesize) {
-	semaphore_V(tfs->lock);
+    if(offset < 0 || offset > (int)node->filesize) {
+	bcache_release(inode);
+	tfs_inode_unlock(tfs, lock);
 	return VFS_ERROR;
     }
 
     /* write at most the number of bytes left in the file */
-    datasize = MIN(datasize,(int)tfs->buffer_inode->filesize-offset);
-
-    if(datasize==0) {
-	semaphore_V(tfs->lock);
-	return 0;
-    }
-
-    /* first block to be written into */
-    b1 = offset / TFS_BLOCK_SIZE;
-    
-    /* last block to be written into */
-    b2 = (offset+datasize-1) / TFS_BLOCK_SIZE;
-
-    /* Write data to blocks from b1 to b2. First and last are special
-       cases because whole block might not be written. Because of possible
-       partial write, first and last block must be read before writing. 
-
-       If we write less than block size or start writing in the middle
-       of the block, read the block firts. Buffer for allocation block
-       is used because it is not needed (for allocation block) in this
-       function. */
-    written = MIN(TFS_BLOCK_SIZE - (offset % TFS_BLOCK_SIZE),datasize);
-    if(written < TFS_BLOCK_SIZE) {
-	req.block = tfs->buffer_inode->block[b1];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-	req.sem   = NULL;
-	r = tfs->disk->read_block(tfs->disk, &req);
-	if(r == 0) {
-	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
+    datasize = MIN(datasize,(int)node->filesize-offset);
+
+    /* Without a semaphore the direct transfers are synchronous. */
+    batch.sem   = semaphore_create(0);
+    batch.count = 0;
+    batch.error = 0;
+
+    /* Start the direct writes, and the reads of partially written
+       blocks. First and last are the only blocks which may be
+       partially written. */
+    for(written=0; written < datasize; written += len) {
+	b1  = (offset + written) / TFS_BLOCK_SIZE;
+	pos = (offset + written) % TFS_BLOCK_SIZE;
+	len = MIN(TFS_BLOCK_SIZE - pos, datasize - written);
+	src = (uint8_t *)buffer + written;
+
+	block = tfs_bmap(tfs, node, b1);
+	if(block == 0) {
+	    batch.error = 1;
+	    break;
 	}
-    }
 
-    memcopy(written,
-	    (uint32_t *)(((uint32_t)tfs->buffer_bat) + 
-			       (offset % TFS_BLOCK_SIZE)),
-	    buffer);   
-    
-    req.block = tfs->buffer_inode->block[b1];
-    req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem   = NULL;
-    r = tfs->disk->write_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
-
-    buffer = (void *)((uint32_t)buffer + written);
-    b1++;
-    while(b1 <= b2) {
-
-	if(b1 == b2) {
-	    /* Last block. If partial write, read the block first.
-	       Write anyway always to the beginning of the block */ 
-	    if((datasize - written)  < TFS_BLOCK_SIZE) {
-		req.block = tfs->buffer_inode->block[b1];
-		req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-		req.sem   = NULL;
-		r = tfs->disk->read_block(tfs->disk, &req);
-		if(r == 0) {
-		    /* An error occured. */
-		    semaphore_V(tfs->lock);
-		    return VFS_ERROR;
-		}
+	if(len == TFS_BLOCK_SIZE && TFS_DIRECT_IO(src)) {
+	    data = bcache_lookup(tfs->disk, block);
+	    if(data != NULL) {
+		memcopy(len, data->data, src);
+		bcache_mark_dirty(data);
+		bcache_release(data);
+	    } else {
+		tfs_batch_add(tfs, &batch, block, src, 1);
 	    }
-	    
-	    memcopy(datasize - written,
-		    (uint32_t *)tfs->buffer_bat,
-		    buffer);
-	    written = datasize;
-	}
-	else {
-	    /* Write whole block */
-	    memcopy(TFS_BLOCK_SIZE,
-		    (uint32_t *)tfs->buffer_bat,
-		    buffer);
-	    written += TFS_BLOCK_SIZE;
-	    buffer = (void *)((uint32_t)buffer + TFS_BLOCK_SIZE);
+	} else if(len < TFS_BLOCK_SIZE) {
+	    bcache_prefetch(tfs->disk, block);
 	}
+    }
 
-	req.block = tfs->buffer_inode->block[b1];
-	req.buf   = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-	req.sem   = NULL;
-	r = tfs->disk->write_block(tfs->disk, &req);
-	if(r == 0) {
-	    /* An error occured. */
-	    semaphore_V(tfs->lock);
-	    return VFS_ERROR;
-	}
+    /* Write the rest to the buffer cache while the disk works. */
+    for(written=0; written < datasize && !batch.error; written += len) {
+	b1  = (offset + written) / TFS_BLOCK_SIZE;
+	pos = (offset + written) % TFS_BLOCK_SIZE;
+	len = MIN(TFS_BLOCK_SIZE - pos, datasize - written);
+	src = (uint8_t *)buffer + written;
+
+	if(len == TFS_BLOCK_SIZE && TFS_DIRECT_IO(src))
+	    continue;
 
-	b1++;
+	block = tfs_bmap(tfs, node, b1);
+	if(block == 0 || tfs_write_block(tfs, block, src, pos, len) < 0)
+	    batch.error = 1;
     }
+    tfs_batch_wait(&batch);
 
-    semaphore_V(tfs->lock);
-    return written;
+    if(batch.sem != NULL)
+	semaphore_destroy(batch.sem);
+    bcache_release(inode);
+    tfs_inode_unlock(tfs, lock);
+
+    if(batch.error) {
+	/* An error occured. */
+	return VFS_ERROR;
+    }
+    return datasize;
 }
 
 /**
  * Get number of free bytes on the disk. Implements fs.getfree().
- * Reads allocation blocks and counts number of zeros in the bitmap.
- * Result is multiplied by the block size and returned.
+ * The free blocks are counted from the allocation bitmap at mount
+ * time and kept up to date. Result is multiplied by the block size
+ * and returned, limited to the largest int.
  *
  * @param fs Pointer to the fs data structure of the device.
  *
@@ -792,29 +1791,14 @@ int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 int tfs_getfree(fs_t *fs)
 {
     tfs_t *tfs = (tfs_t *)fs->internal;
-    gbd_request_t req;
-    int allocated = 0;
-    uint32_t i;
-    int r;
+    uint32_t freeblocks;
 
-    semaphore_P(tfs->lock);
+    semaphore_P(tfs->dirlock);
+    freeblocks = tfs->freeblocks;
+    semaphore_V(tfs->dirlock);
 
-    req.block = TFS_ALLOCATION_BLOCK;
-    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_bat);
-    req.sem = NULL;
-    r = tfs->disk->read_block(tfs->disk, &req);
-    if(r == 0) {
-	/* An error occured. */
-	semaphore_V(tfs->lock);
-	return VFS_ERROR;
-    }
-
-    for(i=0;i<tfs->totalblocks;i++) {
-	allocated += bitmap_get(tfs->buffer_bat,i);
-    }
-    
-    semaphore_V(tfs->lock);
-    return (tfs->totalblocks - allocated)*TFS_BLOCK_SIZE;
+    freeblocks = MIN(freeblocks, 0x7fffffff / TFS_BLOCK_SIZE);
+    return freeblocks * TFS_BLOCK_SIZE;
 }
 
 /** @} */
@@ -99,6 +99,72 @@ typedef struct {
 
 #define TFS_MAX_FILES (TFS_BLOCK_SIZE/sizeof(tfs_direntry_t))
 
+
+/* TFS version 2. The header block is followed by a multi-block
+   allocation bitmap starting from TFS_ALLOCATION_BLOCK, and that by a
+   multi-block directory. Files are described by inodes with direct,
+   single indirect and double indirect block pointers. Version 1
+   volumes are recognized by TFS_MAGIC and version 2 volumes by
+   TFS2_MAGIC. */
+#define TFS2_MAGIC 3746
+
+/* Number of blocks whose allocation one bitmap block records */
+#define TFS2_BITMAP_BITS (8*TFS_BLOCK_SIZE)
+
+/* Maximum number of directory blocks */
+#define TFS2_DIR_BLOCKS_MAX 16
+
+/* Number of block pointers in an indirect block */
+#define TFS2_POINTERS (TFS_BLOCK_SIZE/sizeof(uint32_t))
+
+/* Number of block pointers in the inode itself. The filesize and the
+   two indirect block pointers take the rest of the inode. */
+#define TFS2_DIRECT_BLOCKS (TFS2_POINTERS-3)
+
+/* Maximum number of data blocks of a file and the maximum file size.
+   With 512-byte blocks a file can have 16637 blocks, 8518144 bytes. */
+#define TFS2_BLOCKS_MAX (TFS2_DIRECT_BLOCKS + TFS2_POINTERS + \
+			 TFS2_POINTERS*TFS2_POINTERS)
+#define TFS2_MAX_FILESIZE (TFS_BLOCK_SIZE*TFS2_BLOCKS_MAX)
+
+/* Header block of a version 2 volume. */
+typedef struct {
+    /* TFS2_MAGIC */
+    uint32_t magic;
+
+    /* Volume name, at the same place as on a version 1 volume */
+    char     volumename[TFS_VOLUMENAME_MAX];
+
+    /* Number of blocks in the volume */
+    uint32_t totalblocks;
+
+    /* Number of allocation bitmap blocks, enough for totalblocks
+       bits */
+    uint32_t bitmapblocks;
+
+    /* Number of directory blocks following the bitmap, at most
+       TFS2_DIR_BLOCKS_MAX. Each holds TFS_MAX_FILES entries. */
+    uint32_t dirblocks;
+} tfs2_header_t;
+
+/* Version 2 inode. The first TFS2_DIRECT_BLOCKS blocks of the file
+   are listed in the inode. The indirect block lists the next
+   TFS2_POINTERS blocks, and the double indirect block lists indirect
+   blocks for the rest. Unused pointers are zero. */
+typedef struct {
+    /* filesize in bytes */
+    uint32_t filesize;
+
+    /* block numbers of the first blocks of the file */
+    uint32_t block[TFS2_DIRECT_BLOCKS];
+
+    /* single indirect block */
+    uint32_t indirect;
+
+    /* double indirect block */
+    uint32_t dindirect;
+} tfs2_inode_t;
+
 /* functions */
 fs_t * tfs_init(gbd_t *disk);
 
@@ -110,6 +176,7 @@ int tfs_remove(fs_t *fs, char *filename);
 int tfs_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset);
 int tfs_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset);
 int tfs_getfree(fs_t *fs);
+void tfs_readahead(fs_t *fs, int fileid, int offset, int length);
 
 
 #endif    /* FS_TFS_H */
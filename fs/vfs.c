@@ -42,6 +42,8 @@
 #include "drivers/device.h"
 #include "fs/tfs.h"
 #include "fs/filesystems.h"
+#include "fs/bcache.h"
+#include "vm/swap.h"
 
 /** @name Virtual Filesystem
  *
@@ -70,8 +72,24 @@ typedef struct {
 
     /* Current seek position in the file. */
     int seek_position;
+
+    /* Offset where the next read starts if the file is read
+       sequentially. */
+    int readahead_next;
+
+    /* Number of bytes read ahead of sequential reads, sized by how
+       long the file has been read sequentially. Zero until the file
+       is found to be read sequentially. */
+    int readahead_window;
+
+    /* End of the data already read ahead. */
+    int readahead_end;
 } openfile_entry_t;
 
+/* Limits of the read ahead window in bytes */
+#define VFS_READAHEAD_MIN 2048
+#define VFS_READAHEAD_MAX 16384
+
 
 /* Table of mounted filesystems. */
 static struct {
@@ -143,6 +161,8 @@ void vfs_init(void)
     vfs_ops = 0;
     vfs_usable = 1;
 
+    bcache_init();
+
     kprintf("VFS: Max filesystems: %d, Max open files: %d\n", 
 	    CONFIG_MAX_FILESYSTEMS, CONFIG_MAX_OPEN_FILES);
 }
@@ -252,6 +272,10 @@ void vfs_mount_all(void)
     int i;
     device_t *dev;
 
+    /* Threads can be run now, so the buffer cache can start
+       writing back modified blocks. */
+    bcache_start();
+
     for(i=0; i<CONFIG_MAX_FILESYSTEMS; i++) {
 	dev = device_get(YAMS_TYPECODE_DISK, i);
 	if(dev == NULL) {
@@ -266,6 +290,11 @@ void vfs_mount_all(void)
 			"skipping\n");
 		continue;
 	    }
+
+	    /* The swap disk holds no filesystem. */
+	    if(gbd == swap_get_disk()) {
+		continue;
+	    }
 	    
 	    vfs_mount_fs(gbd, NULL);
 	}
@@ -582,6 +611,9 @@ openfile_t vfs_open(char *pathname)
 
     openfile_table.files[file].fileid = fileid;
     openfile_table.files[file].seek_position = 0;
+    openfile_table.files[file].readahead_next = 0;
+    openfile_table.files[file].readahead_window = 0;
+    openfile_table.files[file].readahead_end = 0;
 
     vfs_end_op();
     return file;
@@ -674,6 +706,41 @@ int vfs_seek(openfile_t file, int seek_position)
 }
 
 
+/**
+ * Identifies the file behind an open file. The filesystem and the
+ * filesystem specific file ID together name the file uniquely as
+ * long as it is open, no matter how many times it has been opened.
+ *
+ * @param file Open file
+ *
+ * @param filesystem The filesystem of the file is returned here
+ *
+ * @param fileid The file ID of the file is returned here
+ *
+ * @return VFS_OK on success, negative (VFS_*) on error.
+ *
+ */
+
+int vfs_fileid(openfile_t file, fs_t **filesystem, int *fileid)
+{
+    openfile_entry_t *openfile;
+
+    if (vfs_start_op() != VFS_OK)
+        return VFS_UNUSABLE;
+
+    semaphore_P(openfile_table.sem);
+
+    openfile = vfs_verify_open(file);
+    *filesystem = openfile->filesystem;
+    *fileid = openfile->fileid;
+
+    semaphore_V(openfile_table.sem);
+
+    vfs_end_op();
+    return VFS_OK;
+}
+
+
 /**
  * Reads at most bufsize bytes from given open file to given buffer.
  * The read is started from current seek position and after read, the
@@ -694,7 +761,10 @@ int vfs_read(openfile_t file, void *buffer, int bufsize)
 {
     openfile_entry_t *openfile;
     fs_t *fs;
+    int offset;
     int ret;
+    int start = 0;
+    int end = 0;
 
     if (vfs_start_op() != VFS_OK)
         return VFS_UNUSABLE;
@@ -704,13 +774,37 @@ int vfs_read(openfile_t file, void *buffer, int bufsize)
 
     KERNEL_ASSERT(bufsize >= 0 && buffer != NULL);
 
-    ret = fs->read(fs, openfile->fileid, buffer, bufsize, 
-			openfile->seek_position);
+    offset = openfile->seek_position;
+    ret = fs->read(fs, openfile->fileid, buffer, bufsize, offset);
 
     if(ret > 0) {
         semaphore_P(openfile_table.sem);
 	openfile->seek_position += ret;
+
+	/* The hits on the blocks read ahead are not counted.
+	   Sequential access is used as a proxy for the hit rate
+	   instead: a read continuing where the previous one ended
+	   uses the data read ahead, so the window grows. Other reads
+	   make it useless and stop the read ahead. */
+	if(offset == openfile->readahead_next) {
+	    openfile->readahead_window = 
+		MIN(MAX(2 * openfile->readahead_window, VFS_READAHEAD_MIN),
+		    VFS_READAHEAD_MAX);
+	} else {
+	    openfile->readahead_window = 0;
+	    openfile->readahead_end = 0;
+	}
+	openfile->readahead_next = offset + ret;
+
+	/* Read ahead only what has not been read ahead yet. */
+	start = MAX(offset + ret, openfile->readahead_end);
+	end   = offset + ret + openfile->readahead_window;
+	if(start < end)
+	    openfile->readahead_end = end;
         semaphore_V(openfile_table.sem);
+
+	if(start < end && fs->readahead != NULL)
+	    fs->readahead(fs, openfile->fileid, start, end - start);
     }
 
     vfs_end_op();
@@ -888,5 +982,25 @@ int vfs_getfree(char *filesystem)
     return ret;
 }
 
+/**
+ * Writes all modified blocks of all filesystems to the disks.
+ *
+ * @return VFS_OK on success, VFS_ERROR if some block could not be
+ * written.
+ */
+int vfs_sync(void)
+{
+    int ret = VFS_OK;
+
+    if (vfs_start_op() != VFS_OK)
+        return VFS_UNUSABLE;
+
+    if (bcache_flush(NULL) < 0)
+        ret = VFS_ERROR;
+
+    vfs_end_op();
+    return ret;
+}
+
 /** @} */
 
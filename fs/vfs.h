@@ -134,6 +134,14 @@ typedef struct fs_struct{
 
        Returns the number of free bytes, negative values are errors. */
     int (*getfree)(struct fs_struct *fs);
+
+    /* Function pointer to a function which starts reading length
+       bytes from the given offset of the given (open) file into
+       memory in the background, because they are about to be read.
+       The data is not returned. NULL if the filesystem does not read
+       ahead. */
+    void (*readahead)(struct fs_struct *fs, int fileid, int offset,
+                      int length);
 } fs_t;
 
 
@@ -148,11 +156,13 @@ int vfs_unmount(char *name);
 openfile_t vfs_open(char *pathname);
 int vfs_close(openfile_t file);
 int vfs_seek(openfile_t file, int seek_position);
+int vfs_fileid(openfile_t file, fs_t **filesystem, int *fileid);
 int vfs_read(openfile_t file, void *buffer, int bufsize);
 int vfs_write(openfile_t file, void *buffer, int datasize);
 
 int vfs_create(char *pathname, int size);
 int vfs_remove(char *pathname);
 int vfs_getfree(char *filesystem);
+int vfs_sync(void);
 
 #endif
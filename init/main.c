@@ -39,6 +39,7 @@
 #include "drivers/gcd.h"
 #include "drivers/metadev.h"
 #include "drivers/polltty.h"
+#include "drivers/timer.h"
 #include "drivers/yams.h"
 #include "fs/vfs.h"
 #include "kernel/assert.h"
@@ -56,6 +57,95 @@
 #include "net/network.h"
 #include "proc/process.h"
 #include "vm/vm.h"
+#include "vm/pagepool.h"
+
+/* Bytes copied or set on each round of the memcopy benchmark, and the
+   number of rounds */
+#define INIT_MEMTEST_BYTES 4000
+#define INIT_MEMTEST_ROUNDS 16
+
+/**
+ * Copies bytes one at a time, like memcopy did before it copied whole
+ * words. The reference for the memcopy benchmark.
+ */
+static void init_bytecopy(int buflen, char *target, const char *source)
+{
+    int i;
+
+    for (i = 0; i < buflen; i++)
+        target[i] = source[i];
+}
+
+/**
+ * Sets bytes one at a time, the reference for memoryset.
+ */
+static void init_byteset(char *target, char value, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        target[i] = value;
+}
+
+/**
+ * Measures memcopy and memoryset against byte loops with differently
+ * aligned buffers, printing the speed of both in bytes per 100 CPU
+ * cycles.
+ */
+static void init_test_memcopy(void)
+{
+    /* Offsets of the target and the source from a word boundary */
+    static const int offsets[][2] = { {0, 0}, {1, 1}, {0, 1}, {2, 3} };
+    uint32_t src_page, dst_page;
+    char *src, *dst;
+    uint32_t start, bytes, fast;
+    unsigned int i;
+    int round;
+
+    src_page = pagepool_get_phys_page();
+    dst_page = pagepool_get_phys_page();
+    KERNEL_ASSERT(src_page != 0 && dst_page != 0);
+
+    bytes = INIT_MEMTEST_BYTES * INIT_MEMTEST_ROUNDS * 100;
+
+    for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        dst = (char *)ADDR_PHYS_TO_KERNEL(dst_page) + offsets[i][0];
+        src = (char *)ADDR_PHYS_TO_KERNEL(src_page) + offsets[i][1];
+
+        start = timer_get_ticks();
+        for (round = 0; round < INIT_MEMTEST_ROUNDS; round++)
+            memcopy(INIT_MEMTEST_BYTES, dst, src);
+        fast = timer_get_ticks() - start;
+
+        start = timer_get_ticks();
+        for (round = 0; round < INIT_MEMTEST_ROUNDS; round++)
+            init_bytecopy(INIT_MEMTEST_BYTES, dst, src);
+
+        kprintf("memcopy target+%d source+%d: %d bytes per 100 cycles, "
+                "byte loop %d\n", offsets[i][0], offsets[i][1],
+                bytes / (fast + 1), bytes / (timer_get_ticks() - start + 1));
+    }
+
+    for (i = 0; i < 2; i++) {
+        dst = (char *)ADDR_PHYS_TO_KERNEL(dst_page) + i;
+
+        start = timer_get_ticks();
+        for (round = 0; round < INIT_MEMTEST_ROUNDS; round++)
+            memoryset(dst, (char)round, INIT_MEMTEST_BYTES);
+        fast = timer_get_ticks() - start;
+
+        start = timer_get_ticks();
+        for (round = 0; round < INIT_MEMTEST_ROUNDS; round++)
+            init_byteset(dst, (char)round, INIT_MEMTEST_BYTES);
+
+        kprintf("memoryset target+%d: %d bytes per 100 cycles, "
+                "byte loop %d\n", i,
+                bytes / (fast + 1), bytes / (timer_get_ticks() - start + 1));
+    }
+
+    pagepool_free_phys_page(src_page);
+    pagepool_free_phys_page(dst_page);
+}
 
 /**
  * Fallback function for system startup. This function is executed
@@ -99,6 +189,9 @@ void init_startup_fallback(void) {
         gcd->write(gcd, buffer, len);
 
 	DEBUG("debuginit", "Console test done, %d bytes written\n", len);
+    } else if (bootargs_get("testmemcopy") != NULL) {
+        /* Run the memcopy benchmark if "testmemcopy" was given. */
+        init_test_memcopy();
     } else if (bootargs_get("testconsole_malloc") != NULL) {
       DEBUG("debug_G4", "###################33something something \n");
       int *h;
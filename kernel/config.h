@@ -106,9 +106,47 @@
  */
 #define CONFIG_MAX_GNDS 4
 
-/* Defines the number of pages allocated for userland stacks.
+/* Defines the number of pages allocated for userland stacks when a
+ * process starts. The stack grows on demand from this.
  * Range from 1 to 1000
  */
 #define CONFIG_USERLAND_STACK_SIZE 1
 
+/* Maximum number of pages a userland stack may grow to. The page
+ * below the largest stack is never mapped (guard page).
+ * Range from CONFIG_USERLAND_STACK_SIZE to 4096
+ */
+#define CONFIG_USERLAND_STACK_MAX_SIZE 256
+
+/* Maximum number of free physical pages kept zeroed in advance by
+ * the idle threads.
+ * Range from 0 to 1024
+ */
+#define CONFIG_PAGEPOOL_ZEROED_PAGES 32
+
+/* Maximum number of different executables whose read-only pages are
+ * shared between the processes running them.
+ * Range from 1 to 128
+ */
+#define CONFIG_TEXTCACHE_ENTRIES 16
+
+/* Maximum number of different files mapped with mmap at the same
+ * time.
+ * Range from 1 to 128
+ */
+#define CONFIG_PAGECACHE_ENTRIES 16
+
+/* Default number of disk blocks kept in the block buffer cache. The
+ * boot argument "bcache" overrides this.
+ * Range from 16 to 4096
+ */
+#define CONFIG_BCACHE_BUFFERS 128
+
+/* Time in milliseconds after which modified blocks in the block
+ * buffer cache are written back by the flusher thread, which sleeps
+ * this long after the first modification.
+ * Range from 0 to 60000
+ */
+#define CONFIG_BCACHE_FLUSH_DELAY 1000
+
 #endif /* BUENOS_CONFIG_H */
@@ -80,17 +80,17 @@ void kernel_exception_handle(int exception)
     _interrupt_clear_EXL();
 
     switch(exception) {
+    /* With demand paging and copy-on-write the kernel takes TLB
+       exceptions on userland buffers. Pages can be read from disk or
+       copied only if the interrupted code had interrupts enabled. */
     case EXCEPTION_TLBM:
-        print_tlb_debug();
-	tlb_modified_exception();
+	tlb_modified_exception(intr_status & INTERRUPT_MASK_MASTER);
 	break;
     case EXCEPTION_TLBL:
-        print_tlb_debug();
-	tlb_load_exception();
+	tlb_load_exception(intr_status & INTERRUPT_MASK_MASTER);
 	break;
     case EXCEPTION_TLBS:
-        print_tlb_debug();
-	tlb_store_exception();
+	tlb_store_exception(intr_status & INTERRUPT_MASK_MASTER);
 	break;
     case EXCEPTION_ADDRL:
 	print_tlb_debug();
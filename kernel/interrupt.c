@@ -42,6 +42,7 @@
 #include "kernel/interrupt.h"
 #include "drivers/polltty.h"
 #include "kernel/thread.h"
+#include "kernel/sleepq.h"
 #include "lib/libc.h"
 #include "vm/tlb.h"
 
@@ -84,11 +85,12 @@ void interrupt_init(int num_cpus) {
         interrupt_stacks[i] = ret+PAGE_SIZE-4;
     }
 
-    /* Copy the interrupt vector code to its positions.All vectors
+    /* Copy the interrupt vector code to its positions. The TLB
+     * refill vector gets its own fast handler, the other vectors
      * will contain the same code.
      */
     for(i = 0 ; i < INTERRUPT_VECTOR_LENGTH ; i++) {
-	iv_area1[i] = ((uint32_t *) &_cswitch_vector_code)[i];
+	iv_area1[i] = ((uint32_t *) &_tlb_refill_vector_code)[i];
 	iv_area2[i] = ((uint32_t *) &_cswitch_vector_code)[i];
 	iv_area3[i] = ((uint32_t *) &_cswitch_vector_code)[i];
     }
@@ -185,23 +187,13 @@ void interrupt_handle(uint32_t cause) {
     if((cause & (INTERRUPT_CAUSE_SOFTWARE_0 |
 		 INTERRUPT_CAUSE_HARDWARE_5)) ||
        scheduler_current_thread[this_cpu] == IDLE_THREAD_TID) {
+	if (cause & INTERRUPT_CAUSE_HARDWARE_5)
+	    sleepq_wake_timeouts();
+
 	scheduler_schedule();
-	
-	/* Until we have proper VM we must manually fill
-	   the TLB with pagetable entries before running code using
-	   given pagetable. Note that this method limits pagetable
-	   rows (possible mapping pairs) to 16 and can't be used
-	   with proper pagetables and VM.
-
-           Note that if you remove this call (which you probably do when
-           you implement proper VM), you must manually call _tlb_set_asid
-           here. See the implementation of tlb_fill on details how to do that.
-        */
-
-	/* The old call */
-	/*tlb_fill(thread_get_current_thread_entry()->pagetable); */
-
-	/* The new call */
-	_tlb_set_asid(thread_get_current_thread());
+
+	/* Switch to the address space of the scheduled thread. The
+	   TLB is filled on demand by the refill handler. */
+	tlb_activate(thread_get_current_thread_entry()->pagetable);
     }
 }
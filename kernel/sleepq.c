@@ -40,6 +40,7 @@
 #include "kernel/config.h"
 #include "kernel/interrupt.h"
 #include "kernel/assert.h"
+#include "drivers/metadev.h"
 
 /** @name Sleep queue
  *
@@ -53,6 +54,9 @@
  * The resources are referenced by memory address. The address is used
  * only as a key, it is never referenced by the sleep queue mechanism.
  *
+ * A sleep may also be given a timeout, after which the thread is
+ * woken by the timer interrupt even if the resource never is.
+ *
  * @{
  */
 
@@ -135,6 +139,29 @@ void sleepq_add(void *resource)
     spinlock_release(&sleepq_slock);
 }
 
+/** Adds the currently running thread into the sleep queue like
+ * sleepq_add, but wakes it up after the given time if the resource
+ * has not been woken by then. The thread cannot tell which of these
+ * woke it, so it must check again whatever it was waiting for.
+ *
+ * Note that interrupts must be disabled before calling this function.
+ *
+ * @param resource The resource to wait for
+ * @param msec Maximum time to sleep in milliseconds
+ */
+void sleepq_add_timeout(void *resource, uint32_t msec)
+{
+    uint32_t wakeup;
+
+    /* 0 means no timeout */
+    wakeup = rtc_get_msec() + msec;
+    if (wakeup == 0)
+	wakeup = 1;
+
+    thread_get_current_thread_entry()->wakeup = wakeup;
+    sleepq_add(resource);
+}
+
 /* Import prototype for unsafe function from scheduler.c */
 void scheduler_add_to_ready_list(TID_t t);
 
@@ -183,6 +210,7 @@ void sleepq_wake(void *resource)
 
 	thread_table[first].sleeps_on = 0;
 	thread_table[first].next = -1;
+	thread_table[first].wakeup = 0;
 	
 	if (thread_table[first].state == THREAD_SLEEPING) {
 	    thread_table[first].state = THREAD_READY;
@@ -248,6 +276,7 @@ void sleepq_wake_all(void *resource)
 
 	    thread_table[wake].sleeps_on = 0;
 	    thread_table[wake].next      = -1;
+	    thread_table[wake].wakeup    = 0;
 	
 	    if (thread_table[wake].state == THREAD_SLEEPING) {
 		thread_table[wake].state = THREAD_READY;
@@ -262,4 +291,64 @@ void sleepq_wake_all(void *resource)
     _interrupt_set_state(intr_state);
 }
 
+/** Wakes the threads whose sleep added with sleepq_add_timeout has
+ * timed out. They are removed from the sleep queue and placed on the
+ * scheduler's ready-to-run list. Called on every timer interrupt.
+ */
+void sleepq_wake_timeouts(void)
+{
+    uint32_t now = 0;
+    int have_now = 0;
+    interrupt_status_t intr_state;
+    TID_t t, prev;
+    uint32_t hash;
+
+    intr_state = _interrupt_disable();
+    spinlock_acquire(&sleepq_slock);
+
+    for (t=0; t<CONFIG_MAX_THREADS; t++) {
+	/* The timeout is set just before the thread is added to the
+	 * queue, so a thread not sleeping yet is left alone.
+	 */
+	if (thread_table[t].wakeup == 0 || thread_table[t].sleeps_on == 0)
+	    continue;
+
+	if (!have_now) {
+	    now = rtc_get_msec();
+	    have_now = 1;
+	}
+	if ((int32_t)(now - thread_table[t].wakeup) < 0)
+	    continue;
+
+	/* remove it from the sleep queue */
+	hash = SLEEPQ_HASH(thread_table[t].sleeps_on);
+	prev = sleepq_hashtable[hash];
+	if (prev == t) {
+	    sleepq_hashtable[hash] = thread_table[t].next;
+	} else {
+	    while (prev > 0 && thread_table[prev].next != t) {
+		prev = thread_table[prev].next;
+	    }
+	    KERNEL_ASSERT(prev > 0);
+	    thread_table[prev].next = thread_table[t].next;
+	}
+
+	spinlock_acquire(&thread_table_slock);
+
+	thread_table[t].sleeps_on = 0;
+	thread_table[t].next      = -1;
+	thread_table[t].wakeup    = 0;
+
+	if (thread_table[t].state == THREAD_SLEEPING) {
+	    thread_table[t].state = THREAD_READY;
+	    scheduler_add_to_ready_list(t);
+	}
+
+	spinlock_release(&thread_table_slock);
+    }
+
+    spinlock_release(&sleepq_slock);
+    _interrupt_set_state(intr_state);
+}
+
 /** @} */
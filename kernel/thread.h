@@ -76,9 +76,12 @@ typedef struct {
     process_id_t process_id;
     /* pointer to the next thread in list (<0 = end of list) */
     TID_t next; 
+    /* time in msec when the sleep times out (0 for none), see
+       sleepq_add_timeout */
+    uint32_t wakeup;
 
     /* pad to 64 bytes */
-    uint32_t dummy_alignment_fill[9]; 
+    uint32_t dummy_alignment_fill[8]; 
 } thread_table_t;
 
 /* function prototypes */
@@ -168,7 +168,14 @@ char *stringcopy(char *target, const char *source, int buflen)
 
 /**
  * Copies memory buffer of size buflen from source to target. The
- * target buffer should be at least buflen long.
+ * target buffer should be at least buflen long. The buffers should not
+ * overlap.
+ *
+ * The target is first aligned to a word boundary, after which whole
+ * words are copied, eight at a time. If the source is not aligned the
+ * same way, each target word is merged from two aligned source words,
+ * so the copy never falls back to single bytes. The merge assumes a
+ * big-endian CPU, like the rest of the kernel.
  *
  * @param buflen The number of bytes to be copied.
  *
@@ -179,46 +186,62 @@ char *stringcopy(char *target, const char *source, int buflen)
  */
 void memcopy(int buflen, void *target, const void *source)
 {
-    int i;
-    char *t;
-    const char *s;
+    uint8_t *t = (uint8_t *)target;
+    const uint8_t *s = (const uint8_t *)source;
     uint32_t *tgt;
     const uint32_t *src;
+    uint32_t w0, w1;
+    int shift;
+    int words;
+    int i;
 
-    tgt = (uint32_t *) target;
-    src = (uint32_t *) source;
-
-    if(((uint32_t)tgt % 4) != 0 || ((uint32_t)src % 4) != 0 ) {
-	t = (char *)tgt;
-	s = (const char *)src;
-	
-	for(i = 0; i < buflen; i++) {
-	    t[i] = s[i];
-	}
-
-	return;
+    /* Align the target. */
+    while (buflen > 0 && ((uint32_t)t % 4) != 0) {
+        *t++ = *s++;
+        buflen--;
     }
 
-    for(i = 0; i < (buflen/4); i++) {
-        *tgt = *src;
-	tgt++;
-	src++;
+    tgt = (uint32_t *)t;
+    words = buflen / 4;
+
+    if (((uint32_t)s % 4) == 0) {
+        src = (const uint32_t *)s;
+        for (i = words; i >= 8; i -= 8) {
+            w0 = src[0]; w1 = src[1]; tgt[0] = w0; tgt[1] = w1;
+            w0 = src[2]; w1 = src[3]; tgt[2] = w0; tgt[3] = w1;
+            w0 = src[4]; w1 = src[5]; tgt[4] = w0; tgt[5] = w1;
+            w0 = src[6]; w1 = src[7]; tgt[6] = w0; tgt[7] = w1;
+            tgt += 8;
+            src += 8;
+        }
+        for (; i > 0; i--)
+            *tgt++ = *src++;
+    } else if (words > 0) {
+        /* Each target word is the end of one aligned source word and
+           the beginning of the next. Only words containing copied
+           bytes are read. */
+        shift = 8 * ((uint32_t)s % 4);
+        src = (const uint32_t *)((uint32_t)s & ~3);
+        w0 = *src++;
+        for (i = words; i > 0; i--) {
+            w1 = *src++;
+            *tgt++ = (w0 << shift) | (w1 >> (32 - shift));
+            w0 = w1;
+        }
     }
-    
 
-    t = (char *)tgt;
-    s = (const char *)src;
-    
-    for(i = 0; i < (buflen%4); i++) {
-	t[i] = s[i];
-    }
+    t += words * 4;
+    s += words * 4;
+    buflen -= words * 4;
 
-    return;
+    while (buflen-- > 0)
+        *t++ = *s++;
 }
 
 
 /**
- * Sets size bytes in target to value.
+ * Sets size bytes in target to value. Whole words are written, eight
+ * at a time, once the target is aligned.
  *
  * @param target The target buffer of the set operation.
  *
@@ -229,12 +252,31 @@ void memcopy(int buflen, void *target, const void *source)
  */
 void memoryset(void *target, char value, int size)
 {
-    int i;
-    char *tgt;
+    uint8_t *tgt = (uint8_t *)target;
+    uint32_t *words;
+    uint32_t word;
+
+    while (size > 0 && ((uint32_t)tgt % 4) != 0) {
+        *tgt++ = value;
+        size--;
+    }
+
+    word = (uint8_t)value;
+    word |= word << 8;
+    word |= word << 16;
+
+    words = (uint32_t *)tgt;
+    for (; size >= 32; size -= 32) {
+        words[0] = word; words[1] = word; words[2] = word; words[3] = word;
+        words[4] = word; words[5] = word; words[6] = word; words[7] = word;
+        words += 8;
+    }
+    for (; size >= 4; size -= 4)
+        *words++ = word;
 
-    tgt = (char *)target;
-    for(i = 0; i < size; i++)
-        tgt[i] = value;
+    tgt = (uint8_t *)words;
+    while (size-- > 0)
+        *tgt++ = value;
 }
 
 /** Converts the initial portion of a string to an integer
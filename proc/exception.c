@@ -40,6 +40,7 @@
 #include "kernel/thread.h"
 #include "kernel/exception.h"
 #include "vm/tlb.h"
+#include "proc/process.h"
 
 void syscall_handle(context_t *user_context);
 
@@ -71,15 +72,19 @@ void user_exception_handle(int exception)
 
     switch(exception) {
     case EXCEPTION_TLBM:
-      tlb_modified_exception();
+      tlb_modified_exception(1);
 	break;
     case EXCEPTION_TLBL:
-      tlb_load_exception();
+      tlb_load_exception(1);
 	break;
     case EXCEPTION_TLBS:
-      tlb_store_exception();
+      tlb_store_exception(1);
 	break;
     case EXCEPTION_ADDRL:
+        /* The function started by fork returned. */
+        if (my_entry->user_context->pc == PROCESS_FORK_RETURN) {
+            process_finish(0);
+        }
 	KERNEL_PANIC("Address Error Load: not handled yet");
 	break;
     case EXCEPTION_ADDRS:
@@ -0,0 +1,375 @@
+/*
+ * Page cache for file mappings
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "proc/pagecache.h"
+#include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "kernel/semaphore.h"
+#include "fs/vfs.h"
+#include "drivers/yams.h"
+#include "vm/pagepool.h"
+#include "vm/swap.h"
+
+/** @name Page cache
+ *
+ * The page cache holds the pages of files mapped with mmap. All
+ * processes mapping the same file share one entry and thus the same
+ * physical pages, so writes through one mapping are seen by the
+ * others. Pages are read from the file on the first access and
+ * written back when the last mapping of the file is gone. The cache
+ * holds one reference to each page and every mapping another one.
+ *
+ * The spinlock protects the table and the page lists, so that pages
+ * can be looked up with interrupts disabled. The semaphore serializes
+ * the file I/O and the creation and destruction of entries.
+ *
+ * @{
+ */
+
+/* Page is dirty, stored in the low bits of the physical address */
+#define PAGECACHE_DIRTY 1
+
+typedef struct {
+    /* Filesystem of the file, NULL if the entry is free */
+    fs_t *filesystem;
+    /* Filesystem specific file ID of the file */
+    int fileid;
+    /* The file, kept open for reading and writing back pages */
+    openfile_t file;
+    /* Number of mappings of the file */
+    int refcount;
+    /* Page holding the physical addresses of the cached pages, zero
+       for pages not read yet, with PAGECACHE_DIRTY set for pages
+       which have been written */
+    uint32_t index_page;
+} pagecache_entry_t;
+
+static pagecache_entry_t pagecache_table[CONFIG_PAGECACHE_ENTRIES];
+
+static spinlock_t pagecache_slock;
+
+static semaphore_t *pagecache_sem;
+
+/**
+ * Initializes the page cache.
+ */
+void pagecache_init(void)
+{
+    int i;
+
+    spinlock_reset(&pagecache_slock);
+    pagecache_sem = semaphore_create(1);
+    KERNEL_ASSERT(pagecache_sem != NULL);
+
+    for (i = 0; i < CONFIG_PAGECACHE_ENTRIES; i++)
+        pagecache_table[i].filesystem = NULL;
+}
+
+/**
+ * Finds the page cache entry of a file, creating it if the file is
+ * not mapped yet. The caller gets a reference to the entry, which is
+ * given back with pagecache_release.
+ *
+ * @param pathname Name of the file
+ *
+ * @return The page cache entry, or negative if the file does not
+ * exist or the cache is full.
+ */
+int pagecache_get(char *pathname)
+{
+    interrupt_status_t intr_status;
+    fs_t *filesystem;
+    openfile_t file;
+    uint32_t index_page;
+    int fileid;
+    int entry = -1;
+    int i;
+
+    file = vfs_open(pathname);
+    if (file < 0)
+        return -1;
+
+    if (vfs_fileid(file, &filesystem, &fileid) != VFS_OK) {
+        vfs_close(file);
+        return -1;
+    }
+
+    semaphore_P(pagecache_sem);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    for (i = 0; i < CONFIG_PAGECACHE_ENTRIES; i++) {
+        if (pagecache_table[i].filesystem == filesystem &&
+            pagecache_table[i].fileid == fileid) {
+            pagecache_table[i].refcount++;
+            entry = i;
+            break;
+        }
+        if (entry < 0 && pagecache_table[i].filesystem == NULL)
+            entry = i;
+    }
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+
+    if (i < CONFIG_PAGECACHE_ENTRIES) {
+        /* The entry has a file handle of its own already. */
+        vfs_close(file);
+    } else if (entry >= 0) {
+        index_page = pagepool_get_zeroed_page();
+        if (index_page != 0) {
+            intr_status = _interrupt_disable();
+            spinlock_acquire(&pagecache_slock);
+
+            pagecache_table[entry].fileid     = fileid;
+            pagecache_table[entry].file       = file;
+            pagecache_table[entry].refcount   = 1;
+            pagecache_table[entry].index_page = index_page;
+            pagecache_table[entry].filesystem = filesystem;
+
+            spinlock_release(&pagecache_slock);
+            _interrupt_set_state(intr_status);
+        } else {
+            vfs_close(file);
+            entry = -1;
+        }
+    } else {
+        vfs_close(file);
+    }
+
+    semaphore_V(pagecache_sem);
+
+    return entry;
+}
+
+/**
+ * Takes another reference to a page cache entry, for a mapping copied
+ * by fork.
+ *
+ * @param entry The page cache entry
+ */
+void pagecache_ref(int entry)
+{
+    interrupt_status_t intr_status;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_PAGECACHE_ENTRIES);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    KERNEL_ASSERT(pagecache_table[entry].refcount > 0);
+    pagecache_table[entry].refcount++;
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Gives back a reference to a page cache entry. When the last mapping
+ * of the file is gone, the dirty pages are written back to the file
+ * and the entry is freed. The file is not extended: the parts of the
+ * pages past the end of the file are not written. The caller must be
+ * able to sleep and the mappings must already be removed.
+ *
+ * @param entry The page cache entry
+ */
+void pagecache_release(int entry)
+{
+    interrupt_status_t intr_status;
+    pagecache_entry_t *cache;
+    uint32_t *pages;
+    uint32_t count = 0;
+    uint32_t i;
+    int last;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_PAGECACHE_ENTRIES);
+    cache = &pagecache_table[entry];
+
+    semaphore_P(pagecache_sem);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    KERNEL_ASSERT(cache->refcount > 0);
+    last = (--cache->refcount == 0);
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+
+    if (!last) {
+        semaphore_V(pagecache_sem);
+        return;
+    }
+
+    /* No mappings are left, so the pages can no longer change and
+       nobody finds the entry while the semaphore is held. */
+    pages = (uint32_t *)ADDR_PHYS_TO_KERNEL(cache->index_page);
+    for (i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        if (pages[i] == 0)
+            continue;
+        if (pages[i] & PAGECACHE_DIRTY) {
+            pages[i] &= PAGE_SIZE_MASK;
+            if (vfs_seek(cache->file, i * PAGE_SIZE) != VFS_OK ||
+                vfs_write(cache->file,
+                          (void *)ADDR_PHYS_TO_KERNEL(pages[i]),
+                          PAGE_SIZE) < 0) {
+                kprintf("Pagecache: Writing back page %d failed\n", i);
+            }
+        }
+        pages[count++] = pages[i];
+    }
+    pagepool_free_phys_pages(pages, count);
+    pagepool_free_phys_page(cache->index_page);
+    vfs_close(cache->file);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+    cache->filesystem = NULL;
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+
+    semaphore_V(pagecache_sem);
+}
+
+/**
+ * Finds a page of a file in the page cache, reading it from the file
+ * if it is not cached yet. The part of the page past the end of the
+ * file is zero. The caller gets a reference to the page, which is
+ * normally given to the mapping of the page.
+ *
+ * @param entry The page cache entry
+ *
+ * @param index Index of the page in the file
+ *
+ * @param may_sleep Whether the page may be read from the file
+ *
+ * @return Physical address of the page, 0 if it could not be read.
+ */
+uint32_t pagecache_get_page(int entry, uint32_t index, int may_sleep)
+{
+    interrupt_status_t intr_status;
+    pagecache_entry_t *cache;
+    uint32_t *pages;
+    uint32_t phys_page;
+    uint32_t new_page;
+    int ret;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_PAGECACHE_ENTRIES);
+    KERNEL_ASSERT(index < PAGECACHE_MAX_PAGES);
+    cache = &pagecache_table[entry];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    pages = (uint32_t *)ADDR_PHYS_TO_KERNEL(cache->index_page);
+    phys_page = pages[index] & PAGE_SIZE_MASK;
+    if (phys_page != 0)
+        pagepool_ref_phys_page(phys_page);
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+
+    if (phys_page != 0 || !may_sleep)
+        return phys_page;
+
+    new_page = swap_get_page(1);
+    if (new_page == 0)
+        return 0;
+
+    intr_status = _interrupt_enable();
+    semaphore_P(pagecache_sem);
+    ret = vfs_seek(cache->file, index * PAGE_SIZE);
+    if (ret == VFS_OK) {
+        ret = vfs_read(cache->file, (void *)ADDR_PHYS_TO_KERNEL(new_page),
+                       PAGE_SIZE);
+    }
+    semaphore_V(pagecache_sem);
+    _interrupt_set_state(intr_status);
+
+    if (ret < 0) {
+        pagepool_free_phys_page(new_page);
+        return 0;
+    }
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    /* Another process may have read the page meanwhile. */
+    phys_page = pages[index] & PAGE_SIZE_MASK;
+    if (phys_page == 0) {
+        pages[index] = new_page;
+        phys_page = new_page;
+    }
+    /* One reference for the cache or the caller */
+    pagepool_ref_phys_page(phys_page);
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+
+    if (phys_page != new_page)
+        pagepool_free_phys_page(new_page);
+
+    return phys_page;
+}
+
+/**
+ * Marks a cached page written, so that it is written back to the file.
+ *
+ * @param entry The page cache entry
+ *
+ * @param index Index of the page in the file
+ */
+void pagecache_set_dirty(int entry, uint32_t index)
+{
+    interrupt_status_t intr_status;
+    uint32_t *pages;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_PAGECACHE_ENTRIES);
+    KERNEL_ASSERT(index < PAGECACHE_MAX_PAGES);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagecache_slock);
+
+    pages = (uint32_t *)ADDR_PHYS_TO_KERNEL(pagecache_table[entry].index_page);
+    KERNEL_ASSERT(pages[index] != 0);
+    pages[index] |= PAGECACHE_DIRTY;
+
+    spinlock_release(&pagecache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/** @} */
@@ -36,6 +36,8 @@
 
 #include "proc/process.h"
 #include "proc/elf.h"
+#include "proc/textcache.h"
+#include "proc/pagecache.h"
 #include "kernel/thread.h"
 #include "kernel/assert.h"
 #include "kernel/interrupt.h"
@@ -44,7 +46,10 @@
 #include "drivers/yams.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
+#include "vm/tlb.h"
+#include "vm/swap.h"
 #include "kernel/sleepq.h"
+#include "lib/debug.h"
 
 
 /** @name Process startup
@@ -71,6 +76,9 @@ void process_init()
     spinlock_reset(&process_table_slock);
     for (i = 0; i <= PROCESS_MAX_PROCESSES; ++i)
         process_reset(i);
+
+    textcache_init();
+    pagecache_init();
 }
 
 /* Find a free slot in the process table. Returns PROCESS_MAX_PROCESSES
@@ -112,13 +120,10 @@ void process_start(process_id_t pid)
 {
     thread_table_t *my_entry;
     pagetable_t *pagetable;
-    uint32_t phys_page;
     context_t user_context;
-    uint32_t stack_bottom;
     elf_info_t elf;
     openfile_t file;
     char *executable;
-
     int i;
 
     interrupt_status_t intr_status;
@@ -132,15 +137,14 @@ void process_start(process_id_t pid)
        This is not possible. */
     KERNEL_ASSERT(my_entry->pagetable == NULL);
 
-    pagetable = vm_create_pagetable(thread_get_current_thread());
+    pagetable = vm_create_pagetable();
     KERNEL_ASSERT(pagetable != NULL);
 
     intr_status = _interrupt_disable();
     my_entry->pagetable = pagetable;
 
-    /* Update TLB to allow access to the virtual addresses of the
-       segments. */
-    _tlb_set_asid(thread_get_current_thread());
+    /* Switch to the address space of the process. */
+    tlb_activate(pagetable);
 
     _interrupt_set_state(intr_status);
 
@@ -152,107 +156,901 @@ void process_start(process_id_t pid)
     /* Trivial and naive sanity check for entry point: */
     KERNEL_ASSERT(elf.entry_point >= PAGE_SIZE);
 
-    /* Calculate the number of pages needed by the whole process
-       (including userland stack). Since we don't have proper tlb
-       handling code, all these pages must fit into TLB. */
-    KERNEL_ASSERT(elf.ro_pages + elf.rw_pages + CONFIG_USERLAND_STACK_SIZE
-            <= _tlb_get_maxindex() + 1);
-
-    /* Allocate and map stack */
-    for(i = 0; i < CONFIG_USERLAND_STACK_SIZE; i++) {
-        phys_page = pagepool_get_phys_page();
-        KERNEL_ASSERT(phys_page != 0);
-        vm_map(my_entry->pagetable, phys_page,
-                (USERLAND_STACK_TOP & PAGE_SIZE_MASK) - i*PAGE_SIZE, 1);
+    /* Segments are filled on demand by process_page_fault, so they
+       must begin at page boundary. (The linker script in tests
+       directory creates this kind of segments) */
+    KERNEL_ASSERT(elf.ro_pages == 0 || (elf.ro_vaddr >= PAGE_SIZE &&
+                                        elf.ro_vaddr % PAGE_SIZE == 0));
+    KERNEL_ASSERT(elf.rw_pages == 0 || (elf.rw_vaddr >= PAGE_SIZE &&
+                                        elf.rw_vaddr % PAGE_SIZE == 0));
+
+    process_table[pid].file = file;
+    process_table[pid].ro_segment.vaddr    = elf.ro_vaddr;
+    process_table[pid].ro_segment.pages    = elf.ro_pages;
+    process_table[pid].ro_segment.location = elf.ro_location;
+    process_table[pid].ro_segment.size     = elf.ro_size;
+    process_table[pid].rw_segment.vaddr    = elf.rw_vaddr;
+    process_table[pid].rw_segment.pages    = elf.rw_pages;
+    process_table[pid].rw_segment.location = elf.rw_location;
+    process_table[pid].rw_segment.size     = elf.rw_size;
+    process_table[pid].text = textcache_get(file, elf.ro_pages);
+    for (i = 0; i < PROCESS_MAX_MMAPS; i++)
+        process_table[pid].mmaps[i].vaddr = 0;
+    process_table[pid].zero_faults = 0;
+    process_table[pid].file_faults = 0;
+    process_table[pid].text_faults = 0;
+    memoryset(&process_table[pid].vmstat, 0, sizeof(vmstat_t));
+
+    /* The heap begins on the page after the segments (the RW segment
+       includes bss). heap_end is exclusive, so the heap is empty and
+       has no pages at first. */
+    if (elf.rw_pages > 0) {
+        process_table[pid].heap_start = elf.rw_vaddr + elf.rw_pages*PAGE_SIZE;
+    } else {
+        process_table[pid].heap_start = elf.ro_vaddr + elf.ro_pages*PAGE_SIZE;
     }
+    process_table[pid].heap_end = process_table[pid].heap_start;
 
-    /* Put the mapped pages into TLB. Here we again assume that the
-       pages fit into the TLB. After writing proper TLB exception
-       handling this call should be skipped. */
-    /*
-    intr_status = _interrupt_disable();
-    tlb_fill(my_entry->pagetable);
-    _interrupt_set_state(intr_status);*/
+    process_table[pid].stack_bottom = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) -
+        (CONFIG_USERLAND_STACK_SIZE-1)*PAGE_SIZE;
+    process_table[pid].stack_limit = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) -
+        (CONFIG_USERLAND_STACK_MAX_SIZE-1)*PAGE_SIZE;
 
-    /* Now we may use the virtual addresses of the segments. */
+    /* No pages are mapped here, the segments, the heap and the stack
+       are all filled on the first access. */
 
-    /* Allocate and map pages for the segments. We assume that
-       segments begin at page boundary. (The linker script in tests
-       directory creates this kind of segments) */
-    for(i = 0; i < (int)elf.ro_pages; i++) {
-        phys_page = pagepool_get_phys_page();
-        KERNEL_ASSERT(phys_page != 0);
-        vm_map(my_entry->pagetable, phys_page,
-                elf.ro_vaddr + i*PAGE_SIZE, 1);
+    /* Initialize the user context. (Status register is handled by
+       thread_goto_userland) */
+    memoryset(&user_context, 0, sizeof(user_context));
+    user_context.cpu_regs[MIPS_REGISTER_SP] = USERLAND_STACK_TOP;
+    user_context.pc = elf.entry_point;
+
+    thread_goto_userland(&user_context);
+
+    KERNEL_PANIC("thread_goto_userland failed.");
+}
+
+/**
+ * Finds the file mapping of a process containing the given address.
+ *
+ * @param process The process
+ *
+ * @param vaddr Userland virtual address
+ *
+ * @return The mapping, NULL if vaddr is not in any file mapping.
+ */
+static process_mmap_t *process_find_mmap(process_table_t *process,
+                                         uint32_t vaddr)
+{
+    int i;
+
+    for (i = 0; i < PROCESS_MAX_MMAPS; i++) {
+        if (process->mmaps[i].vaddr != 0 &&
+            vaddr >= process->mmaps[i].vaddr &&
+            vaddr < process->mmaps[i].vaddr +
+                    process->mmaps[i].pages * PAGE_SIZE)
+            return &process->mmaps[i];
     }
 
-    for(i = 0; i < (int)elf.rw_pages; i++) {
-        phys_page = pagepool_get_phys_page();
-        KERNEL_ASSERT(phys_page != 0);
-        vm_map(my_entry->pagetable, phys_page,
-                elf.rw_vaddr + i*PAGE_SIZE, 1);
+    return NULL;
+}
+
+/**
+ * Finds out how many bytes of the given page are stored in the
+ * executable.
+ *
+ * @param segment The segment containing the page, NULL if none
+ *
+ * @param page Virtual address of the page
+ *
+ * @return Bytes of the page stored in the executable, from the
+ * beginning of the page.
+ */
+static uint32_t process_file_bytes(process_segment_t *segment,
+                                   uint32_t page)
+{
+    if (segment == NULL || page - segment->vaddr >= segment->size)
+        return 0;
+
+    return MIN(segment->size - (page - segment->vaddr), PAGE_SIZE);
+}
+
+/**
+ * Fills a zeroed page for a page fault. The part of the page stored
+ * in the executable is read from the file, the rest is left zero.
+ * Interrupts are enabled for the read.
+ *
+ * @param process The faulting process
+ *
+ * @param segment The segment containing the page, NULL if none
+ *
+ * @param page Virtual address of the page
+ *
+ * @param phys_page The zeroed physical page to fill
+ *
+ * @return 0 on success, -1 if the file could not be read.
+ */
+static int process_read_page(process_table_t *process,
+                             process_segment_t *segment,
+                             uint32_t page, uint32_t phys_page)
+{
+    interrupt_status_t intr_status;
+    uint32_t size = process_file_bytes(segment, page);
+    int ret;
+
+    if (size == 0) {
+        process->zero_faults++;
+        return 0;
     }
 
-    /* Initialize heap pointer */
-    uint32_t heap_end = elf.rw_vaddr+elf.rw_size;
-    process_table[pid].heap_end = heap_end;
-    if (heap_end % PAGE_SIZE == 0) {
-        /* In the unlikely event that the heap should start on the 
-           first address of a page we must allocate that page. */
-        uint32_t phys_page = pagepool_get_phys_page();
-        KERNEL_ASSERT(phys_page != 0);
-        vm_map(pagetable, phys_page, heap_end, 1);
+    intr_status = _interrupt_enable();
+    ret = vfs_seek(process->file, segment->location + (page - segment->vaddr));
+    if (ret == VFS_OK) {
+        ret = vfs_read(process->file,
+                       (void *)ADDR_PHYS_TO_KERNEL(phys_page), size);
     }
+    _interrupt_set_state(intr_status);
 
-    /* Zero the pages. */
-    memoryset((void *)elf.ro_vaddr, 0, elf.ro_pages*PAGE_SIZE);
-    memoryset((void *)elf.rw_vaddr, 0, elf.rw_pages*PAGE_SIZE);
+    if (ret != (int)size)
+        return -1;
 
-    stack_bottom = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) -
-        (CONFIG_USERLAND_STACK_SIZE-1)*PAGE_SIZE;
-    memoryset((void *)stack_bottom, 0, CONFIG_USERLAND_STACK_SIZE*PAGE_SIZE);
+    process->file_faults++;
+    return 0;
+}
+
+/**
+ * Allocates a page for a page fault and fills it with
+ * process_read_page.
+ *
+ * @param process The faulting process
+ *
+ * @param segment The segment containing the page, NULL if none
+ *
+ * @param page Virtual address of the page
+ *
+ * @param may_sleep Whether interrupts may be enabled to read the file
+ *
+ * @return Physical address of the filled page, 0 on failure.
+ */
+static uint32_t process_fill_page(process_table_t *process,
+                                  process_segment_t *segment,
+                                  uint32_t page, int may_sleep)
+{
+    uint32_t phys_page;
+
+    if (process_file_bytes(segment, page) > 0 && !may_sleep)
+        return 0;
 
-    /* Copy segments */
+    if (may_sleep)
+        phys_page = swap_get_page(1);
+    else
+        phys_page = pagepool_get_zeroed_page();
+    if (phys_page == 0)
+        return 0;
 
-    if (elf.ro_size > 0) {
-        /* Make sure that the segment is in proper place. */
-        KERNEL_ASSERT(elf.ro_vaddr >= PAGE_SIZE);
-        KERNEL_ASSERT(vfs_seek(file, elf.ro_location) == VFS_OK);
-        KERNEL_ASSERT(vfs_read(file, (void *)elf.ro_vaddr, elf.ro_size)
-                == (int)elf.ro_size);
+    if (process_read_page(process, segment, page, phys_page) < 0) {
+        pagepool_free_phys_page(phys_page);
+        return 0;
     }
 
-    if (elf.rw_size > 0) {
-        /* Make sure that the segment is in proper place. */
-        KERNEL_ASSERT(elf.rw_vaddr >= PAGE_SIZE);
-        KERNEL_ASSERT(vfs_seek(file, elf.rw_location) == VFS_OK);
-        KERNEL_ASSERT(vfs_read(file, (void *)elf.rw_vaddr, elf.rw_size)
-                == (int)elf.rw_size);
+    return phys_page;
+}
+
+/**
+ * Maps the whole large page containing the given page for a page
+ * fault, if it lies within the region and none of its pages has been
+ * mapped yet. The pages are filled like with process_fill_page. Large
+ * regions thus get large pages, which need fewer TLB entries. Falls
+ * back to normal pages when no contiguous physical memory is free.
+ *
+ * @param process The faulting process
+ *
+ * @param segment The segment containing the page, NULL if none
+ *
+ * @param start Start of the writable region containing the page
+ *
+ * @param end End of the region
+ *
+ * @param page Virtual address of the faulting page
+ *
+ * @return 0 if the large page was mapped, -1 if not.
+ */
+static int process_map_large(process_table_t *process,
+                             process_segment_t *segment,
+                             uint32_t start, uint32_t end, uint32_t page)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    uint32_t base = page & ~(PAGETABLE_LARGE_SIZE - 1);
+    uint32_t phys_page;
+    pte_t *pte;
+    int i;
+
+    if (base < start || end - base < PAGETABLE_LARGE_SIZE)
+        return -1;
+
+    pte = vm_get_pte(pagetable, base);
+    for (i = 0; pte != NULL && i < PAGETABLE_LARGE_PAGES; i++) {
+        if (pte[i].V || pte[i].S || pte[i].PFN != 0)
+            return -1;
     }
 
+    phys_page = pagepool_get_phys_pages(PAGETABLE_LARGE_PAGES);
+    if (phys_page == 0)
+        return -1;
+    memoryset((void *)ADDR_PHYS_TO_KERNEL(phys_page), 0,
+              PAGETABLE_LARGE_SIZE);
 
-    /* Set the dirty bit to zero (read-only) on read-only pages. */
-    for(i = 0; i < (int)elf.ro_pages; i++) {
-        vm_set_dirty(my_entry->pagetable, elf.ro_vaddr + i*PAGE_SIZE, 0);
+    for (i = 0; i < PAGETABLE_LARGE_PAGES; i++) {
+        if (process_read_page(process, segment, base + i * PAGE_SIZE,
+                              phys_page + i * PAGE_SIZE) < 0)
+            break;
     }
 
-    /* Insert page mappings again to TLB to take read-only bits into use */
-    /*  intr_status = _interrupt_disable();
-    tlb_fill(my_entry->pagetable);
-    _interrupt_set_state(intr_status);*/
+    if (i == PAGETABLE_LARGE_PAGES &&
+        vm_map_large(pagetable, phys_page, base, 1) == 0)
+        return 0;
 
+    for (i = 0; i < PAGETABLE_LARGE_PAGES; i++)
+        pagepool_free_phys_page(phys_page + i * PAGE_SIZE);
+    return -1;
+}
+
+/**
+ * Handles a page fault of the current process. If vaddr belongs to
+ * the address space of the process, a zeroed page is mapped for it.
+ * Pages of the ELF segments are filled from the executable, the rest
+ * of the pages (bss, heap and stack) are left zero. The stack grows
+ * down on demand, up to its limit. Read-only segment
+ * pages are mapped write-protected and shared through the text cache
+ * with the other processes running the same executable. Pages of file
+ * mappings come from the page cache, write-protected until the first
+ * write marks them dirty. Pages taken away by the swap are brought
+ * back. Writable regions are mapped in large pages where they cover
+ * whole ones (see process_map_large).
+ *
+ * @param vaddr The faulting userland virtual address
+ *
+ * @param may_sleep Whether the fault may be resolved with interrupts
+ * enabled. Pages can be read from the executable or swap and evicted
+ * to swap only if this is set.
+ *
+ * @return 0 if the page was mapped, negative if vaddr is not in the
+ * address space of the process or the page could not be filled.
+ */
+int process_page_fault(uint32_t vaddr, int may_sleep)
+{
+    process_table_t *process = process_get_current_process_entry();
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    process_segment_t *segment = NULL;
+    process_mmap_t *mmap = NULL;
+    uint32_t page = vaddr & PAGE_SIZE_MASK;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    uint32_t phys_page;
+    uint32_t index = 0;
+    int dirty = 1;
+    int ret;
+
+    KERNEL_ASSERT(pagetable != NULL);
+
+    vmstat_add(VMSTAT_PAGE_FAULTS, 1);
+
+    if (page >= process->ro_segment.vaddr && page <
+        process->ro_segment.vaddr + process->ro_segment.pages*PAGE_SIZE) {
+        segment = &process->ro_segment;
+        dirty   = 0;
+    } else if (page >= process->rw_segment.vaddr && page <
+        process->rw_segment.vaddr + process->rw_segment.pages*PAGE_SIZE) {
+        segment = &process->rw_segment;
+        start   = segment->vaddr;
+        end     = segment->vaddr + segment->pages*PAGE_SIZE;
+    } else if (page >= process->heap_start &&
+               page < PROCESS_HEAP_TOP(process->heap_end)) {
+        /* Heap */
+        start = process->heap_start;
+        end   = PROCESS_HEAP_TOP(process->heap_end);
+    } else if (page >= process->stack_limit && page < USERLAND_STACK_TOP) {
+        /* Stack, grown down to this page if it is below the stack */
+        if (page < process->stack_bottom)
+            process->stack_bottom = page;
+        start = process->stack_bottom;
+        end   = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) + PAGE_SIZE;
+    } else if (page == process->stack_limit - PAGE_SIZE) {
+        kprintf("Process %d: stack overflow, limit is %d pages\n",
+                process_get_current_process(),
+                CONFIG_USERLAND_STACK_MAX_SIZE);
+        return -1;
+    } else if ((mmap = process_find_mmap(process, page)) != NULL) {
+        /* File mapping */
+    } else {
+        return -1;
+    }
+
+    ret = swap_fault(pagetable, page, may_sleep);
+    if (ret != 0)
+        return (ret > 0) ? 0 : -1;
+
+    /* Writable regions covering whole large pages get them. */
+    if (end != 0 && may_sleep &&
+        process_map_large(process, segment, start, end, page) == 0)
+        return 0;
+
+    phys_page = 0;
+    if (mmap != NULL) {
+        phys_page = pagecache_get_page(mmap->cache,
+                                       (page - mmap->vaddr) / PAGE_SIZE,
+                                       may_sleep);
+        if (phys_page == 0)
+            return -1;
+        dirty = 0;
+    } else if (segment == &process->ro_segment && process->text >= 0) {
+        index = (page - segment->vaddr) / PAGE_SIZE;
+        phys_page = textcache_get_page(process->text, index);
+        if (phys_page != 0)
+            process->text_faults++;
+    }
+
+    if (phys_page == 0) {
+        phys_page = process_fill_page(process, segment, page, may_sleep);
+        if (phys_page == 0)
+            return -1;
+
+        if (segment == &process->ro_segment && process->text >= 0)
+            phys_page = textcache_add_page(process->text, index, phys_page);
+    }
+
+    if (vm_map(pagetable, phys_page, page, dirty) != 0) {
+        pagepool_free_phys_page(phys_page);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Handles a write to a write-protected page of the current process.
+ * Pages shared by fork are copied on the first write, unless this
+ * process is the only one left using the page. Pages of file mappings
+ * are shared and marked dirty in the page cache instead. Pages of the
+ * read-only segment are never writable.
+ *
+ * @param vaddr The faulting userland virtual address
+ *
+ * @param may_sleep Whether the fault may be resolved with interrupts
+ * enabled. Pages can be copied only if this is set.
+ *
+ * @return 0 if the page is now writable, negative if the page may not
+ * be written or it could not be copied.
+ */
+int process_write_fault(uint32_t vaddr, int may_sleep)
+{
+    process_table_t *process = process_get_current_process_entry();
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    process_mmap_t *mmap;
+    uint32_t page = vaddr & PAGE_SIZE_MASK;
+    uint32_t old_page;
+    uint32_t new_page;
+    pte_t *pte;
+
+    /* The clock hand may have invalidated the page after it was
+       loaded to the TLB. */
+    pte = vm_get_pte(pagetable, page);
+    if (pte != NULL && !pte->V) {
+        if (process_page_fault(page, may_sleep) < 0)
+            return -1;
+    }
+    if (pte == NULL || !pte->V)
+        return -1;
+
+    if (page >= process->ro_segment.vaddr && page <
+        process->ro_segment.vaddr + process->ro_segment.pages*PAGE_SIZE)
+        return -1;
+
+    /* Another CPU may have already made the page writable. */
+    if (pte->D)
+        return 0;
+
+    old_page = pte->PFN << 12;
+
+    mmap = process_find_mmap(process, page);
+    if (mmap != NULL) {
+        if (!mmap->writable)
+            return -1;
+        pagecache_set_dirty(mmap->cache, (page - mmap->vaddr) / PAGE_SIZE);
+        swap_update_page(pagetable, page, old_page, old_page);
+        return 0;
+    }
+
+    if (pagepool_get_refcount(old_page) == 1) {
+        /* If the page was evicted meanwhile, the write is retried. */
+        swap_update_page(pagetable, page, old_page, old_page);
+        return 0;
+    }
+
+    if (!may_sleep)
+        return -1;
+
+    new_page = swap_get_page(0);
+    if (new_page == 0)
+        return -1;
+
+    memcopy(PAGE_SIZE, (void *)ADDR_PHYS_TO_KERNEL(new_page),
+            (void *)ADDR_PHYS_TO_KERNEL(old_page));
+
+    if (swap_update_page(pagetable, page, old_page, new_page) < 0) {
+        pagepool_free_phys_page(new_page);
+        return 0;
+    }
+
+    /* Other CPUs may still have the shared page in their TLB. It must
+       not be visible to us anymore when the other users write it. */
+    tlb_shootdown(pagetable, &page, 1);
+    pagepool_free_phys_page(old_page);
+
+    return 0;
+}
+
+/**
+ * Pins the page of the current process containing the given userland
+ * address, faulting it in (and making it writable) first if
+ * necessary. The page must be released with pagepool_free_phys_page.
+ *
+ * @param vaddr The userland address
+ *
+ * @param write Whether the page is going to be written
+ *
+ * @return Physical address of the page, 0 if the address is not in
+ * the address space of the process or the page may not be written.
+ */
+static uint32_t process_pin_user_page(uint32_t vaddr, int write)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    uint32_t phys;
+    pte_t *pte;
+    int ret;
+
+    if (vaddr >= USERLAND_END)
+        return 0;
+
+    /* The clock hand may invalidate the page again before it is
+       pinned, so retry until it sticks. */
+    while ((phys = vm_pin_page(pagetable, vaddr, write)) == 0) {
+        pte = vm_get_pte(pagetable, vaddr);
+        if (pte == NULL || !pte->V)
+            ret = process_page_fault(vaddr, 1);
+        else if (write)
+            ret = process_write_fault(vaddr, 1);
+        else
+            ret = 0;
+
+        if (ret < 0)
+            return 0;
+    }
+
+    return phys;
+}
+
+/**
+ * Copies a buffer from the address space of the current process to
+ * the kernel. The userland pages are accessed through their physical
+ * addresses, so the copy takes no TLB faults and the buffer may be
+ * used by code running with interrupts disabled.
+ *
+ * @param target Kernel buffer
+ *
+ * @param user_source Userland address of the source buffer
+ *
+ * @param length Number of bytes to copy
+ *
+ * @return 0 on success, negative if some part of the buffer is not
+ * in the address space of the process.
+ */
+int process_copy_from_user(void *target, uint32_t user_source, int length)
+{
+    uint32_t phys;
+    int offset;
+    int chunk;
+
+    while (length > 0) {
+        phys = process_pin_user_page(user_source, 0);
+        if (phys == 0)
+            return -1;
+
+        offset = user_source & (PAGE_SIZE - 1);
+        chunk  = MIN(length, PAGE_SIZE - offset);
+        memcopy(chunk, target, (void *)(ADDR_PHYS_TO_KERNEL(phys) + offset));
+        pagepool_free_phys_page(phys);
+
+        target       = (uint8_t *)target + chunk;
+        user_source += chunk;
+        length      -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies a buffer from the kernel to the address space of the current
+ * process. Pages shared by fork are copied before they are written.
+ *
+ * @param user_target Userland address of the target buffer
+ *
+ * @param source Kernel buffer
+ *
+ * @param length Number of bytes to copy
+ *
+ * @return 0 on success, negative if some part of the buffer is not
+ * in the address space of the process or is not writable.
+ */
+int process_copy_to_user(uint32_t user_target, const void *source, int length)
+{
+    uint32_t phys;
+    int offset;
+    int chunk;
+
+    while (length > 0) {
+        phys = process_pin_user_page(user_target, 1);
+        if (phys == 0)
+            return -1;
+
+        offset = user_target & (PAGE_SIZE - 1);
+        chunk  = MIN(length, PAGE_SIZE - offset);
+        memcopy(chunk, (void *)(ADDR_PHYS_TO_KERNEL(phys) + offset), source);
+        pagepool_free_phys_page(phys);
+
+        source       = (const uint8_t *)source + chunk;
+        user_target += chunk;
+        length      -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies a NUL-terminated string from the address space of the
+ * current process to the kernel.
+ *
+ * @param target Kernel buffer
+ *
+ * @param user_source Userland address of the string
+ *
+ * @param buflen Size of the kernel buffer. Longer strings are
+ * truncated, the target is always terminated.
+ *
+ * @return 0 on success, negative if the string is not in the address
+ * space of the process.
+ */
+int process_copy_string_from_user(char *target, uint32_t user_source,
+                                  int buflen)
+{
+    uint32_t phys;
+    char *page;
+    int offset;
+
+    KERNEL_ASSERT(buflen > 0);
+
+    while (buflen > 1) {
+        phys = process_pin_user_page(user_source, 0);
+        if (phys == 0)
+            return -1;
+
+        page = (char *)ADDR_PHYS_TO_KERNEL(phys);
+        for (offset = user_source & (PAGE_SIZE - 1);
+             offset < PAGE_SIZE && buflen > 1; offset++) {
+            *target = page[offset];
+            if (*target == '\0')
+                break;
+            target++;
+            user_source++;
+            buflen--;
+        }
+        pagepool_free_phys_page(phys);
+
+        if (offset < PAGE_SIZE && buflen > 1)
+            return 0;
+    }
+
+    *target = '\0';
+    return 0;
+}
+
+/**
+ * Reads from an open file to a buffer of the current process. The
+ * data is read straight into the pinned physical pages of the buffer,
+ * a page at a time, so the whole blocks of a block-aligned buffer are
+ * transferred by the disk in place (see tfs_read).
+ *
+ * @param file The open file
+ *
+ * @param user_target Userland address of the buffer
+ *
+ * @param length Number of bytes to read at most
+ *
+ * @return Number of bytes read, negative on error.
+ */
+int process_read_file(openfile_t file, uint32_t user_target, int length)
+{
+    uint32_t phys;
+    int offset;
+    int chunk;
+    int done = 0;
+    int ret;
+
+    while (done < length) {
+        phys = process_pin_user_page(user_target, 1);
+        if (phys == 0)
+            return (done > 0) ? done : -1;
+
+        offset = user_target & (PAGE_SIZE - 1);
+        chunk  = MIN(length - done, PAGE_SIZE - offset);
+        ret = vfs_read(file, (void *)(ADDR_PHYS_TO_KERNEL(phys) + offset),
+                       chunk);
+        pagepool_free_phys_page(phys);
+
+        if (ret < 0)
+            return (done > 0) ? done : ret;
+
+        done        += ret;
+        user_target += ret;
+        if (ret < chunk)
+            break;
+    }
+
+    return done;
+}
+
+/**
+ * Writes to an open file from a buffer of the current process, a
+ * page at a time from the pinned physical pages of the buffer (see
+ * process_read_file).
+ *
+ * @param file The open file
+ *
+ * @param user_source Userland address of the buffer
+ *
+ * @param length Number of bytes to write
+ *
+ * @return Number of bytes written, negative on error.
+ */
+int process_write_file(openfile_t file, uint32_t user_source, int length)
+{
+    uint32_t phys;
+    int offset;
+    int chunk;
+    int done = 0;
+    int ret;
+
+    while (done < length) {
+        phys = process_pin_user_page(user_source, 0);
+        if (phys == 0)
+            return (done > 0) ? done : -1;
+
+        offset = user_source & (PAGE_SIZE - 1);
+        chunk  = MIN(length - done, PAGE_SIZE - offset);
+        ret = vfs_write(file, (void *)(ADDR_PHYS_TO_KERNEL(phys) + offset),
+                        chunk);
+        pagepool_free_phys_page(phys);
+
+        if (ret < 0)
+            return (done > 0) ? done : ret;
+
+        done        += ret;
+        user_source += ret;
+        if (ret < chunk)
+            break;
+    }
+
+    return done;
+}
+
+/**
+ * Starts a process created by process_fork. The address space has
+ * already been set up, so this only enters userland at the function
+ * given to fork. The function gets its own stack at the top of the
+ * (copied) stack area.
+ *
+ * @param pid The process ID of the new process
+ */
+static void process_fork_start(uint32_t pid)
+{
+    thread_table_t *my_entry;
+    context_t user_context;
+    interrupt_status_t intr_status;
+
+    my_entry = thread_get_current_thread_entry();
+    my_entry->process_id = pid;
+
+    intr_status = _interrupt_disable();
+    tlb_activate(my_entry->pagetable);
+    _interrupt_set_state(intr_status);
 
-    /* Initialize the user context. (Status register is handled by
-       thread_goto_userland) */
     memoryset(&user_context, 0, sizeof(user_context));
     user_context.cpu_regs[MIPS_REGISTER_SP] = USERLAND_STACK_TOP;
-    user_context.pc = elf.entry_point;
+    user_context.cpu_regs[MIPS_REGISTER_A0] = process_table[pid].fork_arg;
+    user_context.cpu_regs[MIPS_REGISTER_RA] = PROCESS_FORK_RETURN;
+    user_context.pc = process_table[pid].fork_func;
 
     thread_goto_userland(&user_context);
 
     KERNEL_PANIC("thread_goto_userland failed.");
 }
 
+/**
+ * Gives back the text cache and page cache entries used by a process.
+ * The pages must already be unmapped.
+ *
+ * @param pid The process
+ */
+static void process_release_caches(process_id_t pid)
+{
+    int i;
+
+    if (process_table[pid].text >= 0)
+        textcache_release(process_table[pid].text);
+
+    for (i = 0; i < PROCESS_MAX_MMAPS; i++) {
+        if (process_table[pid].mmaps[i].vaddr != 0) {
+            pagecache_release(process_table[pid].mmaps[i].cache);
+            process_table[pid].mmaps[i].vaddr = 0;
+        }
+    }
+}
+
+/**
+ * Maps a file in the address space of the current process. The pages
+ * are shared through the page cache with the other processes mapping
+ * the same file, and read from the file on the first access. Written
+ * pages are written back to the file when the last mapping is gone.
+ *
+ * @param pathname Name of the file
+ *
+ * @param length Length of the mapping in bytes. The part past the end
+ * of the file reads as zero and is not written back.
+ *
+ * @param writable Whether the mapping may be written
+ *
+ * @return Address of the mapping, 0 on error.
+ */
+uint32_t process_mmap(char *pathname, int length, int writable)
+{
+    process_table_t *process = process_get_current_process_entry();
+    int cache;
+    int i;
+
+    if (length <= 0 || length > PROCESS_MMAP_SIZE)
+        return 0;
+
+    for (i = 0; i < PROCESS_MAX_MMAPS; i++) {
+        if (process->mmaps[i].vaddr == 0)
+            break;
+    }
+    if (i == PROCESS_MAX_MMAPS)
+        return 0;
+
+    cache = pagecache_get(pathname);
+    if (cache < 0)
+        return 0;
+
+    process->mmaps[i].pages    = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    process->mmaps[i].cache    = cache;
+    process->mmaps[i].writable = writable ? 1 : 0;
+    process->mmaps[i].vaddr    = PROCESS_MMAP_BASE + i * PROCESS_MMAP_SIZE;
+
+    return process->mmaps[i].vaddr;
+}
+
+/**
+ * Removes a file mapping of the current process.
+ *
+ * @param vaddr Address of the mapping, as returned by process_mmap
+ *
+ * @return 0 on success, negative if there is no mapping at vaddr.
+ */
+int process_munmap(uint32_t vaddr)
+{
+    process_table_t *process = process_get_current_process_entry();
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    process_mmap_t *mmap;
+
+    mmap = process_find_mmap(process, vaddr);
+    if (mmap == NULL || mmap->vaddr != vaddr)
+        return -1;
+
+    vm_unmap_range(pagetable, mmap->vaddr,
+                   mmap->vaddr + mmap->pages * PAGE_SIZE);
+    pagecache_release(mmap->cache);
+    mmap->vaddr = 0;
+
+    return 0;
+}
+
+/**
+ * Creates a copy of the current process. All pages are shared
+ * copy-on-write, so only the second level page tables are copied.
+ * The new process starts at func(arg) and ends when func returns.
+ *
+ * @param func Userland address of the function to start
+ *
+ * @param arg Argument given to func
+ *
+ * @return The PID of the new process, or negative on error.
+ */
+process_id_t process_fork(uint32_t func, uint32_t arg)
+{
+    process_id_t cur = process_get_current_process();
+    pagetable_t *parent = thread_get_current_thread_entry()->pagetable;
+    pagetable_t *pagetable;
+    process_id_t pid;
+    TID_t thread;
+    int i;
+
+    pid = alloc_process_id();
+    if (pid == PROCESS_MAX_PROCESSES)
+        return PROCESS_PTABLE_FULL;
+
+    /* The new process reads its pages from the executable through a
+       file handle of its own. */
+    stringcopy(process_table[pid].executable, process_table[cur].executable,
+               PROCESS_MAX_FILELENGTH);
+    process_table[pid].file = vfs_open(process_table[pid].executable);
+    if (process_table[pid].file < 0) {
+        process_reset(pid);
+        return PROCESS_FORK_FAILED;
+    }
+
+    process_table[pid].parent      = cur;
+    process_table[pid].ro_segment  = process_table[cur].ro_segment;
+    process_table[pid].rw_segment  = process_table[cur].rw_segment;
+    process_table[pid].heap_start  = process_table[cur].heap_start;
+    process_table[pid].heap_end    = process_table[cur].heap_end;
+    process_table[pid].stack_bottom = process_table[cur].stack_bottom;
+    process_table[pid].stack_limit  = process_table[cur].stack_limit;
+    process_table[pid].fork_func   = func;
+    process_table[pid].fork_arg    = arg;
+    process_table[pid].text        = process_table[cur].text;
+    process_table[pid].zero_faults = 0;
+    process_table[pid].file_faults = 0;
+    process_table[pid].text_faults = 0;
+    memoryset(&process_table[pid].vmstat, 0, sizeof(vmstat_t));
+
+    if (process_table[pid].text >= 0)
+        textcache_ref(process_table[pid].text);
+    for (i = 0; i < PROCESS_MAX_MMAPS; i++) {
+        process_table[pid].mmaps[i] = process_table[cur].mmaps[i];
+        if (process_table[pid].mmaps[i].vaddr != 0)
+            pagecache_ref(process_table[pid].mmaps[i].cache);
+    }
+
+    thread = thread_create(&process_fork_start, pid);
+    if (thread < 0) {
+        process_release_caches(pid);
+        vfs_close(process_table[pid].file);
+        process_reset(pid);
+        return PROCESS_FORK_FAILED;
+    }
+
+    pagetable = vm_create_pagetable();
+    if (pagetable == NULL || vm_fork_pagetable(parent, pagetable) != 0) {
+        if (pagetable != NULL)
+            vm_destroy_pagetable(pagetable);
+        /* The thread was never run, so it can be given back as such. */
+        thread_get_thread_entry(thread)->state = THREAD_FREE;
+        process_release_caches(pid);
+        vfs_close(process_table[pid].file);
+        process_reset(pid);
+        return PROCESS_FORK_FAILED;
+    }
+
+    /* The pages of the parent were write-protected, the old writable
+       entries must go. */
+    tlb_shootdown(parent, NULL, 0);
+
+    thread_get_thread_entry(thread)->pagetable = pagetable;
+    thread_run(thread);
+
+    return pid;
+}
+
 process_id_t process_spawn(const char *executable)
 {
     TID_t thread;
@@ -316,6 +1114,33 @@ void process_finish(int retval)
     interrupt_status_t intr_status;
     process_id_t cur = process_get_current_process();
     thread_table_t *thread = thread_get_current_thread_entry();
+    pagetable_t *pagetable;
+    int reclaimed;
+
+    /* Files left open by the process */
+    while (process_table[cur].cFiles > 0)
+        vfs_close(process_table[cur].files[--process_table[cur].cFiles]);
+
+    vfs_close(process_table[cur].file);
+
+    /* Tear down the address space. This must be done before taking
+       the process table lock, since the TLB shootdown may sleep. */
+    intr_status = _interrupt_disable();
+    pagetable = thread->pagetable;
+    thread->pagetable = NULL;
+    _interrupt_set_state(intr_status);
+
+    reclaimed = vm_destroy_pagetable(pagetable);
+
+    /* The cached text pages are freed and the mapped files written
+       back only after the last mapping of them is gone. */
+    process_release_caches(cur);
+
+    DEBUG("vmdebug", "Process %d: %d zero filled, %d read, %d shared "
+          "page faults, %d pages reclaimed\n", cur,
+          process_table[cur].zero_faults, process_table[cur].file_faults,
+          process_table[cur].text_faults, reclaimed);
+    vmstat_dump();
 
     intr_status = _interrupt_disable();
     spinlock_acquire(&process_table_slock);
@@ -323,10 +1148,6 @@ void process_finish(int retval)
     process_table[cur].state  = PROCESS_ZOMBIE;
     process_table[cur].retval = retval;
 
-    /* Remember to destroy the pagetable! */
-    vm_destroy_pagetable(thread->pagetable);
-    thread->pagetable = NULL;
-
     sleepq_wake_all(&process_table[cur]);
 
     spinlock_release(&process_table_slock);
@@ -334,25 +1155,65 @@ void process_finish(int retval)
     thread_finish();
 }
 
+/**
+ * Adds an open file to the files of the current process, which are
+ * closed when the process finishes.
+ *
+ * @param fd The open file
+ *
+ * @return 0 on success, -1 if the process has too many open files.
+ */
 int process_add_file(openfile_t fd)
 {
-  fd = fd;
-  KERNEL_PANIC("Not implemented.");
-  return 0; /* Dummy */
+    process_table_t *process = process_get_current_process_entry();
+
+    if (process->cFiles >= PROCESS_MAX_FILES)
+        return -1;
+
+    process->files[process->cFiles++] = fd;
+    return 0;
 }
 
+/**
+ * Removes an open file from the files of the current process.
+ *
+ * @param fd The open file
+ *
+ * @return 0 on success, -1 if the process does not have the file open.
+ */
 int process_rem_file(openfile_t fd)
 {
-  fd = fd;
-  KERNEL_PANIC("Not implemented.");
-  return 0; /* Dummy */
+    process_table_t *process = process_get_current_process_entry();
+    uint32_t i;
+
+    for (i = 0; i < process->cFiles; i++) {
+        if (process->files[i] == fd) {
+            process->files[i] = process->files[--process->cFiles];
+            return 0;
+        }
+    }
+
+    return -1;
 }
 
+/**
+ * Checks whether the current process has opened the given file.
+ *
+ * @param fd The open file
+ *
+ * @return 0 if the process has the file open, -1 if not.
+ */
 int process_check_file(openfile_t fd)
 {
-  fd = fd;
-  KERNEL_PANIC("Not implemented.");
-  return 0; /* Dummy */
+    process_table_t *process = process_get_current_process_entry();
+    uint32_t i;
+
+    for (i = 0; i < process->cFiles; i++) {
+        if (process->files[i] == fd)
+            return 0;
+    }
+
+    return -1;
 }
 
 /** @} */
@@ -38,15 +38,37 @@
 #define BUENOS_PROC_PROCESS
 
 #include "lib/types.h"
+#include "vm/vmstat.h"
 
 #define USERLAND_STACK_TOP 0x7fffeffc
 
 #define PROCESS_PTABLE_FULL  -1
 #define PROCESS_ILLEGAL_JOIN -2
+#define PROCESS_FORK_FAILED  -3
+
+/* Return value of a process killed because of an invalid memory access */
+#define PROCESS_SEGFAULT     -6
+
+/* Return address given to the function started by fork. Returning
+   there causes an address error, which ends the process. */
+#define PROCESS_FORK_RETURN  0xfffffff0
 
 #define PROCESS_MAX_FILELENGTH 256
 #define PROCESS_MAX_PROCESSES  128
 #define PROCESS_MAX_FILES      10
+#define PROCESS_MAX_MMAPS      4
+
+/* File mappings are placed in windows of PROCESS_MMAP_SIZE bytes
+   starting from PROCESS_MMAP_BASE, one for each mapping. The heap
+   must stay below them. */
+#define PROCESS_MMAP_BASE      0x40000000
+#define PROCESS_MMAP_SIZE      0x00400000
+
+/* End of the heap pages when the heap ends at heap_end, which is
+   exclusive: the page holding heap_end is mapped only if the heap
+   extends into it. */
+#define PROCESS_HEAP_TOP(heap_end) \
+    (((heap_end) + PAGE_SIZE - 1) & PAGE_SIZE_MASK)
 
 typedef int process_id_t;
 
@@ -56,6 +78,22 @@ typedef enum {
     PROCESS_ZOMBIE
 } process_state_t;
 
+/* A file mapped with mmap */
+typedef struct {
+  uint32_t vaddr;    /* Beginning of the mapping, 0 if not in use */
+  uint32_t pages;    /* Length of the mapping in pages */
+  int cache;         /* Page cache entry of the file */
+  int writable;      /* Whether the mapping may be written */
+} process_mmap_t;
+
+/* A segment of the executable, filled from the file on demand */
+typedef struct {
+  uint32_t vaddr;    /* Virtual address, page aligned */
+  uint32_t pages;    /* Pages in the address space (including bss) */
+  uint32_t location; /* Location of the segment in the file */
+  uint32_t size;     /* Size of the segment in the file */
+} process_segment_t;
+
 typedef struct {
   char executable[PROCESS_MAX_FILELENGTH];
   process_state_t state;
@@ -65,7 +103,39 @@ typedef struct {
   uint32_t cFiles;
   int files[PROCESS_MAX_FILES];
 
+  uint32_t heap_start;
   uint32_t heap_end;
+
+  /* Lowest page of the stack so far, and the lowest page it may grow
+     to. Accesses to the guard page below the limit kill the process. */
+  uint32_t stack_bottom;
+  uint32_t stack_limit;
+
+  /* The executable (an openfile_t), kept open for filling pages on
+     demand, and its read-only and read-write segments */
+  int file;
+  process_segment_t ro_segment;
+  process_segment_t rw_segment;
+
+  /* Text cache entry sharing the read-only segment pages with other
+     processes running the same executable, negative if none */
+  int text;
+
+  /* Files mapped in the address space */
+  process_mmap_t mmaps[PROCESS_MAX_MMAPS];
+
+  /* Function and its argument where a process created by fork starts */
+  uint32_t fork_func;
+  uint32_t fork_arg;
+
+  /* Number of pages filled with zeros, read from the executable and
+     found in the text cache on demand */
+  uint32_t zero_faults;
+  uint32_t file_faults;
+  uint32_t text_faults;
+
+  /* VM and TLB counters of the process, see vm/vmstat.h */
+  vmstat_t vmstat;
 } process_table_t;
 
 /* Initialize the process table */
@@ -96,4 +166,40 @@ int process_rem_file(int fd);
 /* Check if a file is in the current process's file list. Returns 0 if it is. */
 int process_check_file(int fd);
 
+/* Map the page containing vaddr in the address space of the current
+   process. Returns negative value if vaddr is not in the address space
+   or the page could not be filled. */
+int process_page_fault(uint32_t vaddr, int may_sleep);
+
+/* Handle a write to a write-protected page of the current process,
+   copying pages shared by fork. Returns negative value if the page is
+   not writable or could not be copied. */
+int process_write_fault(uint32_t vaddr, int may_sleep);
+
+/* Copy buffers and strings between the kernel and the address space
+   of the current process through the physical pages. Return negative
+   value if the userland buffer is not in the address space. */
+int process_copy_from_user(void *target, uint32_t user_source, int length);
+int process_copy_to_user(uint32_t user_target, const void *source, int length);
+int process_copy_string_from_user(char *target, uint32_t user_source,
+                                  int buflen);
+
+/* Read from and write to an open file directly from the physical
+   pages of a buffer of the current process. Return the number of
+   bytes transferred, negative on error. */
+int process_read_file(int file, uint32_t user_target, int length);
+int process_write_file(int file, uint32_t user_source, int length);
+
+/* Map the named file in the address space of the current process.
+   Returns the address of the mapping, 0 on error. */
+uint32_t process_mmap(char *pathname, int length, int writable);
+
+/* Remove a mapping created by process_mmap. Returns negative value on
+   error. */
+int process_munmap(uint32_t vaddr);
+
+/* Create a copy-on-write copy of the current process, starting at
+   func(arg). Returns the PID of the new process or negative on error. */
+process_id_t process_fork(uint32_t func, uint32_t arg);
+
 #endif
@@ -47,11 +47,51 @@
 #include "kernel/thread.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
+#include "vm/swap.h"
+#include "vm/vmstat.h"
+#include "fs/vfs.h"
 #include "kernel/interrupt.h"
 
+/* Size of the kernel buffer used by the TTY system calls. */
+#define SYSCALL_IO_BUFFER_SIZE 256
+
+/* File handles of userland are the VFS open files numbered after the
+   console handles. */
+#define SYSCALL_FILE_TO_HANDLE(file)    ((file) + FILEHANDLE_STDERR + 1)
+#define SYSCALL_HANDLE_TO_FILE(fhandle) ((fhandle) - FILEHANDLE_STDERR - 1)
+
+/**
+ * Finds the open file behind a file handle of the current process.
+ *
+ * @param fhandle The file handle
+ *
+ * @return The open file, negative if the process has not opened it.
+ */
+static openfile_t syscall_get_file(int fhandle)
+{
+  openfile_t file = SYSCALL_HANDLE_TO_FILE(fhandle);
+
+  if (fhandle <= FILEHANDLE_STDERR || process_check_file(file) < 0)
+    return VFS_NOT_OPEN;
+
+  return file;
+}
+
 int syscall_write(int fhandle, const void *buffer, int length){
+  char kbuffer[SYSCALL_IO_BUFFER_SIZE];
+  openfile_t file;
   device_t *dev;
   gcd_t *gcd;
+  int written = 0;
+  int chunk;
+  int ret;
+
+  if (fhandle > FILEHANDLE_STDERR) {
+    file = syscall_get_file(fhandle);
+    if (file < 0 || length < 0)
+      return -1;
+    return process_write_file(file, (uint32_t)buffer, length);
+  }
 
   dev = device_get(YAMS_TYPECODE_TTY, 0);
   if(dev == NULL)
@@ -65,13 +105,40 @@ int syscall_write(int fhandle, const void *buffer, int length){
     KERNEL_PANIC("Can only write to standard output!");
   }
 
-  return gcd->write(gcd, buffer, length);
+  /* The driver copies the buffer with interrupts disabled, so it
+     gets a kernel copy which cannot fault. */
+  while (written < length) {
+    chunk = MIN(length - written, SYSCALL_IO_BUFFER_SIZE);
+    if (process_copy_from_user(kbuffer, (uint32_t)buffer + written,
+                               chunk) < 0)
+      return -1;
+
+    ret = gcd->write(gcd, kbuffer, chunk);
+    if (ret < 0)
+      return (written > 0) ? written : ret;
+
+    written += ret;
+    if (ret < chunk)
+      break;
+  }
+
+  return written;
 }
 
 int syscall_read(int fhandle, void *buffer, int length){
+  char kbuffer[SYSCALL_IO_BUFFER_SIZE];
+  openfile_t file;
   device_t *dev;
   gcd_t *gcd;
-  
+  int ret;
+
+  if (fhandle > FILEHANDLE_STDERR) {
+    file = syscall_get_file(fhandle);
+    if (file < 0 || length < 0)
+      return -1;
+    return process_read_file(file, (uint32_t)buffer, length);
+  }
+
   dev = device_get(YAMS_TYPECODE_TTY, fhandle);
   if(dev == NULL)
     return -1;
@@ -84,13 +151,29 @@ int syscall_read(int fhandle, void *buffer, int length){
     KERNEL_PANIC("Can only read from standard input!");
   }
 
-  return gcd->read(gcd, buffer, length);
+  if (length <= 0)
+    return 0;
+
+  /* A read returns what the TTY has buffered, at most one chunk. */
+  ret = gcd->read(gcd, kbuffer, MIN(length, SYSCALL_IO_BUFFER_SIZE));
+  if (ret <= 0)
+    return ret;
+
+  if (process_copy_to_user((uint32_t)buffer, kbuffer, ret) < 0)
+    return -1;
+
+  return ret;
 }
 
 int syscall_exec(const char *filename)
 {
+  char pathname[VFS_PATH_LENGTH];
 
-  return process_spawn(filename);
+  if (process_copy_string_from_user(pathname, (uint32_t)filename,
+                                    VFS_PATH_LENGTH) < 0)
+    return -1;
+
+  return process_spawn(pathname);
 }
 
 void syscall_exit(int retval)
@@ -106,12 +189,9 @@ int syscall_join(int pid)
 
 void *syscall_memlimit (void* new_heap_end)
 {
-  int i;
   uint32_t heap_end = process_get_current_process_entry()->heap_end;
+  process_table_t *process;
   int pages;
-  interrupt_status_t intr_status;
-  pagetable_t *pagetable;
-  uint32_t phys_addr;
 
   /* If argument is NULL, return the current heap end address. */
   if(new_heap_end == NULL){
@@ -121,63 +201,218 @@ void *syscall_memlimit (void* new_heap_end)
 
   DEBUG("debug_G4", "Syscall_memlimit: heap_end is %d and arg new_heap_end is %d\n",heap_end,(uint32_t)new_heap_end);
   
-  /* As unmap is not implemented, it is not allowed to decrease the heap. */
-  KERNEL_ASSERT(heap_end < (uint32_t)new_heap_end);
-  
+  process = process_get_current_process_entry();
+
+  /* The heap must stay below the file mappings. */
+  if ((uint32_t)new_heap_end < process->heap_start ||
+      (uint32_t)new_heap_end >= PROCESS_MMAP_BASE) {
+    return NULL;
+  }
+
+  /* Shrinking the heap returns the pages no longer in the heap to
+     the page pool. */
+  if ((uint32_t)new_heap_end < heap_end) {
+    pages = vm_unmap_range(thread_get_current_thread_entry()->pagetable,
+                           PROCESS_HEAP_TOP((uint32_t)new_heap_end),
+                           PROCESS_HEAP_TOP(heap_end));
+    DEBUG("debug_G4","Syscall_memlimit: Freed %d pages\n", pages);
+    process->heap_end = (uint32_t)new_heap_end;
+    return new_heap_end;
+  }
+
   /* Calculate the needed number of pages to fullfill the request.*/
-  pages = (uint32_t)new_heap_end/PAGE_SIZE - heap_end/PAGE_SIZE;
+  pages = (PROCESS_HEAP_TOP((uint32_t)new_heap_end) -
+           PROCESS_HEAP_TOP(heap_end)) / PAGE_SIZE;
   KERNEL_ASSERT(pages > -1);
   DEBUG("debug_G4","Syscall_memlimit: Number of needed pages: %d\n", pages);
 
-  /* Disable interrupts to make sure no one steals any pages we might need. */
-  intr_status = _interrupt_disable();
-
-  /* If the amount of free pages can fullfill our request,
-     we want to assume that we can take those without having to
-     worry. Hence the disabling of interrupts. */
-  if (pagepool_get_num_free_pages() < pages) {
+  /* The pages are mapped on the first access by process_page_fault,
+     but refuse requests which obviously cannot be satisfied. */
+  if (pagepool_get_num_free_pages() + swap_get_num_free_slots() < pages) {
     DEBUG("debug_G4","Syscall_memlimit: Not enough free pages are available\n");
-    _interrupt_set_state(intr_status);
     return NULL;
   }
 
-  pagetable = thread_get_current_thread_entry()->pagetable;
+  /* Update the process heap pointer. */
+  process_get_current_process_entry()->heap_end = (uint32_t)new_heap_end;
+  
+  /* Return the updated heap pointer. */
+  return (void*)process_get_current_process_entry()->heap_end;
+}
 
-  KERNEL_ASSERT(pagetable != NULL);
+/**
+ * Maps a file in the address space of the current process.
+ *
+ * @param filename Name of the file, in userland
+ *
+ * @param length Length of the mapping in bytes
+ *
+ * @param writable Whether the mapping may be written
+ *
+ * @return Address of the mapping, NULL on error.
+ */
+void *syscall_mmap(const char *filename, int length, int writable)
+{
+  char pathname[VFS_PATH_LENGTH];
 
-  /* Make sure that the pagetable has room for the needed
-     number of pages. */
-  if ((pagetable->valid_count+pages) > PAGETABLE_ENTRIES) {
-    DEBUG("debug_G4","Syscall_memlimit: Request is too big. Cannot add pages %d to pagetable of thread ASID %d\n",pages,pagetable->ASID);
-    _interrupt_set_state(intr_status);
+  if (process_copy_string_from_user(pathname, (uint32_t)filename,
+                                    VFS_PATH_LENGTH) < 0)
     return NULL;
-  }
 
-  /* Make the tmp heap_end value point to the next page address,
-     to avoid mapping with the same virtual address, if the heap was
-     at a page-boundary. And to keep the virtual addresses page-aligned.
-     This has only any effect if we need to allocate atleast one page. */
-  if ((heap_end % PAGE_SIZE) == 0) {
-    heap_end = heap_end + PAGE_SIZE;
-  } else {
-    heap_end = heap_end + (heap_end % PAGE_SIZE);
-  }
+  return (void*)process_mmap(pathname, length, writable);
+}
+
+/**
+ * Reads the VM and TLB statistics of a CPU or the current process.
+ *
+ * @param cpu The CPU, or VMSTAT_PROCESS for the current process
+ *
+ * @param stats The statistics are returned here, in userland
+ *
+ * @return 0 on success, -1 on error.
+ */
+int syscall_vmstat(int cpu, vmstat_t *stats)
+{
+  vmstat_t copy;
+
+  if (vmstat_get(cpu, &copy) < 0)
+    return -1;
+
+  return process_copy_to_user((uint32_t)stats, &copy, sizeof(vmstat_t));
+}
+
+/**
+ * Opens a file for the current process.
+ *
+ * @param filename Full name of the file, in userland
+ *
+ * @return File handle, negative on error.
+ */
+int syscall_open(const char *filename)
+{
+  char pathname[VFS_PATH_LENGTH];
+  openfile_t file;
+
+  if (process_copy_string_from_user(pathname, (uint32_t)filename,
+                                    VFS_PATH_LENGTH) < 0)
+    return VFS_INVALID_PARAMS;
 
-  /* Get the number of needed pages and map them into the
-     process page table. */
-  for(i = 0; i < pages; i++){
-    phys_addr = pagepool_get_phys_page();
-    if (!phys_addr)
-      KERNEL_PANIC("Syscall_memlimit: No physical page left, should not be able to happen.");
-    vm_map(pagetable, phys_addr, heap_end + i * PAGE_SIZE, 1);
+  file = vfs_open(pathname);
+  if (file < 0)
+    return file;
+
+  if (process_add_file(file) < 0) {
+    vfs_close(file);
+    return VFS_LIMIT;
   }
-  _interrupt_set_state(intr_status);
 
-  /* Update the process heap pointer. */
-  process_get_current_process_entry()->heap_end = (uint32_t)new_heap_end;
-  
-  /* Return the updated heap pointer. */
-  return (void*)process_get_current_process_entry()->heap_end;
+  return SYSCALL_FILE_TO_HANDLE(file);
+}
+
+/**
+ * Closes a file opened by the current process.
+ *
+ * @param fhandle The file handle
+ *
+ * @return 0 on success, negative on error.
+ */
+int syscall_close(int fhandle)
+{
+  openfile_t file = syscall_get_file(fhandle);
+
+  if (file < 0)
+    return file;
+
+  process_rem_file(file);
+  return vfs_close(file);
+}
+
+/**
+ * Sets the file position of a file opened by the current process.
+ *
+ * @param fhandle The file handle
+ *
+ * @param offset The new position
+ *
+ * @return 0 on success, negative on error.
+ */
+int syscall_seek(int fhandle, int offset)
+{
+  openfile_t file = syscall_get_file(fhandle);
+
+  if (file < 0)
+    return file;
+  if (offset < 0)
+    return VFS_INVALID_PARAMS;
+
+  return vfs_seek(file, offset);
+}
+
+/**
+ * Creates a file.
+ *
+ * @param filename Full name of the file, in userland
+ *
+ * @param size Size of the file in bytes
+ *
+ * @return 0 on success, negative on error.
+ */
+int syscall_create(const char *filename, int size)
+{
+  char pathname[VFS_PATH_LENGTH];
+
+  if (size < 0 ||
+      process_copy_string_from_user(pathname, (uint32_t)filename,
+                                    VFS_PATH_LENGTH) < 0)
+    return VFS_INVALID_PARAMS;
+
+  return vfs_create(pathname, size);
+}
+
+/**
+ * Removes a file.
+ *
+ * @param filename Full name of the file, in userland
+ *
+ * @return 0 on success, negative on error.
+ */
+int syscall_delete(const char *filename)
+{
+  char pathname[VFS_PATH_LENGTH];
+
+  if (process_copy_string_from_user(pathname, (uint32_t)filename,
+                                    VFS_PATH_LENGTH) < 0)
+    return VFS_INVALID_PARAMS;
+
+  return vfs_remove(pathname);
+}
+
+/**
+ * Writes all modified filesystem blocks to the disks.
+ *
+ * @return 0 on success, negative on error.
+ */
+int syscall_sync(void)
+{
+  return vfs_sync();
+}
+
+/**
+ * Returns the free space of a filesystem.
+ *
+ * @param filesystem Name of the mounted volume, in userland
+ *
+ * @return Number of free bytes, negative on error.
+ */
+int syscall_getfree(const char *filesystem)
+{
+  char volumename[VFS_NAME_LENGTH];
+
+  if (process_copy_string_from_user(volumename, (uint32_t)filesystem,
+                                    VFS_NAME_LENGTH) < 0)
+    return VFS_INVALID_PARAMS;
+
+  return vfs_getfree(volumename);
 }
 
 /**
@@ -221,9 +456,58 @@ void syscall_handle(context_t *user_context)
     case SYSCALL_JOIN:
       user_context->cpu_regs[MIPS_REGISTER_V0] = syscall_join((int)user_context->cpu_regs[MIPS_REGISTER_A1]);
       break;
+    case SYSCALL_FORK:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          process_fork(user_context->cpu_regs[MIPS_REGISTER_A1],
+                       user_context->cpu_regs[MIPS_REGISTER_A2]);
+      break;
     case SYSCALL_MEMLIMIT:
       user_context->cpu_regs[MIPS_REGISTER_V0] = (uint32_t)syscall_memlimit((void*)user_context->cpu_regs[MIPS_REGISTER_A1]);
       break;
+    case SYSCALL_MMAP:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          (uint32_t)syscall_mmap((char*)user_context->cpu_regs[MIPS_REGISTER_A1],
+                                 (int)user_context->cpu_regs[MIPS_REGISTER_A2],
+                                 (int)user_context->cpu_regs[MIPS_REGISTER_A3]);
+      break;
+    case SYSCALL_MUNMAP:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          process_munmap(user_context->cpu_regs[MIPS_REGISTER_A1]);
+      break;
+    case SYSCALL_VMSTAT:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          syscall_vmstat((int)user_context->cpu_regs[MIPS_REGISTER_A1],
+                         (vmstat_t*)user_context->cpu_regs[MIPS_REGISTER_A2]);
+      break;
+    case SYSCALL_OPEN:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          syscall_open((char*)user_context->cpu_regs[MIPS_REGISTER_A1]);
+      break;
+    case SYSCALL_CLOSE:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          syscall_close((int)user_context->cpu_regs[MIPS_REGISTER_A1]);
+      break;
+    case SYSCALL_SEEK:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          syscall_seek((int)user_context->cpu_regs[MIPS_REGISTER_A1],
+                       (int)user_context->cpu_regs[MIPS_REGISTER_A2]);
+      break;
+    case SYSCALL_CREATE:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          syscall_create((char*)user_context->cpu_regs[MIPS_REGISTER_A1],
+                         (int)user_context->cpu_regs[MIPS_REGISTER_A2]);
+      break;
+    case SYSCALL_DELETE:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          syscall_delete((char*)user_context->cpu_regs[MIPS_REGISTER_A1]);
+      break;
+    case SYSCALL_SYNC:
+      user_context->cpu_regs[MIPS_REGISTER_V0] = syscall_sync();
+      break;
+    case SYSCALL_GETFREE:
+      user_context->cpu_regs[MIPS_REGISTER_V0] =
+          syscall_getfree((char*)user_context->cpu_regs[MIPS_REGISTER_A1]);
+      break;
     default: 
       KERNEL_PANIC("Unhandled system call\n");
     }
@@ -46,6 +46,9 @@
 #define SYSCALL_JOIN 0x103
 #define SYSCALL_FORK 0x104
 #define SYSCALL_MEMLIMIT 0x105
+#define SYSCALL_MMAP 0x106
+#define SYSCALL_MUNMAP 0x107
+#define SYSCALL_VMSTAT 0x108
 #define SYSCALL_OPEN 0x201
 #define SYSCALL_CLOSE 0x202
 #define SYSCALL_SEEK 0x203
@@ -53,6 +56,8 @@
 #define SYSCALL_WRITE 0x205
 #define SYSCALL_CREATE 0x206
 #define SYSCALL_DELETE 0x207
+#define SYSCALL_SYNC 0x208
+#define SYSCALL_GETFREE 0x209
 
 /* When userland program reads or writes these already open files it
  * actually accesses the console.
@@ -0,0 +1,302 @@
+/*
+ * Shared text pages of executables
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "proc/textcache.h"
+#include "kernel/assert.h"
+#include "kernel/config.h"
+#include "kernel/interrupt.h"
+#include "kernel/spinlock.h"
+#include "fs/vfs.h"
+#include "drivers/yams.h"
+#include "vm/pagepool.h"
+
+/** @name Text cache
+ *
+ * The read-only segment of an executable is the same in every
+ * process running it. The text cache keeps the pages of the
+ * read-only segments of running executables, so that a page is read
+ * from the file only once and then mapped read-only into every
+ * process which needs it. The pages are shared through the page
+ * reference counts of the pagepool: the cache holds one reference to
+ * each page and every mapping another one.
+ *
+ * An entry lives as long as some process running the executable
+ * exists. Executables are assumed not to be modified while they are
+ * being run.
+ *
+ * @{
+ */
+
+/* Maximum number of pages in a cached read-only segment */
+#define TEXTCACHE_MAX_PAGES (PAGE_SIZE / sizeof(uint32_t))
+
+typedef struct {
+    /* Filesystem of the executable, NULL if the entry is free */
+    fs_t *filesystem;
+    /* Filesystem specific file ID of the executable */
+    int fileid;
+    /* Number of processes using this entry */
+    int refcount;
+    /* Number of pages in the read-only segment */
+    uint32_t pages;
+    /* Page holding the physical addresses of the cached pages of
+       the segment, zero for pages not read yet */
+    uint32_t index_page;
+} textcache_entry_t;
+
+static textcache_entry_t textcache_table[CONFIG_TEXTCACHE_ENTRIES];
+
+static spinlock_t textcache_slock;
+
+/**
+ * Initializes the text cache.
+ */
+void textcache_init(void)
+{
+    int i;
+
+    spinlock_reset(&textcache_slock);
+    for (i = 0; i < CONFIG_TEXTCACHE_ENTRIES; i++)
+        textcache_table[i].filesystem = NULL;
+}
+
+/**
+ * Finds the text cache entry of an executable, creating it if no
+ * running process uses the executable yet. The caller gets a
+ * reference to the entry, which is given back with
+ * textcache_release.
+ *
+ * @param file The executable, opened
+ *
+ * @param pages Number of pages in the read-only segment
+ *
+ * @return The text cache entry, or negative if the read-only segment
+ * cannot be cached.
+ */
+int textcache_get(int file, uint32_t pages)
+{
+    interrupt_status_t intr_status;
+    fs_t *filesystem;
+    int fileid;
+    int entry = -1;
+    int i;
+
+    if (pages == 0 || pages > TEXTCACHE_MAX_PAGES)
+        return -1;
+
+    if (vfs_fileid(file, &filesystem, &fileid) != VFS_OK)
+        return -1;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&textcache_slock);
+
+    for (i = 0; i < CONFIG_TEXTCACHE_ENTRIES; i++) {
+        if (textcache_table[i].filesystem == filesystem &&
+            textcache_table[i].fileid == fileid &&
+            textcache_table[i].pages == pages) {
+            textcache_table[i].refcount++;
+            entry = i;
+            break;
+        }
+        if (entry < 0 && textcache_table[i].filesystem == NULL)
+            entry = i;
+    }
+
+    if (i == CONFIG_TEXTCACHE_ENTRIES && entry >= 0) {
+        textcache_table[entry].index_page = pagepool_get_zeroed_page();
+        if (textcache_table[entry].index_page != 0) {
+            textcache_table[entry].filesystem = filesystem;
+            textcache_table[entry].fileid     = fileid;
+            textcache_table[entry].refcount   = 1;
+            textcache_table[entry].pages      = pages;
+        } else {
+            entry = -1;
+        }
+    }
+
+    spinlock_release(&textcache_slock);
+    _interrupt_set_state(intr_status);
+
+    return entry;
+}
+
+/**
+ * Takes another reference to a text cache entry, for a process
+ * created as a copy of a process using the entry.
+ *
+ * @param entry The text cache entry
+ */
+void textcache_ref(int entry)
+{
+    interrupt_status_t intr_status;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_TEXTCACHE_ENTRIES);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&textcache_slock);
+
+    KERNEL_ASSERT(textcache_table[entry].refcount > 0);
+    textcache_table[entry].refcount++;
+
+    spinlock_release(&textcache_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Gives back a reference to a text cache entry. When the last process
+ * using the entry is done, the cached pages are released. Pages still
+ * mapped somewhere stay allocated until they are unmapped.
+ *
+ * @param entry The text cache entry
+ */
+void textcache_release(int entry)
+{
+    interrupt_status_t intr_status;
+    uint32_t *pages;
+    uint32_t index_page = 0;
+    uint32_t segment_pages = 0;
+    uint32_t count = 0;
+    uint32_t i;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_TEXTCACHE_ENTRIES);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&textcache_slock);
+
+    KERNEL_ASSERT(textcache_table[entry].refcount > 0);
+    if (--textcache_table[entry].refcount == 0) {
+        index_page = textcache_table[entry].index_page;
+        segment_pages = textcache_table[entry].pages;
+        textcache_table[entry].filesystem = NULL;
+    }
+
+    spinlock_release(&textcache_slock);
+    _interrupt_set_state(intr_status);
+
+    if (index_page == 0)
+        return;
+
+    /* Nobody can find the entry anymore, so the cached pages can be
+       packed in the beginning of the index page and freed at once. */
+    pages = (uint32_t *)ADDR_PHYS_TO_KERNEL(index_page);
+    for (i = 0; i < segment_pages; i++) {
+        if (pages[i] != 0)
+            pages[count++] = pages[i];
+    }
+
+    pagepool_free_phys_pages(pages, count);
+    pagepool_free_phys_page(index_page);
+}
+
+/**
+ * Looks up a page of a read-only segment in the text cache. The
+ * caller gets a reference to the page, which is normally given to
+ * the mapping of the page.
+ *
+ * @param entry The text cache entry
+ *
+ * @param index Index of the page in the read-only segment
+ *
+ * @return Physical address of the page, or 0 if the page has not been
+ * read yet.
+ */
+uint32_t textcache_get_page(int entry, uint32_t index)
+{
+    interrupt_status_t intr_status;
+    uint32_t *pages;
+    uint32_t phys_page;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_TEXTCACHE_ENTRIES);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&textcache_slock);
+
+    KERNEL_ASSERT(index < textcache_table[entry].pages);
+    pages = (uint32_t *)ADDR_PHYS_TO_KERNEL(textcache_table[entry].index_page);
+    phys_page = pages[index];
+    if (phys_page != 0)
+        pagepool_ref_phys_page(phys_page);
+
+    spinlock_release(&textcache_slock);
+    _interrupt_set_state(intr_status);
+
+    return phys_page;
+}
+
+/**
+ * Adds a page read from the executable to the text cache. If another
+ * process added the same page meanwhile, that page is used instead
+ * and the given page is freed.
+ *
+ * @param entry The text cache entry
+ *
+ * @param index Index of the page in the read-only segment
+ *
+ * @param phys_page The filled page. The reference of the caller is
+ * passed back with the return value.
+ *
+ * @return Physical address of the cached page. The caller holds a
+ * reference to it.
+ */
+uint32_t textcache_add_page(int entry, uint32_t index, uint32_t phys_page)
+{
+    interrupt_status_t intr_status;
+    uint32_t *pages;
+    uint32_t cached_page;
+
+    KERNEL_ASSERT(entry >= 0 && entry < CONFIG_TEXTCACHE_ENTRIES);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&textcache_slock);
+
+    KERNEL_ASSERT(index < textcache_table[entry].pages);
+    pages = (uint32_t *)ADDR_PHYS_TO_KERNEL(textcache_table[entry].index_page);
+    cached_page = pages[index];
+    if (cached_page == 0) {
+        pages[index] = phys_page;
+        cached_page = phys_page;
+    }
+    /* One reference for the cache or the caller */
+    pagepool_ref_phys_page(cached_page);
+
+    spinlock_release(&textcache_slock);
+    _interrupt_set_state(intr_status);
+
+    if (cached_page != phys_page)
+        pagepool_free_phys_page(phys_page);
+
+    return cached_page;
+}
+
+/** @} */
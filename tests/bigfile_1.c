@@ -0,0 +1,114 @@
+#include "tests/lib.h"
+
+/* The file is written on disk1, which must be a version 2 TFS volume
+   ("util/tfstool create fyams.harddisk 8192 disk1 2"). */
+#define VOLUME "disk1"
+#define BIG_FILE "[disk1]bigfile"
+
+/* Blocks of a file mapped by the inode, by the single indirect block
+   and, after those, by the double indirect block (see fs/tfs.h) */
+#define BLOCK_SIZE 512
+#define DIRECT_BLOCKS 125
+#define INDIRECT_BLOCKS 128
+
+/* The file reaches well into the double indirect block. */
+#define FILE_BLOCKS (DIRECT_BLOCKS + INDIRECT_BLOCKS + 300)
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE)
+
+#define CHUNK 4096
+
+/* Page aligned, so that whole blocks go between the disk and the
+   buffer directly */
+static char buffer[CHUNK] __attribute__((aligned(CHUNK)));
+
+/* The byte at offset i of the file. Differs between blocks, so that
+   blocks mapped to the wrong place are noticed. */
+static char pattern(int i)
+{
+  return (char)(i * 7 + i / BLOCK_SIZE);
+}
+
+/* Reads length bytes at offset and compares them with the pattern. */
+static int check(int file, int offset, int length)
+{
+  int i;
+
+  if (syscall_seek(file, offset) < 0 ||
+      syscall_read(file, buffer, length) != length)
+    return 0;
+
+  for (i = 0; i < length; i++) {
+    if (buffer[i] != pattern(offset + i))
+      return 0;
+  }
+  return 1;
+}
+
+int main(void)
+{
+  /* Blocks at the ends of each region of the block map */
+  static const int blocks[] = {
+    0, 1, DIRECT_BLOCKS - 1,
+    DIRECT_BLOCKS, DIRECT_BLOCKS + INDIRECT_BLOCKS - 1,
+    DIRECT_BLOCKS + INDIRECT_BLOCKS,
+    DIRECT_BLOCKS + 2*INDIRECT_BLOCKS,
+    FILE_BLOCKS - 1
+  };
+  int free_before, free_created, free_after;
+  int file;
+  int ok;
+  int i, j, n;
+
+  wrapper_writeString("Starting to test large files!\n");
+
+  /* 1. Create a file which needs the double indirect block. */
+  free_before = syscall_getfree(VOLUME);
+  wrapper_writeMlt("1. Created the file: ",
+                   syscall_create(BIG_FILE, FILE_SIZE) == 0, "\n");
+  free_created = syscall_getfree(VOLUME);
+  wrapper_writeMlt("   Space was taken: ",
+                   free_before - free_created >= FILE_SIZE, "\n");
+
+  /* 2. Write the pattern to the whole file. */
+  file = syscall_open(BIG_FILE);
+  ok = file >= 0;
+  for (i = 0; ok && i < FILE_SIZE; i += n) {
+    n = MIN(CHUNK, FILE_SIZE - i);
+    for (j = 0; j < n; j++)
+      buffer[j] = pattern(i + j);
+    ok = syscall_write(file, buffer, n) == n;
+  }
+  wrapper_writeMlt("2. Wrote the file: ", ok, "\n");
+
+  /* 3. Read back blocks mapped directly, through the single indirect
+        block and through the double indirect block, and reads
+        crossing from one region to the next. */
+  ok = file >= 0;
+  for (i = 0; ok && i < (int)(sizeof(blocks) / sizeof(blocks[0])); i++)
+    ok = check(file, blocks[i] * BLOCK_SIZE, BLOCK_SIZE);
+  ok = ok &&
+    check(file, DIRECT_BLOCKS * BLOCK_SIZE - 100, 200) &&
+    check(file, (DIRECT_BLOCKS + INDIRECT_BLOCKS) * BLOCK_SIZE - 100, 200);
+  wrapper_writeMlt("3. Read back each region: ", ok, "\n");
+
+  /* 4. The whole file reads back, and no further. */
+  ok = file >= 0 && syscall_seek(file, 0) == 0;
+  for (i = 0; ok && i < FILE_SIZE; i += CHUNK)
+    ok = check(file, i, MIN(CHUNK, FILE_SIZE - i));
+  ok = ok && syscall_read(file, buffer, CHUNK) == 0;
+  wrapper_writeMlt("4. Read back the whole file: ", ok, "\n");
+  syscall_close(file);
+
+  /* 5. Removing the file frees all its blocks, including the inode
+        and the indirect blocks. */
+  wrapper_writeMlt("5. Removed the file: ",
+                   syscall_delete(BIG_FILE) == 0, "\n");
+  free_after = syscall_getfree(VOLUME);
+  wrapper_writeMlt("   Free space is back: ", free_after == free_before, "\n");
+
+  wrapper_writeString("Finished testing large files.\n");
+
+  syscall_exit(0);
+
+  return 0;
+}
@@ -0,0 +1,46 @@
+#include "tests/lib.h"
+
+/* Initialized and uninitialized data shared copy-on-write with the
+   children. The writes of a child must not be seen by the parent. */
+static int value = 42;
+static char buffer[3*4096];
+
+void child(int arg)
+{
+  value = arg;
+  buffer[4096] = 'c';
+  wrapper_writeMlt("Child sees its own writes: ",
+                   value == arg && buffer[4096] == 'c', "\n");
+}
+
+int main(void)
+{
+  int pid;
+  int retval;
+
+  wrapper_writeString("Starting to test syscall_fork!\n");
+
+  buffer[4096] = 'p';
+
+  /* 1. Fork a child which writes the shared pages. */
+  pid = syscall_fork(&child, 7);
+  wrapper_writeMlt("1. Forked a child: ", pid >= 0, "\n");
+
+  /* 2. The child ends when its function returns. */
+  retval = syscall_join(pid);
+  wrapper_writeMlt("2. Joined the child: ", retval == 0, "\n");
+
+  /* 3. The pages written by the child were copied. */
+  wrapper_writeMlt("3. Parent data unchanged: ",
+                   value == 42 && buffer[4096] == 'p', "\n");
+
+  /* 4. Writing after the child is gone does not need a copy. */
+  value = 43;
+  wrapper_writeMlt("4. Parent can write its data: ", value == 43, "\n");
+
+  wrapper_writeString("Finished testing syscall_fork.\n");
+
+  syscall_exit(0);
+
+  return 0;
+}
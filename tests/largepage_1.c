@@ -0,0 +1,44 @@
+#include "tests/lib.h"
+
+/* Size of the region touched, several pairs of 64k large pages */
+#define REGION_SIZE (512*1024)
+#define PAGE 4096
+
+int main(void)
+{
+  vmstat_t before, after;
+  char *region;
+  char *end;
+  int ok = 1;
+  int i;
+
+  wrapper_writeString("Starting to test large pages!\n");
+
+  /* 1. Grow the heap so that it covers whole large pages. */
+  region = syscall_memlimit(NULL);
+  end = syscall_memlimit(region + REGION_SIZE);
+  wrapper_writeMlt("1. Heap grown: ", end == region + REGION_SIZE, "\n");
+
+  /* 2. Write every page. The faults map large pages, which are
+        written to the TLB as large entries. */
+  syscall_vmstat(VMSTAT_PROCESS, &before);
+  for (i = 0; i < REGION_SIZE; i += PAGE)
+    region[i] = (char)(i / PAGE);
+  syscall_vmstat(VMSTAT_PROCESS, &after);
+  wrapper_writeMlt("2. Large TLB entries written: ",
+                   after.counter[VMSTAT_TLB_LARGE] >
+                   before.counter[VMSTAT_TLB_LARGE], "\n");
+
+  /* 3. The pages read back what was written. */
+  for (i = 0; i < REGION_SIZE; i += PAGE) {
+    if (region[i] != (char)(i / PAGE))
+      ok = 0;
+  }
+  wrapper_writeMlt("3. Pages are intact: ", ok, "\n");
+
+  wrapper_writeString("Finished testing large pages.\n");
+
+  syscall_exit(0);
+
+  return 0;
+}
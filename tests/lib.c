@@ -94,10 +94,11 @@ int syscall_join(pid_t pid)
 }
 
 
-/* Create a new thread running in the same address space as the
- * caller. The thread is started at function 'func', and the thread
- * will end when 'func' returns. 'arg' is passed as an argument to
- * 'func'. Returns 0 on success or a negative value on error.
+/* Create a new process running in a copy-on-write copy of the
+ * address space of the caller. The process is started at function
+ * 'func', and the process will end when 'func' returns. 'arg' is
+ * passed as an argument to 'func'. Returns the PID of the new process
+ * (which can be joined) or a negative value on error.
  */
 int syscall_fork(void (*func)(int), int arg)
 {
@@ -115,6 +116,40 @@ void *syscall_memlimit(void *heap_end)
 }
 
 
+/* Map 'length' bytes of the file identified by 'filename' in the
+ * address space, shared with the other processes mapping the same
+ * file. If 'writable' is nonzero, the mapping may be written and the
+ * changes are written back to the file after the last mapping of the
+ * file is removed. The file is not extended. Returns the address of
+ * the mapping, or NULL on error.
+ */
+void *syscall_mmap(const char *filename, int length, int writable)
+{
+  return (void*)_syscall(SYSCALL_MMAP, (uint32_t)filename,
+                         (uint32_t)length, (uint32_t)writable);
+}
+
+
+/* Remove the mapping at 'addr' returned by syscall_mmap. Returns 0 on
+ * success, or a negative value on error.
+ */
+int syscall_munmap(void *addr)
+{
+  return (int)_syscall(SYSCALL_MUNMAP, (uint32_t)addr, 0, 0);
+}
+
+
+/* Read the VM and TLB statistics of CPU 'cpu', or of this process if
+ * 'cpu' is VMSTAT_PROCESS, into 'stats'. The counters are indexed with
+ * the VMSTAT_* constants. Returns 0 on success, or a negative value
+ * on error.
+ */
+int syscall_vmstat(int cpu, vmstat_t *stats)
+{
+  return (int)_syscall(SYSCALL_VMSTAT, (uint32_t)cpu, (uint32_t)stats, 0);
+}
+
+
 /* Open the file identified by 'filename' for reading and
  * writing. Returns the file handle of the opened file (positive
  * value), or a negative value on error.
@@ -183,6 +218,23 @@ int syscall_delete(const char *filename)
   return (int)_syscall(SYSCALL_DELETE, (uint32_t)filename, 0, 0);
 }
 
+/* Write all modified filesystem blocks to the disks. Returns 0 on
+ * success and a negative value on error.
+ */
+int syscall_sync(void)
+{
+  return (int)_syscall(SYSCALL_SYNC, 0, 0, 0);
+}
+
+/* Return the number of free bytes on the filesystem mounted as
+ * 'filesystem' (the volume name without brackets), or a negative
+ * value on error.
+ */
+int syscall_getfree(const char *filesystem)
+{
+  return (int)_syscall(SYSCALL_GETFREE, (uint32_t)filesystem, 0, 0);
+}
+
 /* The following functions are not system calls, but convenient
    library functions inspired by POSIX and the C standard library. */
 
@@ -286,17 +338,89 @@ char *strstr(const char *s1, const char *s2)
   return NULL;
 }
 
+/* Set 'n' bytes at 's' to 'c'. Whole words are written, eight at a
+   time, once the target is aligned. */
 void *memset(void *s, int c, size_t n) {
   byte *p = s;
+  uint32_t *words;
+  uint32_t word;
+
+  while (n > 0 && (uint32_t)p % 4 != 0) {
+    *(p++) = c;
+    n--;
+  }
+
+  word = (byte)c;
+  word |= word << 8;
+  word |= word << 16;
+
+  words = (uint32_t*)p;
+  for (; n >= 32; n -= 32) {
+    words[0] = word; words[1] = word; words[2] = word; words[3] = word;
+    words[4] = word; words[5] = word; words[6] = word; words[7] = word;
+    words += 8;
+  }
+  for (; n >= 4; n -= 4) {
+    *(words++) = word;
+  }
+
+  p = (byte*)words;
   while (n-- > 0) {
     *(p++) = c;
   }
   return s;
 }
 
+/* Copy 'n' bytes from 'src' to 'dest', which must not overlap. Works
+   like memcopy in the kernel: whole words are copied once the target
+   is aligned, merging two source words into each target word if the
+   source is aligned differently (big-endian). */
 void *memcpy(void *dest, const void *src, size_t n) {
   byte *d = dest;
   const byte *s = src;
+  uint32_t *dw;
+  const uint32_t *sw;
+  uint32_t w0, w1;
+  size_t words;
+  size_t i;
+  int shift;
+
+  while (n > 0 && (uint32_t)d % 4 != 0) {
+    *(d++) = *(s++);
+    n--;
+  }
+
+  dw = (uint32_t*)d;
+  words = n / 4;
+
+  if ((uint32_t)s % 4 == 0) {
+    sw = (const uint32_t*)s;
+    for (i = words; i >= 8; i -= 8) {
+      w0 = sw[0]; w1 = sw[1]; dw[0] = w0; dw[1] = w1;
+      w0 = sw[2]; w1 = sw[3]; dw[2] = w0; dw[3] = w1;
+      w0 = sw[4]; w1 = sw[5]; dw[4] = w0; dw[5] = w1;
+      w0 = sw[6]; w1 = sw[7]; dw[6] = w0; dw[7] = w1;
+      dw += 8;
+      sw += 8;
+    }
+    for (; i > 0; i--) {
+      *(dw++) = *(sw++);
+    }
+  } else if (words > 0) {
+    shift = 8 * ((uint32_t)s % 4);
+    sw = (const uint32_t*)((uint32_t)s & ~3);
+    w0 = *(sw++);
+    for (i = words; i > 0; i--) {
+      w1 = *(sw++);
+      *(dw++) = (w0 << shift) | (w1 >> (32 - shift));
+      w0 = w1;
+    }
+  }
+
+  d += words * 4;
+  s += words * 4;
+  n -= words * 4;
+
   while (n-- > 0) {
     *(d++) = *(s++);
   }
@@ -763,273 +887,259 @@ int snprintf(char *str, int size, const  char  *fmt, ...) {
 /* Heap allocation. */
 #ifdef PROVIDE_HEAP_ALLOCATOR
 
-typedef struct free_block {
+/* The heap allocator is a segregated fit allocator. Small blocks are
+   rounded up to a size class (a power of two) and kept in a free list
+   of their class when freed, so they are found without searching.
+   Larger blocks are kept in one free list sorted by address. They are
+   allocated first-fit and merged with their free neighbours when
+   freed. The heap grows in chunks of MALLOC_CHUNK bytes, and free
+   memory at the end of the heap is given back to the kernel once
+   there is enough of it. */
+
+/* Every block, free or allocated, starts with this header. */
+typedef struct {
+  /* Size of the block including the header, a multiple of
+     MALLOC_ALIGN */
   size_t size;
+  /* MALLOC_MAGIC ^ size while the block is allocated, zero when it
+     is free. Catches frees of pointers not given by malloc. */
+  uint32_t check;
+} block_header_t;
+
+typedef struct free_block {
+  block_header_t header;
   struct free_block *next;
 } free_block_t;
 
-static const size_t MIN_ALLOC_SIZE = sizeof(free_block_t);
+#define MALLOC_MAGIC 0x6d616c6c
+#define MALLOC_ALIGN 8
+#define MALLOC_MIN_BLOCK 16
 
-free_block_t *free_list = NULL;
+/* Size classes of small blocks: MALLOC_MIN_BLOCK, twice that, and so
+   on up to MALLOC_SMALL_MAX bytes. */
+#define MALLOC_CLASSES 8
+#define MALLOC_SMALL_MAX (MALLOC_MIN_BLOCK << (MALLOC_CLASSES - 1))
 
-byte heap[HEAP_SIZE]; /* obselete */
-void *heap_start = NULL; /* Start address of the heap. */
-void *heap_end = NULL; /* End address of the heap. */
+/* The heap grows at least this much at a time. */
+#define MALLOC_CHUNK (16*4096)
 
-/* Initialise the heap - malloc et al won't work unless this is called
-   first. */
-/* heap_init should now be obselete. */
-void heap_init()
-{
-  free_list = (free_block_t*) heap;
-  free_list->size = HEAP_SIZE;
-  free_list->next = NULL;
-}
+/* When the free block at the end of the heap grows at least this
+   big, free gives all but one chunk of it back to the kernel. */
+#define HEAP_TRIM_THRESHOLD (2*MALLOC_CHUNK)
+
+/* Free small blocks of each size class */
+static free_block_t *small_free[MALLOC_CLASSES];
+
+/* Free large blocks, sorted by address */
+static free_block_t *free_list = NULL;
 
-#define MAX_MALL_PTRS 64
-uint32_t mallptrs[MAX_MALL_PTRS];
-int mallptrs_size;
+static void *heap_start = NULL; /* Start address of the heap. */
+static void *heap_end = NULL; /* End address of the heap. */
 
-/* Initialize the mallptrs array by setting
-   all entries to 0. */
-void mallptrs_init()
+/* Kept for old programs, the heap needs no initialisation. */
+void heap_init()
 {
-  int i;
-  mallptrs_size = 0;
-  for (i=0; i < MAX_MALL_PTRS; i++) {
-    mallptrs[i] = 0;
-  }
 }
 
-/* Insert the adress of a pointer in
-   mallptrs. */
-void *mallptrs_insert(void *ptr)
+/* Return the size class of small blocks of 'size' bytes. */
+static int malloc_class(size_t size)
 {
-  int i;
-  for (i=0; i < MAX_MALL_PTRS; i++) {
-    if (mallptrs[i] == 0) {
-      mallptrs[i] = (uint32_t)ptr;
-      mallptrs_size++;
-      return ptr;
-    }
+  int class = 0;
+
+  while ((size_t)(MALLOC_MIN_BLOCK << class) < size) {
+    class++;
   }
-  printf("mallptrs_insert: array is filled%s\n","");
-  return NULL;
+  return class;
 }
 
-/* Check if the adress of a pointer exists
-   in mallptrs. */
-int mallptrs_member(void *ptr)
+/* Return the header of the allocated block 'ptr', or NULL if 'ptr'
+   was not returned by malloc or it has already been freed. */
+static block_header_t *malloc_header(void *ptr)
 {
-  int i;
-  for (i=0; i < MAX_MALL_PTRS; i++) {
-    if (mallptrs[i] == (uint32_t)ptr) {
-      return 1;
-    }
+  block_header_t *header = (block_header_t*)((byte*)ptr -
+                                             sizeof(block_header_t));
+
+  if ((byte*)header < (byte*)heap_start || ptr >= heap_end ||
+      (uint32_t)ptr % MALLOC_ALIGN != 0 ||
+      header->check != (MALLOC_MAGIC ^ header->size)) {
+    return NULL;
   }
-  return 0;
+  return header;
 }
 
-/* Remove the adress of a pointer from
-   mallptrs. */
-void mallptrs_remove(void *ptr)
+/* Insert 'block' in the list of free large blocks, merging it with
+   its free neighbours. Returns the merged block. */
+static free_block_t *free_list_insert(free_block_t *block)
 {
-  int i;
-  for (i=0; i < MAX_MALL_PTRS; i++) {
-    if (mallptrs[i] == (uint32_t)ptr) {
-      mallptrs[i] = 0;
-      mallptrs_size--;
-      return;
-    }
+  free_block_t *cur_block;
+  free_block_t *prev_block;
+
+  /* Find the position in the list, which is sorted by increasing
+     address. */
+  for (cur_block = free_list, prev_block = NULL;
+       cur_block != NULL && cur_block < block;
+       prev_block = cur_block, cur_block = cur_block->next) {
   }
-  printf("mallptrs_remove: pointer was not in mallptrs%s\n","");
-  return;
-}
 
-/* Return a block of at least size bytes, or NULL if no such block 
-   can be found.  */
-void *malloc(size_t size) {
-  free_block_t *block;
-  free_block_t **prev_p; /* Previous link so we can remove an element */
-  void *old_end, *new_end;
-  free_block_t *new_block, *tmp;  
-
-  if (size == 0) {
-    return NULL;
+  if (prev_block == NULL) {
+    free_list = block;
+  } else {
+    prev_block->next = block;
   }
-
-  if (mallptrs_size >= MAX_MALL_PTRS) {
-    printf("Malloc: mallptrs array is filled up%s\n","");
-    return NULL;
+  block->next = cur_block;
+
+  if (prev_block != NULL &&
+      (size_t)((byte*)block - (byte*)prev_block) == prev_block->header.size) {
+    /* Merge with previous. */
+    prev_block->header.size += block->header.size;
+    prev_block->next = cur_block;
+    block = prev_block;
   }
 
-  /* Ensure block is big enough for bookkeeping. */
-  size=MAX(MIN_ALLOC_SIZE,size);
-  /* Word-align */
-  if (size % 4 != 0) {
-    size &= ~3;
-    size += 4;
+  if (cur_block != NULL &&
+      (size_t)((byte*)cur_block - (byte*)block) == block->header.size) {
+    /* Merge with next. */
+    block->header.size += cur_block->header.size;
+    block->next = cur_block->next;
   }
 
-  /* Iterate through list of free blocks, using the first that is
-     big enough for the request. */
+  return block;
+}
+
+/* Remove a block of at least 'size' bytes from the list of free large
+   blocks, splitting the first one big enough. Returns NULL if there
+   is none. */
+static free_block_t *free_list_take(size_t size)
+{
+  free_block_t *block;
+  free_block_t **prev_p; /* Previous link so we can remove an element */
+  free_block_t *new_block;
+
   for (block = free_list, prev_p = &free_list;
-       block;
+       block != NULL;
        prev_p = &(block->next), block = block->next) {
-    printf("Malloc: Free-list block: pointer %d, size %d, next %d\n"
-	   ,(uint32_t)block,block->size,(block->next != NULL));
-    if ( (int)( block->size - size - sizeof(size_t) ) >= 
-         (int)( MIN_ALLOC_SIZE+sizeof(size_t) ) ) {
-      /* Block is too big, but can be split. */
-      block->size -= size+sizeof(size_t);
-      free_block_t *new_block =
-        (free_block_t*)(((byte*)block)+block->size);
-      new_block->size = size+sizeof(size_t);
-      /*return ((byte*)new_block)+sizeof(size_t);*/
-      return mallptrs_insert(((byte*)new_block)+sizeof(size_t));
-    } else if (block->size >= size + sizeof(size_t)) {
+    if (block->header.size >= size + MALLOC_MIN_BLOCK) {
+      /* Block is too big, give away its end. */
+      block->header.size -= size;
+      new_block = (free_block_t*)((byte*)block + block->header.size);
+      new_block->header.size = size;
+      return new_block;
+    } else if (block->header.size >= size) {
       /* Block is big enough, but not so big that we can split
          it, so just return it */
       *prev_p = block->next;
-      /*return ((byte*)block)+sizeof(size_t);*/
-      return mallptrs_insert(((byte*)block)+sizeof(size_t));
+      return block;
     }
-    /* Else, check the next block. */
   }
+  return NULL;
+}
 
-  /* If no suitable free block was found, we must
-     allocate a new one. */
+/* Grow the heap by at least 'size' bytes and add the new memory to
+   the free list. Returns 0 on success, -1 if the kernel has no more
+   memory to give. */
+static int heap_grow(size_t size)
+{
+  free_block_t *block;
+  void *new_end;
 
-  /* If this is the first time, we get the addresse of
-     our process's heap end, for bookkeeping.
-     And initialize the mallptrs array. */
   if (heap_start == NULL) {
     heap_start = syscall_memlimit(NULL);
-    heap_end = heap_start;
-    mallptrs_init();
-    printf("Malloc: Heap_start: %d\n", (uint32_t)heap_start);
+    heap_end = (void*)(((uint32_t)heap_start + MALLOC_ALIGN - 1) &
+                       ~(MALLOC_ALIGN - 1));
+  }
+
+  size = MAX(size, MALLOC_CHUNK);
+  new_end = (byte*)heap_end + size;
+  if (new_end < heap_end || syscall_memlimit(new_end) != new_end) {
+    return -1;
   }
 
-  printf("Malloc: Size: %d, heapend: %d\n", size, (uint32_t)heap_end); 
+  block = (free_block_t*)heap_end;
+  block->header.size = size;
+  block->header.check = 0;
+  heap_end = new_end;
+  free_list_insert(block);
+  return 0;
+}
 
-  old_end = heap_end;
-  heap_end = (void*)((uint32_t)heap_end + size+ sizeof(size_t));
-  /* Try and allocate more memory */
-  new_end = syscall_memlimit(heap_end);
+/* Return a block of at least size bytes, or NULL if no such block 
+   can be found.  */
+void *malloc(size_t size) {
+  free_block_t *block = NULL;
+  int class;
 
-  /* Check if it was possible to get more memory. */
-  if(new_end == NULL){
-    /* No heap space left. */
-    printf("Malloc: syscall_memlimit returned NULL%s\n","");
-    heap_end = (void*)((uint32_t)heap_end - size+ sizeof(size_t));
+  /* Refuse sizes which would overflow below. */
+  if (size == 0 || size > 0x7fffffff - MALLOC_CHUNK) {
     return NULL;
   }
 
-  printf("Malloc: memlimit returned %d\n", (uint32_t)new_end);
+  /* Add the header and align */
+  size = (size + sizeof(block_header_t) + MALLOC_ALIGN - 1) &
+    ~(MALLOC_ALIGN - 1);
 
-  /* Make sure that the new end is not lower than what
-     the user requested. */
-  if(new_end < heap_end) {
-    printf("Malloc: new_end (%d) was lower than what was requested (%d)\n"
-	   ,(uint32_t)new_end,(uint32_t)heap_end);
-    return NULL;
+  if (size <= MALLOC_SMALL_MAX) {
+    class = malloc_class(size);
+    size = MALLOC_MIN_BLOCK << class;
+    block = small_free[class];
+    if (block != NULL) {
+      small_free[class] = block->next;
+    }
   }
 
-  /* Make sure the new end is not lower than the old.
-     It should not happen. */
-  if(old_end >= new_end) {
-    printf("Malloc: new_end was lower or equal to the old_end%s\n","");
-    heap_end = (void*)((uint32_t)heap_end - size+ sizeof(size_t));
-    return NULL;
+  if (block == NULL) {
+    block = free_list_take(size);
   }
-
-  /* Create a new free block with the size we just allocated. */
-  new_block = (free_block_t*)((byte*)old_end);
-  new_block->size = new_end - old_end;
-  new_block->next = NULL;
-  printf("Malloc: Created free block with size %d and address %d\n",new_block->size, (uint32_t)new_block);
-
-  /* Attach it too the list of free blocks in a 
-     sorted manor. That is at the end. */
-  if (free_list == NULL) {
-    printf("Malloc: free_list is null%s\n","");
-    free_list = new_block;
-  } else {
-    printf("Malloc: free_list is not null%s\n","");
-    tmp = free_list;
-    
-    while (tmp->next != NULL) {
-      tmp = tmp->next;
+  if (block == NULL) {
+    if (heap_grow(size) < 0) {
+      return NULL;
     }
-
-    tmp->next = new_block;
-    printf("Malloc: out of loop%s\n","");
+    block = free_list_take(size);
   }
 
-  /* Update the heap end to the new end address. */
-  heap_end = new_end;
-  
-  /* Recursively call malloc which should now find the free block
-     we just created and fullfill the user request for more memory. */
-  return malloc(size);
+  block->header.check = MALLOC_MAGIC ^ block->header.size;
+  return (byte*)block + sizeof(block_header_t);
 }
 
 /* Return the block pointed to by ptr to the free pool. */
 void free(void *ptr)
 {
+  block_header_t *header;
+  free_block_t *block;
+  void *new_end;
+  int class;
 
-  /* Make sure that the pointer is within the space of
-     the already allocated memory space. */
-  if (ptr < heap_start || ptr > heap_end) {
-    printf("Error: free: ptr (%d) given to free is either below heap_start (%d) or above heap_end (%d)\n"
-	   ,(uint32_t)ptr,(uint32_t)heap_start,(uint32_t)heap_end);
+  if (ptr == NULL) { /* Freeing NULL is a no-op */
     return;
   }
-  
-  /* Make sure that the pointer ptr was previously allocated by malloc. */
-  if (!mallptrs_member(ptr)) {
-    printf("Error: free: pointer %d was not previous allocated by malloc!\n",(uint32_t)ptr);
+
+  header = malloc_header(ptr);
+  if (header == NULL) {
+    printf("Error: free: pointer %d was not allocated by malloc!\n",
+           (uint32_t)ptr);
+    return;
+  }
+  header->check = 0;
+  block = (free_block_t*)header;
+
+  /* Blocks of a size class go to its list. Small blocks are not merged,
+     they are likely to be needed again soon. */
+  if (header->size <= MALLOC_SMALL_MAX &&
+      (header->size & (header->size - 1)) == 0) {
+    class = malloc_class(header->size);
+    block->next = small_free[class];
+    small_free[class] = block;
     return;
   }
-  /* Remove the ptr from the list of allocated pointers. */
-  mallptrs_remove(ptr);
-
-  if (ptr != NULL) { /* Freeing NULL is a no-op */
-    free_block_t *block = (free_block_t*)((byte*)ptr-sizeof(size_t));
-    free_block_t *cur_block;
-    free_block_t *prev_block;
-
-    /* Iterate through the free list, which is sorted by
-       increasing address, and insert the newly freed block at the
-       proper position. */
-    for (cur_block = free_list, prev_block = NULL; 
-         ;
-         prev_block = cur_block, cur_block = cur_block->next) {
-      if (cur_block > block || cur_block == NULL) {
-        /* Insert block here. */
-        if (prev_block == NULL) {
-          free_list = block;
-        } else {
-          prev_block->next = block;
-        }
-        block->next = cur_block;
-
-        if (prev_block != NULL &&
-            (size_t)((byte*)block - (byte*)prev_block) == prev_block->size) {
-          /* Merge with previous. */
-          prev_block->size += block->size;
-          prev_block->next = cur_block;
-          block = prev_block;
-        }
 
-        if (cur_block != NULL &&
-            (size_t)((byte*)cur_block - (byte*)block) == block->size) {
-          /* Merge with next. */
-          block->size += cur_block->size;
-          block->next = cur_block->next;
-        }
-        return;
-      }
+  block = free_list_insert(block);
+
+  if ((byte*)block + block->header.size == (byte*)heap_end &&
+      block->header.size >= HEAP_TRIM_THRESHOLD) {
+    /* Shrink the heap, keeping one chunk for the next allocations. */
+    new_end = (void*)(((uint32_t)block + MALLOC_CHUNK + 4095) & ~4095);
+    if (syscall_memlimit(new_end) == new_end) {
+      block->header.size = (byte*)new_end - (byte*)block;
+      heap_end = new_end;
     }
   }
 }
@@ -1037,7 +1147,13 @@ void free(void *ptr)
 void *calloc(size_t nmemb, size_t size)
 {
   size_t i;
-  byte *ptr = malloc(nmemb*size);
+  byte *ptr;
+
+  if (size != 0 && nmemb > 0xffffffff / size) {
+    return NULL;
+  }
+
+  ptr = malloc(nmemb*size);
   if (ptr != NULL) {
     for (i = 0; i < nmemb*size; i++) {
       ptr[i] = 0;
@@ -1048,7 +1164,9 @@ void *calloc(size_t nmemb, size_t size)
 
 void *realloc(void *ptr, size_t size)
 {
+  block_header_t *header;
   byte *new_ptr;
+  size_t old_size;
   size_t i;
   if (ptr == NULL) {
     return malloc(size);
@@ -1059,12 +1177,20 @@ void *realloc(void *ptr, size_t size)
     return NULL;
   }
 
-  /* Simple implementation: allocate new space and copy the contents
-     over.  Exercise: Improve this by searching through the free
-     list and seeing whether an actual enlargement is possible. */
+  header = malloc_header(ptr);
+  if (header == NULL) {
+    return NULL;
+  }
+
+  /* The block may already be big enough. */
+  old_size = header->size - sizeof(block_header_t);
+  if (size <= old_size) {
+    return ptr;
+  }
+
   new_ptr = malloc(size);
   if (new_ptr != NULL) {
-    for (i = 0; i < size; i++) {
+    for (i = 0; i < old_size; i++) {
       new_ptr[i] = ((byte*)ptr)[i];
     }
     free(ptr);
@@ -53,6 +53,7 @@
 #include <stddef.h>
 
 #include "lib/types.h"
+#include "vm/vmstat.h"
 
 #define MIN(arg1,arg2) ((arg1) > (arg2) ? (arg2) : (arg1))
 #define MAX(arg1,arg2) ((arg1) > (arg2) ? (arg1) : (arg2))
@@ -90,9 +91,14 @@ int syscall_read(int filehandle, void *buffer, int length);
 int syscall_write(int filehandle, const void *buffer, int length);
 int syscall_create(const char *filename, int size);
 int syscall_delete(const char *filename);
+int syscall_sync(void);
+int syscall_getfree(const char *filesystem);
 
 int syscall_fork(void (*func)(int), int arg);
 void *syscall_memlimit(void *heap_end);
+void *syscall_mmap(const char *filename, int length, int writable);
+int syscall_munmap(void *addr);
+int syscall_vmstat(int cpu, vmstat_t *stats);
 
 #ifdef PROVIDE_STRING_FUNCTIONS
 size_t strlen(const char *s);
@@ -122,12 +128,7 @@ int snprintf(char *, int, const char *, ...);
 #endif
 
 #ifdef PROVIDE_HEAP_ALLOCATOR
-#define HEAP_SIZE 256 /* 256 byte heap - puny! */
-void heap_init(); /* Call this once before any other heap functions. */
-void mallptrs_init();
-void *mallptrs_insert(void *ptr);
-int mallptrs_member(void *ptr);
-void mallptrs_remove(void *ptr);
+void heap_init(); /* Obsolete, the heap needs no initialisation. */
 void *calloc(size_t nmemb, size_t size);
 void *malloc(size_t size);
 void free(void *ptr);
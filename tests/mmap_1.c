@@ -0,0 +1,54 @@
+#include "tests/lib.h"
+
+/* The test maps its own executable, which startup.sh writes to the
+   disk as "test". */
+#define MMAP_FILE "[disk1]test"
+
+void child(int arg)
+{
+  char *map = (char *)arg;
+
+  /* The child shares the pages of the mapping with the parent. */
+  wrapper_writeMlt("Child sees the mapped file: ",
+                   map[0] == 0x7f && map[1] == 'E', "\n");
+}
+
+int main(void)
+{
+  char *map;
+  char *map2;
+  int pid;
+
+  wrapper_writeString("Starting to test syscall_mmap!\n");
+
+  /* 1. Map the beginning of the file read-only. */
+  map = syscall_mmap(MMAP_FILE, 2*4096, 0);
+  wrapper_writeMlt("1. Mapped the file: ", map != NULL, "\n");
+
+  /* 2. The file contents are visible through the mapping. */
+  wrapper_writeMlt("2. ELF header is mapped: ",
+                   map[0] == 0x7f && map[1] == 'E' &&
+                   map[2] == 'L' && map[3] == 'F', "\n");
+
+  /* 3. A second mapping of the same file shares the cached pages. */
+  map2 = syscall_mmap(MMAP_FILE, 4096, 0);
+  wrapper_writeMlt("3. Mapped the file again: ",
+                   map2 != NULL && map2 != map && map2[1] == 'E', "\n");
+
+  /* 4. Forked children inherit the mappings. */
+  pid = syscall_fork(&child, (int)map);
+  wrapper_writeMlt("4. Child joined: ", syscall_join(pid) == 0, "\n");
+
+  /* 5. Mappings can be removed, but only at their start address. */
+  wrapper_writeMlt("5. Unmapping the middle fails: ",
+                   syscall_munmap(map + 4096) < 0, "\n");
+  wrapper_writeMlt("6. Unmapped the mappings: ",
+                   syscall_munmap(map) == 0 && syscall_munmap(map2) == 0,
+                   "\n");
+
+  wrapper_writeString("Finished testing syscall_mmap.\n");
+
+  syscall_exit(0);
+
+  return 0;
+}
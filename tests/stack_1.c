@@ -0,0 +1,63 @@
+#include "tests/lib.h"
+
+/* Stack used by each level of recursion */
+#define FRAME_SIZE 1024
+
+/* Recurses depth levels, using about FRAME_SIZE bytes of stack on
+   each. Returns the sum of the levels, computed from values kept on
+   the stack of each level. */
+int recurse(int depth)
+{
+  char frame[FRAME_SIZE];
+  int i;
+
+  for (i = 0; i < FRAME_SIZE; i++)
+    frame[i] = (char)depth;
+
+  if (depth == 0)
+    return 0;
+
+  return recurse(depth - 1) + (unsigned char)frame[FRAME_SIZE - 1];
+}
+
+void child(int depth)
+{
+  syscall_exit(recurse(depth) == depth * (depth + 1) / 2 ? 0 : 1);
+}
+
+void overflow(int depth)
+{
+  /* Never returns, the stack hits the guard page first. */
+  recurse(depth);
+  syscall_exit(0);
+}
+
+int main(void)
+{
+  int sum = 0;
+  int pid;
+  int i;
+
+  wrapper_writeString("Starting to test stack growth!\n");
+
+  /* 1. The stack grows down page by page. 100 levels take about
+        25 pages. */
+  for (i = 1; i <= 100; i++)
+    sum += i;
+  wrapper_writeMlt("1. Deep recursion works: ", recurse(100) == sum, "\n");
+
+  /* 2. The grown stack of a forked child is copied on write. */
+  pid = syscall_fork(&child, 50);
+  wrapper_writeMlt("2. Child recursed: ", syscall_join(pid) == 0, "\n");
+
+  /* 3. Running past the stack limit kills only the process. */
+  pid = syscall_fork(&overflow, 100000);
+  wrapper_writeMlt("3. Stack overflow kills the child: ",
+                   syscall_join(pid) != 0, "\n");
+
+  wrapper_writeString("Finished testing stack growth.\n");
+
+  syscall_exit(0);
+
+  return 0;
+}
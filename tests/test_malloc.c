@@ -1,7 +1,20 @@
 #include "tests/lib.h"
 
+/* Number of small blocks allocated at once, and rounds of the
+   benchmark */
+#define SMALL_COUNT 100
+#define BENCH_ROUNDS 1000
+
+/* Size of the large blocks, big enough to skip the size classes */
+#define LARGE_SIZE 30000
+
 int main (void){
   void *a,*b,*c,*d,*e,*f;
+  char *small[SMALL_COUNT];
+  void *end_before, *end_after;
+  vmstat_t before, after;
+  int ok;
+  int i;
 
   /*
     malloc:
@@ -73,6 +86,80 @@ int main (void){
   free(f);
   printf("---------- 15.0 ----------%s\n","");
 
+  /* Small blocks are aligned, do not overlap and are reused. */
+  ok = 1;
+  for (i = 0; i < SMALL_COUNT; i++) {
+    small[i] = malloc(24);
+    if (small[i] == NULL || (uint32_t)small[i] % 8 != 0) {
+      ok = 0;
+      break;
+    }
+    memset(small[i], i, 24);
+  }
+  for (i = 0; ok && i < SMALL_COUNT; i++) {
+    if (small[i][0] != (char)i || small[i][23] != (char)i) {
+      ok = 0;
+    }
+  }
+  printf("Malloc test: small blocks are intact = %d\n", ok);
+  for (i = 0; ok && i < SMALL_COUNT; i++) {
+    free(small[i]);
+  }
+  a = malloc(20);
+  printf("Malloc test: freed small block is reused = %d\n",
+         a == small[SMALL_COUNT-1]);
+  free(a);
+  printf("---------- 16.0 ----------%s\n","");
+
+  /* Freed neighbouring large blocks merge. */
+  a = malloc(LARGE_SIZE);
+  b = malloc(LARGE_SIZE);
+  end_before = syscall_memlimit(NULL);
+  free(a);
+  free(b);
+  c = malloc(2*LARGE_SIZE);
+  end_after = syscall_memlimit(NULL);
+  printf("Malloc test: merged block is used = %d\n",
+         c != NULL && end_after == end_before);
+  free(c);
+  printf("---------- 17.0 ----------%s\n","");
+
+  /* Free memory at the end of the heap goes back to the kernel. */
+  a = malloc(256*1024);
+  end_before = syscall_memlimit(NULL);
+  free(a);
+  end_after = syscall_memlimit(NULL);
+  printf("Malloc test: heap shrinks = %d\n",
+         a != NULL && end_after < end_before);
+  printf("---------- 18.0 ----------%s\n","");
+
+  /* Benchmark: mixed small allocations. The heap grows in chunks, so
+     this should take only a few page faults and heap growths. */
+  syscall_vmstat(VMSTAT_PROCESS, &before);
+  end_before = syscall_memlimit(NULL);
+  for (i = 0; i < BENCH_ROUNDS; i++) {
+    small[i % SMALL_COUNT] = malloc(8 + (i * 37) % 500);
+    if (i % SMALL_COUNT == SMALL_COUNT - 1) {
+      int j;
+      for (j = 0; j < SMALL_COUNT; j += 2) {
+        free(small[j]);
+      }
+      for (j = 1; j < SMALL_COUNT; j += 2) {
+        free(small[j]);
+      }
+    }
+  }
+  end_after = syscall_memlimit(NULL);
+  syscall_vmstat(VMSTAT_PROCESS, &after);
+  printf("Malloc benchmark: %d allocations, heap grew %d bytes, "
+         "%d page faults, %d pages allocated\n", BENCH_ROUNDS,
+         (uint32_t)end_after - (uint32_t)end_before,
+         after.counter[VMSTAT_PAGE_FAULTS] -
+         before.counter[VMSTAT_PAGE_FAULTS],
+         after.counter[VMSTAT_PAGES_ALLOCATED] -
+         before.counter[VMSTAT_PAGES_ALLOCATED]);
+  printf("---------- 19.0 ----------%s\n","");
+
   syscall_halt();
   return 0;
 }
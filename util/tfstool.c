@@ -50,7 +50,8 @@
 #include "lib/bitmap.h"
 #include "util/tfstool.h"
 
-void tfstool_createvol(char *diskname, int size, char *volumename);
+void tfstool_createvol(char *diskname, int size, char *volumename,
+                       int version);
 void tfstool_list(char *filename);
 void tfstool_write(char *diskname, char *source, char *target);
 unsigned long getfilesize(FILE *fp);
@@ -60,9 +61,29 @@ void tfstool_read(char *diskname, char *source, char *target);
 FILE *openfile(char *filename, const char *mode);
 void read_block(block_t data, int block);
 void write_block(block_t data, int block);
+void tfstool_open(char *diskfilename, const char *mode);
+void tfstool_sync(void);
+tfs_direntry_t *tfstool_direntry(int index);
+int tfstool_find(char *filename);
+uint32_t tfstool_alloc(void);
+uint32_t tfstool_bmap(block_t inode_block, uint32_t n);
+void tfstool_bmap_set(block_t inode_block, uint32_t n, uint32_t bnum);
+void tfstool_free_blocks(block_t inode_block);
 
 FILE *disk;
 
+/* Layout of the opened volume, read from its header block by
+   tfstool_open(). The allocation bitmap and the directory are kept in
+   memory and written back by tfstool_sync(). */
+int volume_version;
+uint32_t volume_blocks;
+uint32_t volume_bitmapblocks;
+uint32_t volume_dirstart;
+uint32_t volume_dirblocks;
+char volume_name[TFS_VOLUMENAME_MAX];
+bitmap_t *volume_bitmap;
+block_t *volume_dir;
+
 void print_usage(void)
 {
     printf("Buenos Trivial Filesystem (TFS) Tool -- Version %s\n\n",
@@ -76,15 +97,21 @@ void print_usage(void)
 
     printf("Usage: tfstool arguments ...\n");
     printf("Commands:\n");
-    printf("  create <image name> <size in %d-byte blocks> <volume name>\n",
-	   TFS_BLOCK_SIZE);
+    printf("  create <image name> <size in %d-byte blocks> <volume name>"
+           " [<format version>]\n", TFS_BLOCK_SIZE);
     printf("  list   <image name>\n");
     printf("  write  <image name> <local file name> [<tfs filename>]\n");
     printf("  read   <image name> <TFS filename> [<local filename>]\n");
     printf("  delete <image name> <TFS filename>\n");
     printf("\n");
-    printf("N.B.: You need to make the size at least 3 blocks in order to\n");
-    printf("      include header, allocaton table and master directory.\n");
+    printf("The format version is 1 (default) or 2. Version 2 volumes can be\n");
+    printf("larger than %d blocks and hold files of up to %d bytes.\n",
+           8*TFS_BLOCK_SIZE, (int)TFS2_MAX_FILESIZE);
+    printf("\n");
+    printf("N.B.: You need to make the size at least 3 blocks (version 2:\n");
+    printf("      %d blocks) in order to include header, allocaton table\n",
+           TFS_ALLOCATION_BLOCK + 1 + TFS2_DIR_BLOCKS_MAX);
+    printf("      and master directory.\n");
     exit(EXIT_FAILURE);
 }
 
@@ -95,13 +122,14 @@ int main(int argc, char *argv[])
     char tfsfilename[TFS_FILENAME_MAX];
     char volumename[TFS_VOLUMENAME_MAX];
     size_t size;
+    int version;
 
 
     if (argc < 3)
         print_usage();
 
     if (!strncmp(argv[1], "create", 6)) {
-        if (argc != 5)
+        if (argc < 5 || argc > 6)
             print_usage();
 
         strncpy(diskfilename, argv[2], FILENAME_MAX);
@@ -109,7 +137,13 @@ int main(int argc, char *argv[])
         strncpy(volumename, argv[4], TFS_VOLUMENAME_MAX);
         volumename[TFS_FILENAME_MAX - 1] = '\0';
 
-        tfstool_createvol(diskfilename, size, volumename);
+        version = 1;
+        if (argc == 6)
+            version = atoi(argv[5]);
+        if (version != 1 && version != 2)
+            print_usage();
+
+        tfstool_createvol(diskfilename, size, volumename, version);
     } else if (!strncmp(argv[1], "list", 4)) {
         if (argc != 3)
             print_usage();
@@ -160,101 +194,352 @@ int main(int argc, char *argv[])
 }
 
 /* Creates a disk volume named 'diskname', the size of the disk is
-   'size' blocks (a block is 512 bytes). */
-void tfstool_createvol(char *diskfilename, int size, char *volumename)
+   'size' blocks (a block is 512 bytes). 'version' is the TFS format
+   version of the volume, 1 or 2. */
+void tfstool_createvol(char *diskfilename, int size, char *volumename,
+                       int version)
 {
     int i;
 
-    uint32_t tfsmagic = htonl(TFS_MAGIC);
-    block_t header, bat;
-    /* The size of the allocation bitmap is one block in the filesystem.
-       We reserve an array of bitmap_t's totaling TFS_BLOCK_SIZE
-       from the stack here.
-    */
-    bitmap_t allocation[TFS_BLOCK_SIZE/sizeof(bitmap_t)];
+    block_t header;
+    tfs2_header_t *header2 = (tfs2_header_t *)header;
+    uint32_t bitmapblocks, dirblocks, sysblocks;
+    /* The allocation bitmap of a version 1 volume is one block, of a
+       version 2 volume as many blocks as needed for 'size' bits. */
+    bitmap_t *allocation;
 
-    bitmap_init(allocation, 8*TFS_BLOCK_SIZE);
     disk = fopen(diskfilename, "r");
     if (disk != NULL) {
 	printf("tfstool: File '%s' already exists?\n", diskfilename);
 	exit(EXIT_FAILURE);
     }
 
+    if (version == 1) {
+        bitmapblocks = 1;
+        dirblocks = 1;
+    } else {
+        bitmapblocks = (size + TFS2_BITMAP_BITS - 1) / TFS2_BITMAP_BITS;
+        dirblocks = TFS2_DIR_BLOCKS_MAX;
+    }
+    sysblocks = TFS_ALLOCATION_BLOCK + bitmapblocks + dirblocks;
+
     /* check that there is room for all headers in the disk */
-    if(size < 3) {
+    if(size < (int)sysblocks) {
 	printf("tfstool: Disk size too small. Disk size must be");
-	printf(" at least 3 blocks.\n");
+	printf(" at least %d blocks.\n", sysblocks);
 	exit(EXIT_FAILURE);
     }
 
-    disk = openfile(diskfilename, "wb");
+    allocation = calloc(bitmapblocks, TFS_BLOCK_SIZE);
+    if (allocation == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
 
-    /* zero the header and block allocation table (bat) blocks */
-    memset(header, 0, TFS_BLOCK_SIZE);
-    memset(bat, 0, TFS_BLOCK_SIZE);
+    disk = openfile(diskfilename, "wb");
 
     /* set up the header block and write it */
-    memcpy(header, &tfsmagic, 4);
-    memcpy(&header[4], volumename, TFS_VOLUMENAME_MAX);
+    memset(header, 0, TFS_BLOCK_SIZE);
+    if (version == 1) {
+        header2->magic = htonl(TFS_MAGIC);
+    } else {
+        header2->magic = htonl(TFS2_MAGIC);
+        header2->totalblocks = htonl(size);
+        header2->bitmapblocks = htonl(bitmapblocks);
+        header2->dirblocks = htonl(dirblocks);
+    }
+    memcpy(header2->volumename, volumename, TFS_VOLUMENAME_MAX);
     write_block(header, TFS_HEADER_BLOCK);
 
-    /* set up the block allocation table block and write it */
-    bitmap_set(allocation, TFS_HEADER_BLOCK, 1);
-    bitmap_set(allocation, TFS_ALLOCATION_BLOCK, 1);
-    bitmap_set(allocation, TFS_DIRECTORY_BLOCK, 1);
-    memcpy(bat, allocation, TFS_BLOCK_SIZE);
-    write_block(bat, TFS_ALLOCATION_BLOCK);
+    /* set up the block allocation table blocks and write them */
+    for (i = 0; i < (int)sysblocks; i++)
+        bitmap_set(allocation, i, 1);
+    for (i = 0; i < (int)bitmapblocks; i++)
+        write_block((uint8_t *)allocation + i * TFS_BLOCK_SIZE,
+                    TFS_ALLOCATION_BLOCK + i);
 
-    /* write zero directory block (the disk is initially empty) */
-    write_block(NULL, TFS_DIRECTORY_BLOCK);
+    /* write zero directory blocks (the disk is initially empty) */
+    for (i = 0; i < (int)dirblocks; i++)
+        write_block(NULL, TFS_ALLOCATION_BLOCK + bitmapblocks + i);
 
     /* Write data blocks. initially empty. Start writing from
-       first data block (blocik num 3). */
-    for (i = 3; i < size; i++)
+       first data block. */
+    for (i = sysblocks; i < size; i++)
 	write_block(NULL, i);
 
     fclose(disk);
+    free(allocation);
+
+    printf("Disk image '%s', volume name '%s', size %d blocks created"
+           " (TFS version %d).\n", diskfilename, volumename, size, version);
+}
+
+/* Opens the disk image 'diskfilename' with the given fopen() mode
+   and reads the layout, the allocation bitmap and the directory of
+   the volume. */
+void tfstool_open(char *diskfilename, const char *mode)
+{
+    block_t header;
+    tfs2_header_t *header2 = (tfs2_header_t *)header;
+    uint32_t i, numblocks;
+
+    disk = openfile(diskfilename, mode);
+    numblocks = tfstool_numblocks(disk);
+
+    read_block(header, TFS_HEADER_BLOCK);
+    memcpy(volume_name, header2->volumename, TFS_VOLUMENAME_MAX);
+    volume_name[TFS_VOLUMENAME_MAX - 1] = '\0';
+
+    if (ntohl(header2->magic) == TFS_MAGIC) {
+        volume_version = 1;
+        volume_blocks = numblocks;
+        if (volume_blocks > 8*TFS_BLOCK_SIZE)
+            volume_blocks = 8*TFS_BLOCK_SIZE;
+        volume_bitmapblocks = 1;
+        volume_dirblocks = 1;
+    } else if (ntohl(header2->magic) == TFS2_MAGIC) {
+        volume_version = 2;
+        volume_blocks = ntohl(header2->totalblocks);
+        if (volume_blocks > numblocks)
+            volume_blocks = numblocks;
+        volume_bitmapblocks = ntohl(header2->bitmapblocks);
+        volume_dirblocks = ntohl(header2->dirblocks);
+
+        if (volume_bitmapblocks * TFS2_BITMAP_BITS < volume_blocks ||
+            volume_dirblocks == 0 || volume_dirblocks > TFS2_DIR_BLOCKS_MAX ||
+            volume_blocks < TFS_ALLOCATION_BLOCK + volume_bitmapblocks
+                            + volume_dirblocks) {
+            printf("tfstool: Invalid TFS version 2 header in '%s'.\n",
+                   diskfilename);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        printf("tfstool: '%s' does not contain a TFS volume.\n",
+               diskfilename);
+        exit(EXIT_FAILURE);
+    }
+    volume_dirstart = TFS_ALLOCATION_BLOCK + volume_bitmapblocks;
+
+    volume_bitmap = malloc(volume_bitmapblocks * TFS_BLOCK_SIZE);
+    volume_dir = malloc(volume_dirblocks * TFS_BLOCK_SIZE);
+    if (volume_bitmap == NULL || volume_dir == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < volume_bitmapblocks; i++)
+        read_block((uint8_t *)volume_bitmap + i * TFS_BLOCK_SIZE,
+                   TFS_ALLOCATION_BLOCK + i);
+    for (i = 0; i < volume_dirblocks; i++)
+        read_block(volume_dir[i], volume_dirstart + i);
+}
+
+/* Writes the allocation bitmap and the directory of the opened
+   volume back to the disk image. */
+void tfstool_sync(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < volume_bitmapblocks; i++)
+        write_block((uint8_t *)volume_bitmap + i * TFS_BLOCK_SIZE,
+                    TFS_ALLOCATION_BLOCK + i);
+    for (i = 0; i < volume_dirblocks; i++)
+        write_block(volume_dir[i], volume_dirstart + i);
+}
+
+/* Returns the directory entry 'index' of the opened volume. */
+tfs_direntry_t *tfstool_direntry(int index)
+{
+    return (tfs_direntry_t *)volume_dir[index / TFS_MAX_FILES]
+        + index % TFS_MAX_FILES;
+}
+
+/* Finds the file 'filename' from the directory of the opened volume.
+   Returns the index of its directory entry, or -1 if not found. */
+int tfstool_find(char *filename)
+{
+    int i;
+
+    for (i = 0; i < (int)(volume_dirblocks * TFS_MAX_FILES); i++) {
+        if (tfstool_direntry(i)->inode != 0 &&
+            strncmp(tfstool_direntry(i)->name, filename,
+                    TFS_FILENAME_MAX) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Allocates a free block from the allocation bitmap of the opened
+   volume. The bitmap is written by tfstool_sync(), so nothing
+   changes on the disk if the volume turns out to be full. */
+uint32_t tfstool_alloc(void)
+{
+    int bnum;
+
+    bnum = bitmap_findnset(volume_bitmap, volume_blocks);
+    if (bnum < 0) {
+        printf("Error: while writing file to tfs-file (disk full?)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return bnum;
+}
+
+/* Returns pointer 'n' of the indirect block 'block', or zero if
+   'block' is zero. */
+static uint32_t tfstool_indirect_get(uint32_t block, uint32_t n)
+{
+    block_t ind;
+
+    if (block == 0)
+        return 0;
+
+    read_block(ind, block);
+    return ntohl(((uint32_t *)ind)[n]);
+}
+
+/* Sets pointer 'n' of the indirect block '*block' (in network byte
+   order) to 'bnum'. The indirect block is allocated if '*block' is
+   zero. */
+static void tfstool_indirect_set(uint32_t *block, uint32_t n, uint32_t bnum)
+{
+    block_t ind;
+
+    if (*block == 0) {
+        memset(ind, 0, TFS_BLOCK_SIZE);
+        *block = htonl(tfstool_alloc());
+    } else {
+        read_block(ind, ntohl(*block));
+    }
+
+    ((uint32_t *)ind)[n] = htonl(bnum);
+    write_block(ind, ntohl(*block));
+}
+
+/* Returns the disk block containing block 'n' of the file whose inode
+   is 'inode_block'. */
+uint32_t tfstool_bmap(block_t inode_block, uint32_t n)
+{
+    tfs2_inode_t *inode = (tfs2_inode_t *)inode_block;
+
+    if (volume_version == 1)
+        return ntohl(((tfs_inode_t *)inode_block)->block[n]);
+
+    if (n < TFS2_DIRECT_BLOCKS)
+        return ntohl(inode->block[n]);
+    n -= TFS2_DIRECT_BLOCKS;
+
+    if (n < TFS2_POINTERS)
+        return tfstool_indirect_get(ntohl(inode->indirect), n);
+    n -= TFS2_POINTERS;
 
-    printf("Disk image '%s', volume name '%s', size %d blocks created.\n",
-           diskfilename, volumename, size);
+    return tfstool_indirect_get(
+        tfstool_indirect_get(ntohl(inode->dindirect), n / TFS2_POINTERS),
+        n % TFS2_POINTERS);
+}
+
+/* Records 'bnum' as block 'n' of the file whose inode is
+   'inode_block'. Indirect blocks are allocated as needed. */
+void tfstool_bmap_set(block_t inode_block, uint32_t n, uint32_t bnum)
+{
+    tfs2_inode_t *inode = (tfs2_inode_t *)inode_block;
+    block_t dind;
+    uint32_t ptr;
+
+    if (volume_version == 1) {
+        ((tfs_inode_t *)inode_block)->block[n] = htonl(bnum);
+        return;
+    }
+
+    if (n < TFS2_DIRECT_BLOCKS) {
+        inode->block[n] = htonl(bnum);
+        return;
+    }
+    n -= TFS2_DIRECT_BLOCKS;
+
+    if (n < TFS2_POINTERS) {
+        tfstool_indirect_set(&inode->indirect, n, bnum);
+        return;
+    }
+    n -= TFS2_POINTERS;
+
+    if (inode->dindirect == 0)
+        tfstool_indirect_set(&inode->dindirect, 0, 0);
+
+    read_block(dind, ntohl(inode->dindirect));
+    ptr = ((uint32_t *)dind)[n / TFS2_POINTERS];
+    tfstool_indirect_set(&ptr, n % TFS2_POINTERS, bnum);
+    ((uint32_t *)dind)[n / TFS2_POINTERS] = ptr;
+    write_block(dind, ntohl(inode->dindirect));
+}
+
+/* Releases the blocks of the file whose inode is 'inode_block',
+   including indirect blocks but not the inode. */
+void tfstool_free_blocks(block_t inode_block)
+{
+    tfs2_inode_t *inode = (tfs2_inode_t *)inode_block;
+    block_t dind;
+    uint32_t i, j, ptr, count;
+
+    if (volume_version == 1) {
+        for (i = 0; i < TFS_BLOCKS_MAX &&
+                 ((tfs_inode_t *)inode_block)->block[i] != 0; i++)
+            bitmap_set(volume_bitmap,
+                       ntohl(((tfs_inode_t *)inode_block)->block[i]), 0);
+        return;
+    }
+
+    count = (ntohl(inode->filesize) + TFS_BLOCK_SIZE - 1) / TFS_BLOCK_SIZE;
+    for (i = 0; i < count; i++)
+        bitmap_set(volume_bitmap, tfstool_bmap(inode_block, i), 0);
+
+    if (inode->indirect != 0)
+        bitmap_set(volume_bitmap, ntohl(inode->indirect), 0);
+
+    if (inode->dindirect != 0) {
+        read_block(dind, ntohl(inode->dindirect));
+        for (j = 0; j < TFS2_POINTERS; j++) {
+            ptr = ntohl(((uint32_t *)dind)[j]);
+            if (ptr != 0)
+                bitmap_set(volume_bitmap, ptr, 0);
+        }
+        bitmap_set(volume_bitmap, ntohl(inode->dindirect), 0);
+    }
 }
 
 /* Copy a file 'source' from host file system to buenos tfs filesystem
    as 'target'. */
 void tfstool_write(char *diskfilename, char *source, char *target) {
-    block_t allocation_block, master_dir, inode_block, data;
-    bitmap_t *bat;
+    block_t inode_block, data;
     tfs_direntry_t *direntry;
     tfs_inode_t *inode;
-    unsigned int i, num_blocks, bnum, inode_bnum;
+    uint32_t i, num_blocks, bnum, inode_bnum, maxsize;
     signed int index;
-    int writeok = 1;
     uint32_t filesize;
 
     /* Pointer to source file in host file system. */
     FILE *source_fp;
     unsigned long source_filesize;
 
-    disk = openfile(diskfilename, "r+");
+    tfstool_open(diskfilename, "r+");
 
     source_fp = openfile(source, "r");
     source_filesize = getfilesize(source_fp);
 
     memset(inode_block, 0, TFS_BLOCK_SIZE);
 
-    /* Read master directory from tfs disk file and find free entry.
-       If there is no free entries or filename already exists exit
-       with error. */
-    read_block(master_dir, TFS_DIRECTORY_BLOCK);
-    direntry = (tfs_direntry_t *)master_dir;
+    /* Find free entry from the directory. If there is no free entries
+       or filename already exists exit with error. */
+    if (tfstool_find(target) >= 0) {
+        printf("File %s already exists in TFS.\n", target);
+        exit(EXIT_FAILURE);
+    }
     index = -1;
-    for(i=0; i < TFS_MAX_FILES; i++) {
-        if(direntry[i].inode == 0 && index == -1) {
+    for(i=0; i < volume_dirblocks * TFS_MAX_FILES; i++) {
+        if(tfstool_direntry(i)->inode == 0) {
             index = i;
-        }
-        if(strncmp(direntry[i].name, target, TFS_FILENAME_MAX) == 0) {
-            printf("File %s already exists in TFS.\n", target);
-            exit(EXIT_FAILURE);
+            break;
         }
     }
     if(index < 0) {
@@ -262,72 +547,54 @@ void tfstool_write(char *diskfilename, char *source, char *target) {
         exit(EXIT_FAILURE);
     }
 
-    /* Read allocation block. Find free block from allocation bitmap and
-       set it reserved (findnset()).Write block from source file to
-       correponding block in tfs file.
+    maxsize = (volume_version == 1) ? TFS_MAX_FILESIZE : TFS2_MAX_FILESIZE;
+    if (source_filesize > maxsize) {
+        printf("Error: File is %ld bytes, but at most %d bytes fit to a"
+               " file -- wrote nothing.\n", source_filesize, maxsize);
+        fclose(source_fp);
+        fclose(disk);
+        exit(EXIT_FAILURE);
+    }
+    num_blocks = (source_filesize + TFS_BLOCK_SIZE - 1) / TFS_BLOCK_SIZE;
 
-       If there is not enough free blocks for file set writeok to zero.
-       Allocation block is then not updated (written back to file) so
-       it soesn't matter that we have written file blocks to disk. */
+    /* Find free blocks from allocation bitmap and set them reserved
+       (findnset()). Write blocks from source file to correponding
+       blocks in tfs file.
 
-    read_block(allocation_block, TFS_ALLOCATION_BLOCK);
-    num_blocks = tfstool_numblocks(disk);
+       If there is not enough free blocks for file, tfstool_alloc()
+       exits. The allocation bitmap is then not written back, so it
+       doesn't matter that we have written file blocks to disk. */
 
-    bat = (bitmap_t *)allocation_block;
     inode = (tfs_inode_t *)inode_block;
+    inode_bnum = tfstool_alloc();
+
+    filesize = 0;
+    for(i=0;i<num_blocks;i++) {
+        bnum = tfstool_alloc();
+        memset(data, 0, TFS_BLOCK_SIZE);
+        filesize += fread(data, 1, TFS_BLOCK_SIZE, source_fp);
+        write_block(data, bnum);
+        tfstool_bmap_set(inode_block, i, bnum);
+    }
 
-    inode_bnum = bitmap_findnset(bat, num_blocks);
-    if(inode_bnum > 2 && inode_bnum < num_blocks) {
-        bnum = 0;
-        filesize = 0;
-        for(i=0;i<num_blocks && filesize < TFS_MAX_FILESIZE;i++) {
-            bnum = bitmap_findnset(bat, num_blocks);
-            if(bnum > 2 && bnum < num_blocks) {
-                filesize += fread(data, 1, TFS_BLOCK_SIZE, source_fp);
-                write_block(data, bnum);
-                inode->block[i] = htonl(bnum);
-
-                if(feof(source_fp))
-                    break;
-            } else {
-		/* No free block was found */
-                writeok = 0;
-                break;
-            }
-        }
-
-        if (filesize != source_filesize) {
-            printf("Error: Only %d bytes (of %ld bytes) fit to the file"
-                   " -- wrote nothing.\n", filesize, source_filesize);
-            fclose(source_fp);
-            fclose(disk);
-            exit(EXIT_FAILURE);
-        }
-
-        if(writeok) {
-	    /* Write allocation block and inode block. Inode must be
-	       written here because we don't earlier know the file size. */
-            inode->filesize = htonl(filesize);
-            write_block(inode_block, inode_bnum);
-
-            direntry[index].inode = htonl(inode_bnum);
-            strncpy(direntry[index].name, target, TFS_FILENAME_MAX);
-            write_block(master_dir, TFS_DIRECTORY_BLOCK);
-
-            write_block(allocation_block, TFS_ALLOCATION_BLOCK);
-        } else {
-            printf("Error: while writing file to tfs-file (disk full?)\n");
-            fclose(source_fp);
-            fclose(disk);
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        printf("Error: Could not allocate inode (disk full?).\n");
+    if (filesize != source_filesize) {
+        printf("Error: Only %d bytes (of %ld bytes) could be read"
+               " -- wrote nothing.\n", filesize, source_filesize);
         fclose(source_fp);
         fclose(disk);
         exit(EXIT_FAILURE);
     }
 
+    /* Write inode block, directory and allocation bitmap. Inode must
+       be written here because we don't earlier know the file size. */
+    inode->filesize = htonl(filesize);
+    write_block(inode_block, inode_bnum);
+
+    direntry = tfstool_direntry(index);
+    direntry->inode = htonl(inode_bnum);
+    strncpy(direntry->name, target, TFS_FILENAME_MAX);
+    tfstool_sync();
+
     fclose(source_fp);
     fclose(disk);
 
@@ -338,48 +605,36 @@ void tfstool_write(char *diskfilename, char *source, char *target) {
 /* Copy a file 'source' from buenos tfs filesystem to host filesystem
    as 'target'. */
 void tfstool_read(char *diskfilename, char *source, char *target) {
-    block_t master_dir;
     block_t inode_block;
     block_t data;
-    tfs_direntry_t *direntry;
     tfs_inode_t *inode;
-    unsigned int i, bnum, size, filesize;
+    unsigned int i, size, filesize;
     signed int index;
-    int count = 0;
+    unsigned int count = 0;
 
     /* target file on host file system */
     FILE *t;
 
-    disk = openfile(diskfilename, "r+");
-    t = openfile(target, "w");
-
+    tfstool_open(diskfilename, "r+");
 
-
-    /* Read directory block of tfs and find the file to be copied. */
-    read_block(master_dir, TFS_DIRECTORY_BLOCK);
-    direntry = (tfs_direntry_t *)master_dir;
-    index = -1;
-    for(i=0; i < TFS_MAX_FILES; i++) {
-        if(strncmp(direntry[i].name, source, TFS_FILENAME_MAX) == 0) {
-            index = i;
-            break;
-        }
-    }
+    /* Find the file to be copied from the directory. */
+    index = tfstool_find(source);
     if(index < 0) {
         printf("File '%s' not found.\n", source);
         exit(EXIT_FAILURE);
     }
 
+    t = openfile(target, "w");
+
     /* Read inode block of the file. */
-    read_block(inode_block, ntohl(direntry[index].inode));
+    read_block(inode_block, ntohl(tfstool_direntry(index)->inode));
     inode = (tfs_inode_t *)inode_block;
 
     /* Get file blocks from inode. read corresponding blocks from tfs
        and write them to host file system. */
     filesize = ntohl(inode->filesize);
-    for (i = 0; i < (int) (TFS_BLOCKS_MAX) &&
-                (bnum = ntohl(inode->block[i])) != 0; i++) {
-        read_block(data, bnum);
+    for (i = 0; count < filesize; i++) {
+        read_block(data, tfstool_bmap(inode_block, i));
 
 	/* If there is less than block size to write, write only that.
 	   Rest of the block doesn't belong and is not wanted to
@@ -388,7 +643,11 @@ void tfstool_read(char *diskfilename, char *source, char *target) {
         if(size > TFS_BLOCK_SIZE)
             size = TFS_BLOCK_SIZE;
 
-        count += fwrite(data, 1, size, t);
+        if (fwrite(data, 1, size, t) != size) {
+            perror("fwrite");
+            exit(EXIT_FAILURE);
+        }
+        count += size;
     }
 
     printf("%d bytes written to file '%s'.\n", count, target);
@@ -400,100 +659,73 @@ void tfstool_read(char *diskfilename, char *source, char *target) {
 
 /* Lists the files in the image file named 'diskfilename'. */
 void tfstool_list(char *diskfilename) {
-    block_t header, master_dir;
     tfs_direntry_t *direntry;
-    unsigned int i;
-    int numblocks;
+    unsigned int i, j, numblocks;
 
-    disk = openfile(diskfilename, "r");
+    tfstool_open(diskfilename, "r");
 
-    read_block(header, TFS_HEADER_BLOCK);
-    read_block(master_dir, TFS_DIRECTORY_BLOCK);
-    direntry = (tfs_direntry_t *)master_dir;
-    numblocks = tfstool_numblocks(disk);
-
-    printf("diskfilename: %s, volume name: %s, volume blocks: %d\n\n",
-           diskfilename, (char *)(header + 4), numblocks);
+    printf("diskfilename: %s, volume name: %s, volume blocks: %d,"
+           " TFS version: %d\n\n",
+           diskfilename, volume_name, volume_blocks, volume_version);
 
     printf("inode  size  name               block numbers\n");
-    for (i = 0; i < TFS_MAX_FILES; i++) {
-        if (direntry[i].inode > 0) {
+    for (i = 0; i < volume_dirblocks * TFS_MAX_FILES; i++) {
+        direntry = tfstool_direntry(i);
+        if (direntry->inode > 0) {
             block_t data;
             tfs_inode_t *inode;
-            int j;
 
             /* We need to fetch each file's inode to get filesize. */
-            read_block(data, ntohl(direntry[i].inode));
+            read_block(data, ntohl(direntry->inode));
             inode = (tfs_inode_t *)data;
 
-            printf("  %3u %5u  %-16s", 
-		   (unsigned int) ntohl(direntry[i].inode),
+            printf("  %3u %5u  %-16.16s", 
+		   (unsigned int) ntohl(direntry->inode),
                    (unsigned int) ntohl(inode->filesize),
-		   direntry[i].name);
-            for (j = 0; j < (int) (TFS_BLOCKS_MAX) && ntohl(inode->block[j]) != 0; j++)
-                printf(" %3u", (unsigned int) ntohl(inode->block[j]));
+		   direntry->name);
+            numblocks = (ntohl(inode->filesize) + TFS_BLOCK_SIZE - 1)
+                / TFS_BLOCK_SIZE;
+            for (j = 0; j < numblocks; j++)
+                printf(" %3u", (unsigned int) tfstool_bmap(data, j));
             printf("\n");
         }
     }
+
+    fclose(disk);
 }
 
 /* Deletes file 'filename' from the disk 'diskfilename'. */
 void tfstool_delete(char *diskfilename, char *filename)
 {
-    block_t allocation_block;
-    block_t master_dir;
     block_t inode_block;
-    bitmap_t *bat;
     tfs_direntry_t *direntry;
-    tfs_inode_t *inode;
     signed int index;
-    unsigned int i;
+    uint32_t inode_bn;
 
-    memset(allocation_block, 0, TFS_BLOCK_SIZE);
-    memset(master_dir, 0, TFS_BLOCK_SIZE);
-    memset(inode_block, 0, TFS_BLOCK_SIZE);
-
-    disk = openfile(diskfilename, "r+");
-
-    /* We read the master_dir and find the inode of the file
-     * named 'filename'. */
-    read_block(master_dir, TFS_DIRECTORY_BLOCK);
-    direntry = (tfs_direntry_t *)master_dir;
-    index = -1;
-    for(i=0; i < TFS_MAX_FILES; i++) {
-        if(strncmp(direntry[i].name, filename, TFS_FILENAME_MAX) == 0) {
-            index = i;
-            break;
-        }
-    }
+    tfstool_open(diskfilename, "r+");
 
+    /* Find the inode of the file named 'filename'. */
+    index = tfstool_find(filename);
     if(index < 0) {
         printf("File '%s' not found.\n", filename);
         exit(EXIT_FAILURE);
-    } else {
-        uint32_t inode_bn;
-        read_block(allocation_block, TFS_ALLOCATION_BLOCK);
-        bat = (bitmap_t *)allocation_block;
-
-        inode_bn = ntohl(direntry[index].inode);
-        read_block(inode_block, inode_bn);
-        inode = (tfs_inode_t *)inode_block;
+    }
 
-        /* Release the blocks reserved for the file. */
-        for (i = 0; i < (int) (TFS_BLOCKS_MAX) && ntohl(inode->block[i]) != 0; i++)
-            bitmap_set(bat, ntohl(inode->block[i]), 0);
+    direntry = tfstool_direntry(index);
+    inode_bn = ntohl(direntry->inode);
+    read_block(inode_block, inode_bn);
 
-        /* Release the inode block */
-        bitmap_set(bat, inode_bn, 0);
+    /* Release the blocks reserved for the file and the inode
+       block. */
+    tfstool_free_blocks(inode_block);
+    bitmap_set(volume_bitmap, inode_bn, 0);
 
-        /* Empty entry in TFS is one with NULL as it's direntry's
-           inode and name[0]. */
-        direntry[index].inode   = 0;
-        direntry[index].name[0] = '\0';
+    /* Empty entry in TFS is one with NULL as it's direntry's
+       inode and name[0]. */
+    direntry->inode   = 0;
+    direntry->name[0] = '\0';
 
-        write_block(allocation_block, TFS_ALLOCATION_BLOCK);
-        write_block(master_dir, TFS_DIRECTORY_BLOCK);
-    }
+    tfstool_sync();
     fclose(disk);
 
     printf("File '%s' deleted from '%s'.\n", filename, diskfilename);
@@ -40,6 +40,8 @@
 #include "kernel/spinlock.h"
 #include "kernel/interrupt.h"
 #include "kernel/assert.h"
+#include "kernel/config.h"
+#include "vm/vmstat.h"
 
 /** @name Page pool
  *
@@ -55,8 +57,14 @@ static bitmap_t *pagepool_free_pages;
 /* Number of physical pages */
 static int pagepool_num_pages;
 
-/* Number of free physical pages */
+/* Number of references (mappings) to each reserved physical page.
+   Pages shared copy-on-write have more than one. */
+static uint16_t *pagepool_refcounts;
+
+/* Number of free physical pages, and the smallest number there has
+   been since boot */
 static int pagepool_num_free_pages;
+static int pagepool_min_free_pages;
 
 /* Number of last staticly reserved page. This is needed to ensure
    that staticly reserved pages are not freed in accident (or in
@@ -66,6 +74,26 @@ static int pagepool_static_end;
 /* Spinlock to handle synchronous access to pagepool_free_pages */
 static spinlock_t pagepool_slock;
 
+/* Free pages which have already been zeroed by the idle threads. These
+   pages are marked reserved in pagepool_free_pages, but they are
+   counted in pagepool_num_free_pages. */
+static uint32_t pagepool_zeroed_pages[CONFIG_PAGEPOOL_ZEROED_PAGES];
+
+/* Number of pages in pagepool_zeroed_pages */
+static int pagepool_num_zeroed_pages;
+
+/* Page which the idle thread of each CPU is zeroing (zero if none)
+   and the offset up to which it has been zeroed. The idle thread is
+   restarted after every interrupt, so the work must be resumable. */
+static uint32_t pagepool_zeroing_page[CONFIG_MAX_CPUS];
+static uint32_t pagepool_zeroing_offset[CONFIG_MAX_CPUS];
+
+/* Number of pages currently being zeroed by the idle threads */
+static int pagepool_num_zeroing_pages;
+
+/* Number of bytes the idle thread zeroes between progress updates */
+#define PAGEPOOL_ZERO_CHUNK 64
+
 /**
  * Pagepool initialization. Finds out number of physical pages and
  * number of staticly reserved physical pages. Marks reserved pages
@@ -82,15 +110,28 @@ void pagepool_init(void)
         (uint32_t *)kmalloc(bitmap_sizeof(pagepool_num_pages));
     bitmap_init(pagepool_free_pages, pagepool_num_pages);
 
+    pagepool_refcounts =
+        (uint16_t *)kmalloc(pagepool_num_pages * sizeof(uint16_t));
+    for (i = 0; i < pagepool_num_pages; i++)
+        pagepool_refcounts[i] = 0;
+
     /* Note that number of reserved pages must be get after we have 
        (staticly) reserved memory for bitmap. */
     num_res_pages = kmalloc_get_reserved_pages();
     pagepool_num_free_pages = pagepool_num_pages - num_res_pages;
     pagepool_static_end = num_res_pages;
+    pagepool_min_free_pages = pagepool_num_free_pages;
 
     for (i = 0; i < num_res_pages; i++)
         bitmap_set(pagepool_free_pages, i, 1);
 
+    pagepool_num_zeroed_pages = 0;
+    pagepool_num_zeroing_pages = 0;
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+        pagepool_zeroing_page[i] = 0;
+        pagepool_zeroing_offset[i] = 0;
+    }
+
     spinlock_reset(&pagepool_slock);
 
     kprintf("Pagepool: Found %d pages of size %d\n", pagepool_num_pages,
@@ -101,7 +142,9 @@ void pagepool_init(void)
 }
 
 /**
- * Finds first free physical page and marks it reserved.  
+ * Finds first free physical page and marks it reserved. Pages which
+ * are not zeroed are preferred, the pre-zeroed pages are used only
+ * when nothing else is left.
  *
  * @return Address of first free physical page, zero if no free pages
  * are available.
@@ -114,55 +157,298 @@ uint32_t pagepool_get_phys_page(void)
     intr_status = _interrupt_disable();
     spinlock_acquire(&pagepool_slock);
     
-    if (pagepool_num_free_pages > 0) {
+    if (pagepool_num_free_pages > pagepool_num_zeroed_pages) {
 	i = bitmap_findnset(pagepool_free_pages,pagepool_num_pages);
 	pagepool_num_free_pages--;
 
         /* There should have been a free page. Check that the pagepool
            internal variables are in synch. */
 	KERNEL_ASSERT(i >= 0 && pagepool_num_free_pages >= 0);
+    } else if (pagepool_num_zeroed_pages > 0) {
+        pagepool_num_zeroed_pages--;
+        pagepool_num_free_pages--;
+        i = pagepool_zeroed_pages[pagepool_num_zeroed_pages] / PAGE_SIZE;
     } else {
         i = 0;
     }
 
+    if (i != 0)
+        pagepool_refcounts[i] = 1;
+    if (pagepool_num_free_pages < pagepool_min_free_pages)
+        pagepool_min_free_pages = pagepool_num_free_pages;
+
     spinlock_release(&pagepool_slock);
     _interrupt_set_state(intr_status);
+
+    if (i != 0)
+        vmstat_add(VMSTAT_PAGES_ALLOCATED, 1);
     return i*PAGE_SIZE;
 }
 
 /**
- * Frees given page. Given page should be reserved, but not staticly
- * reserved.
+ * Reserves count physically contiguous pages, aligned to count pages.
+ * Used to back large pages (see vm_map_large). Each page gets its own
+ * reference and is freed separately. The pre-zeroed pages are not
+ * used, and neither are the contents of the pages cleared.
+ *
+ * @param count Number of pages, a power of two
+ *
+ * @return Physical address of the first page, zero if no aligned
+ * free run of count pages was found.
+ */
+uint32_t pagepool_get_phys_pages(int count)
+{
+    interrupt_status_t intr_status;
+    int start = 0;
+    int i;
+    int j;
+
+    KERNEL_ASSERT(count > 0 && (count & (count - 1)) == 0);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_slock);
+
+    if (pagepool_num_free_pages - pagepool_num_zeroed_pages >= count) {
+        i = (pagepool_static_end + count - 1) & ~(count - 1);
+        for (; i + count <= pagepool_num_pages; i += count) {
+            for (j = 0; j < count; j++) {
+                if (bitmap_get(pagepool_free_pages, i + j))
+                    break;
+            }
+            if (j == count) {
+                start = i;
+                break;
+            }
+        }
+    }
+
+    if (start != 0) {
+        for (j = 0; j < count; j++) {
+            bitmap_set(pagepool_free_pages, start + j, 1);
+            pagepool_refcounts[start + j] = 1;
+        }
+        pagepool_num_free_pages -= count;
+        if (pagepool_num_free_pages < pagepool_min_free_pages)
+            pagepool_min_free_pages = pagepool_num_free_pages;
+    }
+
+    spinlock_release(&pagepool_slock);
+    _interrupt_set_state(intr_status);
+
+    if (start != 0)
+        vmstat_add(VMSTAT_PAGES_ALLOCATED, count);
+    return start*PAGE_SIZE;
+}
+
+/**
+ * Reserves a physical page whose contents are all zero. A page zeroed
+ * in advance by the idle threads is used if one is available,
+ * otherwise a free page is cleared synchronously.
+ *
+ * @return Address of the reserved physical page, zero if no free
+ * pages are available.
+ */
+uint32_t pagepool_get_zeroed_page(void)
+{
+    interrupt_status_t intr_status;
+    uint32_t phys_addr = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_slock);
+
+    if (pagepool_num_zeroed_pages > 0) {
+        pagepool_num_zeroed_pages--;
+        pagepool_num_free_pages--;
+        phys_addr = pagepool_zeroed_pages[pagepool_num_zeroed_pages];
+        pagepool_refcounts[phys_addr / PAGE_SIZE] = 1;
+        if (pagepool_num_free_pages < pagepool_min_free_pages)
+            pagepool_min_free_pages = pagepool_num_free_pages;
+    }
+
+    spinlock_release(&pagepool_slock);
+    _interrupt_set_state(intr_status);
+
+    if (phys_addr != 0) {
+        vmstat_add(VMSTAT_PAGES_ALLOCATED, 1);
+    } else {
+        phys_addr = pagepool_get_phys_page();
+        if (phys_addr != 0)
+            memoryset((void *)ADDR_PHYS_TO_KERNEL(phys_addr), 0, PAGE_SIZE);
+    }
+
+    return phys_addr;
+}
+
+/**
+ * Zeroes free pages until CONFIG_PAGEPOOL_ZEROED_PAGES of them are
+ * ready or no free pages are left. Called by the idle thread of each
+ * CPU before it goes to sleep. The idle thread is restarted after
+ * every interrupt, so the page being zeroed and the progress are
+ * remembered per CPU and the work continues where it was left off.
+ */
+void pagepool_zero_free_pages(void)
+{
+    interrupt_status_t intr_status;
+    uint32_t *chunk;
+    int cpu;
+    int i;
+
+    cpu = _interrupt_getcpu();
+
+    while (1) {
+        if (pagepool_zeroing_page[cpu] == 0) {
+            intr_status = _interrupt_disable();
+            spinlock_acquire(&pagepool_slock);
+
+            if (pagepool_num_zeroed_pages + pagepool_num_zeroing_pages
+                >= CONFIG_PAGEPOOL_ZEROED_PAGES
+                || pagepool_num_free_pages <= pagepool_num_zeroed_pages) {
+                spinlock_release(&pagepool_slock);
+                _interrupt_set_state(intr_status);
+                return;
+            }
+
+            i = bitmap_findnset(pagepool_free_pages, pagepool_num_pages);
+            KERNEL_ASSERT(i >= 0);
+            pagepool_num_free_pages--;
+            pagepool_num_zeroing_pages++;
+            pagepool_zeroing_offset[cpu] = 0;
+            pagepool_zeroing_page[cpu] = i * PAGE_SIZE;
+
+            spinlock_release(&pagepool_slock);
+            _interrupt_set_state(intr_status);
+        }
+
+        /* An interrupt may restart us in the middle of a chunk, in
+           which case the whole chunk is simply zeroed again. */
+        while (pagepool_zeroing_offset[cpu] < PAGE_SIZE) {
+            chunk = (uint32_t *)
+                ADDR_PHYS_TO_KERNEL(pagepool_zeroing_page[cpu]
+                                    + pagepool_zeroing_offset[cpu]);
+            for (i = 0; i < PAGEPOOL_ZERO_CHUNK / 4; i++)
+                chunk[i] = 0;
+            pagepool_zeroing_offset[cpu] += PAGEPOOL_ZERO_CHUNK;
+        }
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&pagepool_slock);
+
+        pagepool_zeroed_pages[pagepool_num_zeroed_pages] =
+            pagepool_zeroing_page[cpu];
+        pagepool_num_zeroed_pages++;
+        pagepool_num_free_pages++;
+        pagepool_num_zeroing_pages--;
+        pagepool_zeroing_page[cpu] = 0;
+
+        spinlock_release(&pagepool_slock);
+        _interrupt_set_state(intr_status);
+    }
+}
+
+/**
+ * Releases a reference to the given page. The page is freed when its
+ * last reference is released. Given page should be reserved, but not
+ * staticly reserved.
  *
  * @param phys_addr Page to be freed.
  */
 void pagepool_free_phys_page(uint32_t phys_addr)
+{
+    pagepool_free_phys_pages(&phys_addr, 1);
+}
+
+/**
+ * Releases a reference to each of the given pages, freeing the pages
+ * whose last reference was released. Equivalent to calling
+ * pagepool_free_phys_page for each of them, but the page pool is
+ * locked only once.
+ *
+ * @param phys_addrs Pages to be freed.
+ *
+ * @param count Number of pages in phys_addrs.
+ */
+void pagepool_free_phys_pages(uint32_t *phys_addrs, int count)
 {
     interrupt_status_t intr_status;
-    int i;
+    int i, page;
+    int freed = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_slock);
+
+    for (i = 0; i < count; i++) {
+        page = phys_addrs[i] / PAGE_SIZE;
+
+        /* A page allocated by kmalloc should not be freed. */
+        KERNEL_ASSERT(page >= pagepool_static_end);
 
-    i = phys_addr / PAGE_SIZE;
+        /* Check that the page was reserved. */
+        KERNEL_ASSERT(bitmap_get(pagepool_free_pages, page) == 1);
+        KERNEL_ASSERT(pagepool_refcounts[page] > 0);
 
-    /* A page allocated by kmalloc should not be freed. */
-    KERNEL_ASSERT(i >= pagepool_static_end);
+        pagepool_refcounts[page]--;
+        if (pagepool_refcounts[page] == 0) {
+            bitmap_set(pagepool_free_pages, page, 0);
+            pagepool_num_free_pages++;
+            freed++;
+        }
+    }
+
+    spinlock_release(&pagepool_slock);
+    _interrupt_set_state(intr_status);
+
+    if (freed > 0)
+        vmstat_add(VMSTAT_PAGES_FREED, freed);
+}
+
+/**
+ * Adds a reference to the given reserved page. The page will not be
+ * freed before the reference is released with pagepool_free_phys_page.
+ *
+ * @param phys_addr The page
+ */
+void pagepool_ref_phys_page(uint32_t phys_addr)
+{
+    interrupt_status_t intr_status;
+    int page = phys_addr / PAGE_SIZE;
 
     intr_status = _interrupt_disable();
     spinlock_acquire(&pagepool_slock);
-    
-    /* Check that the page was reserved. */
-    KERNEL_ASSERT(bitmap_get(pagepool_free_pages, i) == 1);
 
-    bitmap_set(pagepool_free_pages, i, 0);
-    pagepool_num_free_pages++;
+    KERNEL_ASSERT(page >= pagepool_static_end);
+    KERNEL_ASSERT(pagepool_refcounts[page] > 0);
+    pagepool_refcounts[page]++;
 
     spinlock_release(&pagepool_slock);
     _interrupt_set_state(intr_status);
 }
 
+/**
+ * Returns the number of references to the given reserved page.
+ *
+ * @param phys_addr The page
+ *
+ * @return Number of references
+ */
+int pagepool_get_refcount(uint32_t phys_addr)
+{
+    return pagepool_refcounts[phys_addr / PAGE_SIZE];
+}
+
 int pagepool_get_num_free_pages()
 {
   return pagepool_num_free_pages;
 }
 
-/** @} */
+/**
+ * Returns the smallest number of free physical pages there has been
+ * since boot.
+ *
+ * @return Number of pages
+ */
+int pagepool_get_min_free_pages(void)
+{
+    return pagepool_min_free_pages;
+}
 
+/** @} */
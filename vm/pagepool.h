@@ -45,8 +45,15 @@
 
 void pagepool_init(void);
 uint32_t pagepool_get_phys_page(void);
+uint32_t pagepool_get_zeroed_page(void);
+uint32_t pagepool_get_phys_pages(int count);
+void pagepool_zero_free_pages(void);
 void pagepool_free_phys_page(uint32_t phys_addr);
+void pagepool_free_phys_pages(uint32_t *phys_addrs, int count);
+void pagepool_ref_phys_page(uint32_t phys_addr);
+int pagepool_get_refcount(uint32_t phys_addr);
 
 int pagepool_get_num_free_pages();
+int pagepool_get_min_free_pages(void);
 
 #endif /* BUENOS_VM_PAGEPOOL_H */
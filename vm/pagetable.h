@@ -38,20 +38,67 @@
 #define BUENOS_VM_PAGETABLE_H
 
 #include "lib/libc.h"
+#include "kernel/config.h"
 #include "vm/tlb.h"
 
-/* Number of mapping entries in one pagetable. This is the number
-   of entries that fits on a single hardware memory page (4k). */
-#define PAGETABLE_ENTRIES 340
+/* A page table entry describing one virtual page. The layout matches
+   the CP0 EntryLo0 and EntryLo1 registers, so two consecutive entries
+   (an even and an odd page) can be written to the TLB as such. */
+typedef struct {
+    /* Set in invalid entries of pages evicted to swap, the PFN field
+       holds the swap slot then. Not used by the hardware. */
+    unsigned int S:1        __attribute__ ((packed));
+    /* Set in the entries of pages mapped as a large page (see
+       vm_map_large). Only a hint, the TLB refill handler passes these
+       pairs on to tlb_update, which checks that the large page is
+       still intact. Not used by the hardware. */
+    unsigned int L:1        __attribute__ ((packed));
+    unsigned int dummy:4    __attribute__ ((packed));
+    /* Physical page number */
+    unsigned int PFN:20     __attribute__ ((packed));
+    /* Cache settings. Not used. */
+    unsigned int C:3        __attribute__ ((packed));
+    /* Dirty bit. If this is 0, page is write protected. */
+    unsigned int D:1        __attribute__ ((packed));
+    /* Valid bit */
+    unsigned int V:1        __attribute__ ((packed));
+    /* Global bit. Never set for userland mappings. */
+    unsigned int G:1        __attribute__ ((packed));
+} pte_t;
 
-/* A pagetable. This structure fits on one physical page (4k). */
+/* Number of entries in one second level page table. One second level
+   table fills one page and maps 4MB of virtual memory. */
+#define PAGETABLE_PTES 1024
+
+/* Number of entries in the page directory. Together the second level
+   tables cover the 2GB userland segment (kuseg). */
+#define PAGETABLE_DIRECTORY_ENTRIES 512
+
+/* Indices of the directory entry and the second level table entry
+   of a (userland) virtual address. */
+#define PAGETABLE_DIRECTORY_INDEX(vaddr) ((vaddr) >> 22)
+#define PAGETABLE_PTE_INDEX(vaddr) (((vaddr) >> 12) & (PAGETABLE_PTES - 1))
+
+/* Number of pages in a large page and its size. A large page is
+   physically contiguous and aligned to its size both physically and
+   virtually. One TLB entry maps a pair of large pages. */
+#define PAGETABLE_LARGE_PAGES 16
+#define PAGETABLE_LARGE_SIZE (PAGETABLE_LARGE_PAGES * 4096)
+
+/* A two level pagetable. This structure fits on one physical page
+   (4k), the second level tables are allocated on demand, one page
+   each. */
 typedef struct pagetable_struct_t{
-    /* Address space identifier. We use Thread Ids in Buenos. */
-    uint32_t ASID;
-    /* Number of valid consecutive mappings in this pagetable. */
+    /* Number of valid mappings in this pagetable. */
     uint32_t valid_count;
-    /* Actual virtual memory mapping entries*/
-    tlb_entry_t entries[PAGETABLE_ENTRIES];
+    /* Second level tables (kernel addresses), NULL if the 4MB region
+       has no mappings. */
+    pte_t *directory[PAGETABLE_DIRECTORY_ENTRIES];
+    /* Address space identifier on each CPU, valid only if the
+       generation matches the current ASID generation of the CPU. All
+       threads using the pagetable share it. See tlb_activate. */
+    uint32_t asid[CONFIG_MAX_CPUS];
+    uint32_t asid_generation[CONFIG_MAX_CPUS];
 } pagetable_t;
 
 #endif /* BUENOS_VM_PAGETABLE_H */
@@ -0,0 +1,565 @@
+/*
+ * Swap
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "vm/swap.h"
+#include "vm/vmstat.h"
+#include "vm/vm.h"
+#include "vm/pagepool.h"
+#include "vm/tlb.h"
+#include "drivers/bootargs.h"
+#include "drivers/device.h"
+#include "drivers/yams.h"
+#include "kernel/kmalloc.h"
+#include "kernel/spinlock.h"
+#include "kernel/assert.h"
+
+/** @name Swap
+ *
+ * Userland pages are evicted to a swap disk when the page pool runs
+ * out of free pages. The disk is selected with the boot argument
+ * swapdisk, which gives the number of the disk device. Without it
+ * nothing is ever evicted.
+ *
+ * The pages are chosen with the clock (second chance) algorithm. The
+ * hardware has no referenced bits, so they are emulated with the
+ * valid bits: when the clock hand passes a mapped page, the page is
+ * invalidated but kept in memory. If the page is accessed before the
+ * hand comes around again, the page fault just validates it again.
+ * Otherwise the page is written to a swap slot, the page table entry
+ * is marked swapped (S) and records the slot, and the page is freed.
+ * The page is read back on the next page fault.
+ *
+ * Only pages mapped in exactly one place can be evicted. Each such
+ * physical page records its owner (the page table and the virtual
+ * address mapping it). Pages shared copy-on-write or through the text
+ * cache stay in memory.
+ *
+ * The swap lock protects the owners, the swap slots and the page
+ * table entries of evictable pages: the clock hand changes page table
+ * entries of other processes.
+ *
+ * @{
+ */
+
+/* The mapping of a physical page which may be evicted */
+typedef struct {
+    /* Pagetable mapping the page, NULL if the page is not evictable */
+    pagetable_t *pagetable;
+    /* Virtual address of the mapping */
+    uint32_t vaddr;
+} swap_owner_t;
+
+/* Owners of the physical pages, indexed by physical page number */
+static swap_owner_t *swap_owners;
+
+/* Number of physical pages */
+static uint32_t swap_num_frames;
+
+/* Physical page at the clock hand */
+static uint32_t swap_clock_hand;
+
+/* The swap disk, NULL if swapping is disabled */
+static gbd_t *swap_disk;
+
+/* Number of disk blocks in one swap slot (one page) */
+static uint32_t swap_blocks_per_slot;
+
+/* Number of references (swapped page table entries) to each swap
+   slot, zero for free slots. Slots are shared by fork. */
+static uint8_t *swap_slot_refs;
+
+/* Number of slots on the swap disk, and free slots */
+static uint32_t swap_num_slots;
+static uint32_t swap_num_free_slots;
+
+/* Next slot to try when allocating */
+static uint32_t swap_next_slot;
+
+static spinlock_t swap_slock;
+
+/**
+ * Initializes the swap. Selects the swap disk given by the boot
+ * argument swapdisk. Called by vm_init after the page pool is
+ * initialized but before kmalloc is disabled.
+ */
+void swap_init(void)
+{
+    device_t *dev;
+    uint32_t i;
+
+    spinlock_reset(&swap_slock);
+
+    swap_num_frames = kmalloc_get_numpages();
+    swap_owners = (swap_owner_t *)kmalloc(swap_num_frames *
+                                          sizeof(swap_owner_t));
+    for (i = 0; i < swap_num_frames; i++)
+        swap_owners[i].pagetable = NULL;
+    swap_clock_hand = 0;
+
+    swap_disk = NULL;
+    swap_num_slots = 0;
+    swap_num_free_slots = 0;
+    swap_next_slot = 0;
+
+    if (bootargs_get("swapdisk") == NULL)
+        return;
+
+    dev = device_get(YAMS_TYPECODE_DISK, atoi(bootargs_get("swapdisk")));
+    if (dev == NULL || dev->generic_device == NULL) {
+        kprintf("Swap: No disk %s, swapping disabled\n",
+                bootargs_get("swapdisk"));
+        return;
+    }
+
+    swap_disk = (gbd_t *)dev->generic_device;
+    KERNEL_ASSERT(PAGE_SIZE % swap_disk->block_size(swap_disk) == 0);
+    swap_blocks_per_slot = PAGE_SIZE / swap_disk->block_size(swap_disk);
+
+    /* The slot is stored in the PFN field of the page table entry. */
+    swap_num_slots = MIN(swap_disk->total_blocks(swap_disk) /
+                         swap_blocks_per_slot, 1 << 20);
+    swap_num_free_slots = swap_num_slots;
+
+    swap_slot_refs = (uint8_t *)kmalloc(swap_num_slots);
+    for (i = 0; i < swap_num_slots; i++)
+        swap_slot_refs[i] = 0;
+
+    kprintf("Swap: Using disk %s, %d slots of size %d\n",
+            bootargs_get("swapdisk"), swap_num_slots, PAGE_SIZE);
+}
+
+/**
+ * Returns the swap disk, which must not be used for anything else.
+ *
+ * @return The swap disk, NULL if swapping is disabled.
+ */
+gbd_t *swap_get_disk(void)
+{
+    return swap_disk;
+}
+
+/**
+ * Returns the number of free swap slots.
+ */
+int swap_get_num_free_slots(void)
+{
+    return swap_num_free_slots;
+}
+
+/**
+ * Takes the swap lock. Interrupts are disabled while it is held.
+ *
+ * @return Interrupt state to be given to swap_unlock
+ */
+interrupt_status_t swap_lock(void)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&swap_slock);
+
+    return intr_status;
+}
+
+/**
+ * Releases the swap lock.
+ *
+ * @param intr_status Interrupt state returned by swap_lock
+ */
+void swap_unlock(interrupt_status_t intr_status)
+{
+    spinlock_release(&swap_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Records the only mapping of a physical page, making the page
+ * evictable. The swap lock must be held.
+ *
+ * @param phys_addr The physical page
+ *
+ * @param pagetable Pagetable mapping the page
+ *
+ * @param vaddr Virtual address of the mapping
+ */
+void swap_set_owner(uint32_t phys_addr, pagetable_t *pagetable,
+                    uint32_t vaddr)
+{
+    KERNEL_ASSERT(phys_addr / PAGE_SIZE < swap_num_frames);
+
+    swap_owners[phys_addr / PAGE_SIZE].pagetable = pagetable;
+    swap_owners[phys_addr / PAGE_SIZE].vaddr     = vaddr;
+}
+
+/**
+ * Forgets the owner of a physical page if it is the given pagetable.
+ * Called when a mapping is removed or the page becomes shared. The
+ * swap lock must be held.
+ *
+ * @param phys_addr The physical page
+ *
+ * @param pagetable Pagetable which is not going to map the page alone
+ */
+void swap_clear_owner(uint32_t phys_addr, pagetable_t *pagetable)
+{
+    KERNEL_ASSERT(phys_addr / PAGE_SIZE < swap_num_frames);
+
+    if (swap_owners[phys_addr / PAGE_SIZE].pagetable == pagetable)
+        swap_owners[phys_addr / PAGE_SIZE].pagetable = NULL;
+}
+
+/**
+ * Adds a reference to a swap slot, for a swapped entry copied by
+ * fork. The swap lock must be held.
+ *
+ * @param slot The swap slot
+ */
+void swap_ref_slot(uint32_t slot)
+{
+    KERNEL_ASSERT(slot < swap_num_slots && swap_slot_refs[slot] > 0);
+    KERNEL_ASSERT(swap_slot_refs[slot] < 255);
+
+    swap_slot_refs[slot]++;
+}
+
+/**
+ * Removes a reference to a swap slot, freeing the slot when the last
+ * reference is gone. The swap lock must be held.
+ *
+ * @param slot The swap slot
+ */
+void swap_free_slot(uint32_t slot)
+{
+    KERNEL_ASSERT(slot < swap_num_slots && swap_slot_refs[slot] > 0);
+
+    if (--swap_slot_refs[slot] == 0)
+        swap_num_free_slots++;
+}
+
+/**
+ * Reserves a free swap slot. The swap lock must be held.
+ *
+ * @return The slot, or negative if the swap disk is full.
+ */
+static int swap_alloc_slot(void)
+{
+    uint32_t i;
+    uint32_t slot;
+
+    if (swap_num_free_slots == 0)
+        return -1;
+
+    for (i = 0; i < swap_num_slots; i++) {
+        slot = (swap_next_slot + i) % swap_num_slots;
+        if (swap_slot_refs[slot] == 0) {
+            swap_slot_refs[slot] = 1;
+            swap_num_free_slots--;
+            swap_next_slot = (slot + 1) % swap_num_slots;
+            return slot;
+        }
+    }
+
+    KERNEL_PANIC("Swap: free slot count is wrong");
+    return -1;
+}
+
+/**
+ * Reads or writes one page to a swap slot. Sleeps until the transfer
+ * is complete. Interrupts are enabled meanwhile, since this may be
+ * called from an exception handler.
+ *
+ * @param slot The swap slot
+ *
+ * @param phys_addr The physical page
+ *
+ * @param write 1 to write the page to the slot, 0 to read it
+ *
+ * @return 0 on success, negative on disk error.
+ */
+static int swap_transfer(uint32_t slot, uint32_t phys_addr, int write)
+{
+    interrupt_status_t intr_status;
+    gbd_request_t request;
+    uint32_t block_size = swap_disk->block_size(swap_disk);
+    uint32_t i;
+    int ret = 1;
+
+    intr_status = _interrupt_enable();
+
+    for (i = 0; i < swap_blocks_per_slot && ret != 0; i++) {
+        request.block = slot * swap_blocks_per_slot + i;
+        request.buf   = phys_addr + i * block_size;
+        request.sem   = NULL;
+
+        if (write)
+            ret = swap_disk->write_block(swap_disk, &request);
+        else
+            ret = swap_disk->read_block(swap_disk, &request);
+    }
+
+    _interrupt_set_state(intr_status);
+
+    return (ret != 0) ? 0 : -1;
+}
+
+/**
+ * Advances the clock hand until one page has been evicted to swap.
+ * Mapped pages passed by the hand are invalidated (given a second
+ * chance), pages which have stayed invalid since the last pass are
+ * written to swap and freed. The caller must be able to sleep.
+ *
+ * @return 1 if a page was freed, 0 if no page could be evicted.
+ */
+static int swap_evict_page(void)
+{
+    interrupt_status_t intr_status;
+    swap_owner_t *owner;
+    pagetable_t *pagetable;
+    uint32_t phys_addr;
+    uint32_t vaddr;
+    tlb_asids_t asids;
+    uint32_t steps;
+    int slot;
+    int evicted;
+    pte_t *pte;
+
+    if (swap_disk == NULL)
+        return 0;
+
+    /* Two rounds: the first one may only give second chances. */
+    for (steps = 0; steps < 2 * swap_num_frames; steps++) {
+        intr_status = swap_lock();
+
+        phys_addr = swap_clock_hand * PAGE_SIZE;
+        owner = &swap_owners[swap_clock_hand];
+        swap_clock_hand = (swap_clock_hand + 1) % swap_num_frames;
+
+        if (owner->pagetable == NULL ||
+            pagepool_get_refcount(phys_addr) != 1) {
+            swap_unlock(intr_status);
+            continue;
+        }
+
+        pagetable = owner->pagetable;
+        vaddr = owner->vaddr;
+        pte = vm_get_pte(pagetable, vaddr);
+        KERNEL_ASSERT(pte != NULL && !pte->S &&
+                      pte->PFN == phys_addr / PAGE_SIZE);
+
+        if (pte->V) {
+            /* Give a second chance. The page is mapped again on the
+               next access, after which it is seen as referenced. */
+            pte->V = 0;
+            /* The pagetable may be destroyed once the lock is
+               released. */
+            tlb_get_asids(pagetable, &asids);
+            swap_unlock(intr_status);
+            tlb_shootdown_asids(&asids, &vaddr, 1);
+            continue;
+        }
+
+        slot = swap_alloc_slot();
+        if (slot < 0) {
+            swap_unlock(intr_status);
+            return 0;
+        }
+
+        /* Keep the page while it is being written, even if the owner
+           unmaps it meanwhile. */
+        pagepool_ref_phys_page(phys_addr);
+        swap_unlock(intr_status);
+
+        if (swap_transfer(slot, phys_addr, 1) < 0) {
+            kprintf("Swap: Write to slot %d failed\n", slot);
+            intr_status = swap_lock();
+            swap_free_slot(slot);
+            swap_unlock(intr_status);
+            pagepool_free_phys_page(phys_addr);
+            return 0;
+        }
+
+        /* The page was written while invalid, so it is up to date
+           unless the owner validated it or unmapped it meanwhile. */
+        intr_status = swap_lock();
+        evicted = 0;
+        if (owner->pagetable == pagetable && owner->vaddr == vaddr &&
+            !pte->V && pte->PFN == phys_addr / PAGE_SIZE) {
+            pte->S   = 1;
+            pte->PFN = slot;
+            owner->pagetable = NULL;
+            evicted = 1;
+        } else {
+            swap_free_slot(slot);
+        }
+        swap_unlock(intr_status);
+
+        pagepool_free_phys_page(phys_addr);
+        if (evicted) {
+            /* The reference of the mapping */
+            pagepool_free_phys_page(phys_addr);
+            vmstat_add(VMSTAT_EVICTIONS, 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reserves a physical page for a userland page, evicting pages to
+ * swap if no free pages are left. The caller must be able to sleep.
+ *
+ * @param zeroed 1 if the page must be filled with zeros
+ *
+ * @return Address of the physical page, 0 if none could be freed.
+ */
+uint32_t swap_get_page(int zeroed)
+{
+    uint32_t phys_addr;
+
+    do {
+        if (zeroed)
+            phys_addr = pagepool_get_zeroed_page();
+        else
+            phys_addr = pagepool_get_phys_page();
+    } while (phys_addr == 0 && swap_evict_page());
+
+    return phys_addr;
+}
+
+/**
+ * Handles a page fault on a page which was invalidated by the clock
+ * hand or evicted to swap. A page still in memory is just validated
+ * again, an evicted page is read from swap.
+ *
+ * @param pagetable The faulting page table
+ *
+ * @param vaddr The faulting page
+ *
+ * @param may_sleep Whether the page may be read from swap
+ *
+ * @return 1 if the page is mapped again, 0 if the page was not
+ * invalidated by the swap (it has not been mapped yet), negative if
+ * the page could not be read.
+ */
+int swap_fault(pagetable_t *pagetable, uint32_t vaddr, int may_sleep)
+{
+    interrupt_status_t intr_status;
+    uint32_t phys_addr;
+    uint32_t slot;
+    pte_t *pte;
+
+    intr_status = swap_lock();
+
+    pte = vm_get_pte(pagetable, vaddr);
+    if (pte == NULL || (pte->PFN == 0 && !pte->S)) {
+        swap_unlock(intr_status);
+        return 0;
+    }
+
+    if (!pte->S) {
+        pte->V = 1;
+        swap_unlock(intr_status);
+        return 1;
+    }
+
+    slot = pte->PFN;
+    swap_unlock(intr_status);
+
+    if (!may_sleep)
+        return -1;
+
+    phys_addr = swap_get_page(0);
+    if (phys_addr == 0)
+        return -1;
+
+    if (swap_transfer(slot, phys_addr, 0) < 0) {
+        kprintf("Swap: Read from slot %d failed\n", slot);
+        pagepool_free_phys_page(phys_addr);
+        return -1;
+    }
+
+    /* Only this process changes its swapped entries. */
+    intr_status = swap_lock();
+    KERNEL_ASSERT(pte->S && pte->PFN == slot);
+    pte->S   = 0;
+    pte->PFN = phys_addr / PAGE_SIZE;
+    pte->V   = 1;
+    swap_set_owner(phys_addr, pagetable, vaddr);
+    swap_free_slot(slot);
+    swap_unlock(intr_status);
+
+    return 1;
+}
+
+/**
+ * Makes a page writable after a write fault, replacing the physical
+ * page with a private copy if it was shared. Fails if the clock hand
+ * has evicted the page meanwhile, in which case the access is just
+ * retried.
+ *
+ * @param pagetable The faulting page table
+ *
+ * @param vaddr The faulting page
+ *
+ * @param old_page The physical page mapped when the fault was handled
+ *
+ * @param new_page The private copy, or old_page if it was not shared
+ *
+ * @return 0 on success, negative if the entry has changed.
+ */
+int swap_update_page(pagetable_t *pagetable, uint32_t vaddr,
+                     uint32_t old_page, uint32_t new_page)
+{
+    interrupt_status_t intr_status;
+    pte_t *pte;
+    int ret = -1;
+
+    intr_status = swap_lock();
+
+    pte = vm_get_pte(pagetable, vaddr);
+    if (pte != NULL && !pte->S && pte->PFN == old_page / PAGE_SIZE) {
+        swap_clear_owner(old_page, pagetable);
+        pte->PFN = new_page / PAGE_SIZE;
+        pte->D   = 1;
+        swap_set_owner(new_page, pagetable, vaddr);
+        ret = 0;
+    }
+
+    swap_unlock(intr_status);
+
+    return ret;
+}
+
+/** @} */
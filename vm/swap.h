@@ -0,0 +1,62 @@
+/*
+ * Swap
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef BUENOS_VM_SWAP_H
+#define BUENOS_VM_SWAP_H
+
+#include "lib/libc.h"
+#include "kernel/interrupt.h"
+#include "drivers/gbd.h"
+#include "vm/pagetable.h"
+
+void swap_init(void);
+gbd_t *swap_get_disk(void);
+int swap_get_num_free_slots(void);
+
+interrupt_status_t swap_lock(void);
+void swap_unlock(interrupt_status_t intr_status);
+
+/* The following require the swap lock to be held */
+void swap_set_owner(uint32_t phys_addr, pagetable_t *pagetable,
+                    uint32_t vaddr);
+void swap_clear_owner(uint32_t phys_addr, pagetable_t *pagetable);
+void swap_ref_slot(uint32_t slot);
+void swap_free_slot(uint32_t slot);
+
+uint32_t swap_get_page(int zeroed);
+int swap_fault(pagetable_t *pagetable, uint32_t vaddr, int may_sleep);
+int swap_update_page(pagetable_t *pagetable, uint32_t vaddr,
+                     uint32_t old_page, uint32_t new_page);
+
+#endif /* BUENOS_VM_SWAP_H */
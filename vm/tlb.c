@@ -38,95 +38,582 @@
 #include "kernel/assert.h"
 #include "vm/tlb.h"
 #include "vm/pagetable.h"
+#include "vm/vm.h"
+#include "vm/swap.h"
+#include "vm/vmstat.h"
 #include "kernel/thread.h"
 #include "lib/debug.h"
 #include "proc/process.h"
+#include "kernel/interrupt.h"
+#include "kernel/semaphore.h"
+#include "kernel/spinlock.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
+#include "drivers/yams.h"
+#include "drivers/timer.h"
 
-void tlb_modified_exception(void)
+/** @name TLB handling
+ *
+ * TLB exception handlers, address space identifiers and TLB
+ * invalidation on all CPUs.
+ *
+ * ASIDs are given to pagetables separately on each CPU, in
+ * generations. When a pagetable is activated on a CPU where it has no
+ * ASID of the current generation, it gets the next free ASID. When
+ * the ASIDs run out, the TLB of the CPU is flushed and a new
+ * generation is started, which invalidates the ASIDs of all
+ * pagetables on that CPU. The ASID belongs to the pagetable, so
+ * threads sharing a pagetable keep their TLB entries when switching
+ * between each other.
+ *
+ * @{
+ */
+
+/* Invalidated TLB rows get a kseg0 address, which is never looked up
+   from the TLB. Each row gets a different one, since duplicate
+   entries are not allowed. */
+#define TLB_INVALID_VPN2(index) ((0x80000000 >> 13) + (index))
+
+/* Number of CPUs in the system */
+static int tlb_num_cpus;
+
+/* Serializes TLB shootdown requests */
+static semaphore_t *tlb_shootdown_sem;
+
+/* Protects tlb_shootdown_pending */
+static spinlock_t tlb_shootdown_slock;
+
+/* Current ASID generation and the next free ASID of each CPU. ASID 0
+   belongs to the threads without a pagetable. */
+static uint32_t tlb_asid_generation[CONFIG_MAX_CPUS];
+static uint32_t tlb_next_asid[CONFIG_MAX_CPUS];
+
+/* The current shootdown request. A count of -1 means that all
+   entries of the address space are invalidated. */
+static tlb_asids_t tlb_shootdown_asids_req;
+static int tlb_shootdown_count;
+static uint32_t tlb_shootdown_vaddrs[TLB_SHOOTDOWN_BATCH];
+
+/* Bitmask of CPUs which have not yet handled the current request */
+static volatile uint32_t tlb_shootdown_pending;
+
+/**
+ * Initializes TLB shootdown. Must be called after semaphores and
+ * devices have been initialized.
+ */
+void tlb_init(void)
+{
+    int i;
+
+    tlb_num_cpus = cpustatus_count();
+    tlb_shootdown_sem = semaphore_create(1);
+    KERNEL_ASSERT(tlb_shootdown_sem != NULL);
+    spinlock_reset(&tlb_shootdown_slock);
+    tlb_shootdown_pending = 0;
+
+    /* New pagetables have generation 0, which is never current. */
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+        tlb_asid_generation[i] = 1;
+        tlb_next_asid[i] = 1;
+    }
+}
+
+/**
+ * Invalidates the given row of the TLB of this CPU. Interrupts must
+ * be disabled.
+ *
+ * @param index The TLB row
+ */
+static void tlb_invalidate_index(int index)
+{
+    tlb_entry_t entry;
+
+    memoryset(&entry, 0, sizeof(entry));
+    entry.VPN2 = TLB_INVALID_VPN2(index);
+    _tlb_write(&entry, index, 1);
+}
+
+/**
+ * Sets the ASID of the current thread in EntryHi. Probing and reading
+ * the TLB change it. Interrupts must be disabled.
+ */
+static void tlb_restore_asid(void)
+{
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+
+    if (pagetable == NULL)
+        _tlb_set_asid(0);
+    else
+        _tlb_set_asid(pagetable->asid[_interrupt_getcpu()]);
+}
+
+/**
+ * Switches this CPU to the address space of the given pagetable,
+ * giving the pagetable an ASID on this CPU first if it has none of
+ * the current generation. Called when a thread is scheduled.
+ * Interrupts must be disabled.
+ *
+ * @param pagetable Pagetable of the thread, NULL for kernel threads
+ */
+void tlb_activate(pagetable_t *pagetable)
+{
+    uint32_t cpu = _interrupt_getcpu();
+    uint32_t max_index;
+    uint32_t i;
+
+    if (pagetable == NULL) {
+        _tlb_set_asid(0);
+        return;
+    }
+
+    if (pagetable->asid_generation[cpu] != tlb_asid_generation[cpu]) {
+        if (tlb_next_asid[cpu] == TLB_NUM_ASIDS) {
+            /* All ASIDs of the generation are used. Entries of the old
+               generation must go before the ASIDs are reused. */
+            max_index = _tlb_get_maxindex();
+            for (i = 0; i <= max_index; i++)
+                tlb_invalidate_index(i);
+            tlb_asid_generation[cpu]++;
+            tlb_next_asid[cpu] = 1;
+        }
+        pagetable->asid[cpu] = tlb_next_asid[cpu]++;
+        /* Set after the ASID, tlb_get_asids relies on the order. */
+        pagetable->asid_generation[cpu] = tlb_asid_generation[cpu];
+    }
+
+    _tlb_set_asid(pagetable->asid[cpu]);
+}
+
+/**
+ * Finds the current ASIDs of the given pagetable on all CPUs, for
+ * tlb_shootdown_asids. Entries loaded to the TLBs after the page table
+ * was changed do not matter, so this must be called after changing
+ * it.
+ *
+ * @param pagetable The pagetable
+ *
+ * @param asids The ASIDs are returned here
+ */
+void tlb_get_asids(pagetable_t *pagetable, tlb_asids_t *asids)
+{
+    uint32_t generation;
+    int cpu;
+
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+        generation = pagetable->asid_generation[cpu];
+        if (generation == tlb_asid_generation[cpu])
+            asids->asid[cpu] = pagetable->asid[cpu];
+        else
+            asids->asid[cpu] = -1;
+    }
+}
+
+/**
+ * Handles the current shootdown request on this CPU. Interrupts must
+ * be disabled.
+ */
+static void tlb_shootdown_local(void)
+{
+    tlb_entry_t entry;
+    uint32_t max_index;
+    uint32_t i;
+    int index;
+    int asid;
+
+    asid = tlb_shootdown_asids_req.asid[_interrupt_getcpu()];
+    if (asid < 0)
+        return;
+
+    if (tlb_shootdown_count < 0) {
+        max_index = _tlb_get_maxindex();
+        for (i = 0; i <= max_index; i++) {
+            _tlb_read(&entry, i, 1);
+            if (entry.ASID == (uint32_t)asid && !entry.G0)
+                tlb_invalidate_index(i);
+        }
+    } else {
+        for (i = 0; i < (uint32_t)tlb_shootdown_count; i++) {
+            memoryset(&entry, 0, sizeof(entry));
+            entry.VPN2 = tlb_shootdown_vaddrs[i] >> 13;
+            entry.ASID = asid;
+            index = _tlb_probe(&entry);
+            if (index >= 0)
+                tlb_invalidate_index(index);
+        }
+    }
+
+    /* Probing and reading changed the ASID in EntryHi. */
+    tlb_restore_asid();
+}
+
+/**
+ * Invalidates TLB entries of the given address space on all CPUs.
+ * The pagetable must not be destroyed while this runs. See
+ * tlb_shootdown_asids.
+ *
+ * @param pagetable The address space
+ *
+ * @param vaddrs Addresses of the invalidated pages. If NULL, or if
+ * count is more than TLB_SHOOTDOWN_BATCH, all entries of the address
+ * space are invalidated.
+ *
+ * @param count Number of addresses in vaddrs
+ */
+void tlb_shootdown(pagetable_t *pagetable, uint32_t *vaddrs, int count)
+{
+    tlb_asids_t asids;
+
+    tlb_get_asids(pagetable, &asids);
+    tlb_shootdown_asids(&asids, vaddrs, count);
+}
+
+/**
+ * Invalidates TLB entries of an address space on all CPUs. Other CPUs
+ * are interrupted with an inter-CPU interrupt and this function waits
+ * until all of them have done the invalidation, so the pages may be
+ * reused after this returns. The caller must be able to sleep and
+ * must not hold any spinlocks.
+ *
+ * @param asids The ASIDs of the address space, from tlb_get_asids
+ *
+ * @param vaddrs Addresses of the invalidated pages. If NULL, or if
+ * count is more than TLB_SHOOTDOWN_BATCH, all entries of the address
+ * space are invalidated.
+ *
+ * @param count Number of addresses in vaddrs
+ */
+void tlb_shootdown_asids(tlb_asids_t *asids, uint32_t *vaddrs, int count)
+{
+    interrupt_status_t intr_status;
+    device_t *dev;
+    uint32_t this_cpu;
+    int cpu;
+    int i;
+
+    semaphore_P(tlb_shootdown_sem);
+
+    intr_status = _interrupt_disable();
+    this_cpu = _interrupt_getcpu();
+
+    tlb_shootdown_asids_req = *asids;
+    if (vaddrs == NULL || count > TLB_SHOOTDOWN_BATCH) {
+        tlb_shootdown_count = -1;
+    } else {
+        tlb_shootdown_count = count;
+        for (i = 0; i < count; i++)
+            tlb_shootdown_vaddrs[i] = vaddrs[i];
+    }
+
+    spinlock_acquire(&tlb_shootdown_slock);
+    for (cpu = 0; cpu < tlb_num_cpus; cpu++) {
+        if ((uint32_t)cpu != this_cpu)
+            tlb_shootdown_pending |= 1 << cpu;
+    }
+    spinlock_release(&tlb_shootdown_slock);
+
+    for (cpu = 0; cpu < tlb_num_cpus; cpu++) {
+        if ((uint32_t)cpu == this_cpu)
+            continue;
+        dev = device_get(YAMS_TYPECODE_CPUSTATUS + cpu, 0);
+        KERNEL_ASSERT(dev != NULL);
+        cpustatus_generate_irq(dev);
+    }
+
+    tlb_shootdown_local();
+
+    /* No spinlocks are held here, so the other CPUs will get to
+       handle the interrupt. */
+    while (tlb_shootdown_pending != 0)
+        ;
+
+    _interrupt_set_state(intr_status);
+
+    semaphore_V(tlb_shootdown_sem);
+}
+
+/**
+ * Handles a TLB shootdown request on this CPU, if there is one. Called
+ * from the CPU status device interrupt handler.
+ */
+void tlb_shootdown_interrupt(void)
+{
+    uint32_t this_cpu = _interrupt_getcpu();
+
+    if (!(tlb_shootdown_pending & (1 << this_cpu)))
+        return;
+
+    tlb_shootdown_local();
+
+    spinlock_acquire(&tlb_shootdown_slock);
+    tlb_shootdown_pending &= ~(1 << this_cpu);
+    spinlock_release(&tlb_shootdown_slock);
+}
+
+/* States of one large page of a pair, see tlb_large_state. */
+#define TLB_LARGE_INTACT 0
+#define TLB_LARGE_ABSENT 1
+#define TLB_LARGE_BROKEN 2
+
+/**
+ * Checks one large page of a pair. The large page is intact if all its
+ * pages are valid, physically contiguous and equally writable, and
+ * absent if none of its pages has been mapped yet. Evicting, copying
+ * on write or unmapping any page of a large page breaks it, as does
+ * mapping the pages of an absent one as normal pages.
+ *
+ * @param pte The entries of the large page
+ *
+ * @return TLB_LARGE_INTACT, TLB_LARGE_ABSENT or TLB_LARGE_BROKEN.
+ */
+static int tlb_large_state(pte_t *pte)
+{
+  int intact = 1;
+  int absent = 1;
+  int i;
+
+  for (i = 0; i < PAGETABLE_LARGE_PAGES; i++) {
+    if (!pte[i].L || !pte[i].V || pte[i].D != pte[0].D ||
+        (pte[0].PFN & (PAGETABLE_LARGE_PAGES - 1)) != 0 ||
+        pte[i].PFN != pte[0].PFN + i)
+      intact = 0;
+    if (pte[i].L || pte[i].V || pte[i].S || pte[i].PFN != 0)
+      absent = 0;
+  }
+
+  if (intact)
+    return TLB_LARGE_INTACT;
+  return absent ? TLB_LARGE_ABSENT : TLB_LARGE_BROKEN;
+}
+
+/**
+ * Writes the mapping of the large page pair containing vaddr to the
+ * TLB of this CPU, if neither large page of the pair is broken (see
+ * tlb_large_state). A large page which is not mapped yet is written
+ * invalid, so that its first access faults and maps it, after which
+ * the pair is written again. The L bits of a broken pair are cleared,
+ * so its pages are refilled as normal pages from then on. Interrupts
+ * must be disabled, so that shootdowns of the checked entries wait
+ * until the TLB entry has been written.
+ *
+ * @param pagetable The pagetable of the current thread
+ *
+ * @param vaddr A userland virtual address with a second level table
+ *
+ * @return 1 if the large pages were written to the TLB, 0 if not.
+ */
+static int tlb_update_large(pagetable_t *pagetable, uint32_t vaddr)
+{
+  interrupt_status_t intr_status;
+  tlb_entry_t tlb_entry;
+  uint32_t base;
+  pte_t *pte;
+  int even, odd;
+  int index;
+  int i;
+
+  base = vaddr & ~(2 * PAGETABLE_LARGE_SIZE - 1);
+  pte = vm_get_pte(pagetable, base);
+  KERNEL_ASSERT(pte != NULL);
+
+  /* The clock hand may be changing the entries. */
+  intr_status = swap_lock();
+  even = tlb_large_state(&pte[0]);
+  odd  = tlb_large_state(&pte[PAGETABLE_LARGE_PAGES]);
+  if (even == TLB_LARGE_BROKEN || odd == TLB_LARGE_BROKEN) {
+    for (i = 0; i < 2 * PAGETABLE_LARGE_PAGES; i++)
+      pte[i].L = 0;
+  }
+  swap_unlock(intr_status);
+
+  if (even != TLB_LARGE_INTACT && odd != TLB_LARGE_INTACT)
+    return 0;
+  if (even == TLB_LARGE_BROKEN || odd == TLB_LARGE_BROKEN)
+    return 0;
+
+  memoryset(&tlb_entry, 0, sizeof(tlb_entry));
+  tlb_entry.ASID = pagetable->asid[_interrupt_getcpu()];
+
+  /* Normal entries within the large pages would be duplicates, and so
+     would an earlier entry of the pair with one half invalid. */
+  for (i = 0; i < PAGETABLE_LARGE_PAGES; i++) {
+    tlb_entry.VPN2 = (base >> 13) + i;
+    index = _tlb_probe(&tlb_entry);
+    if (index >= 0)
+      tlb_invalidate_index(index);
+  }
+
+  tlb_entry.VPN2 = base >> 13;
+  if (even == TLB_LARGE_INTACT) {
+    tlb_entry.PFN0 = pte[0].PFN;
+    tlb_entry.D0   = pte[0].D;
+    tlb_entry.V0   = 1;
+  }
+  if (odd == TLB_LARGE_INTACT) {
+    tlb_entry.PFN1 = pte[PAGETABLE_LARGE_PAGES].PFN;
+    tlb_entry.D1   = pte[PAGETABLE_LARGE_PAGES].D;
+    tlb_entry.V1   = 1;
+  }
+  _tlb_write_random_large(&tlb_entry, TLB_LARGE_PAGEMASK);
+  vmstat_add(VMSTAT_TLB_LARGE, 1);
+
+  return 1;
+}
+
+/**
+ * Writes the mapping of the page pair containing vaddr from the given
+ * pagetable to the TLB of this CPU. Pairs marked as part of a large
+ * page are written as a large page if it is still intact.
+ *
+ * @param pagetable The pagetable of the current thread
+ *
+ * @param vaddr A userland virtual address with a second level table
+ */
+static void tlb_update(pagetable_t *pagetable, uint32_t vaddr)
+{
+  interrupt_status_t intr_status;
+  tlb_entry_t tlb_entry;
+  pte_t *pte;
+  int index;
+
+  /* The even page of the pair */
+  pte = vm_get_pte(pagetable, vaddr & ~0x1fff);
+  KERNEL_ASSERT(pte != NULL);
+
+  if (pte[0].L) {
+    intr_status = _interrupt_disable();
+    if (tlb_update_large(pagetable, vaddr)) {
+      _interrupt_set_state(intr_status);
+      return;
+    }
+    _interrupt_set_state(intr_status);
+  }
+
+  memoryset(&tlb_entry, 0, sizeof(tlb_entry));
+  tlb_entry.VPN2 = vaddr >> 13;
+  tlb_entry.PFN0 = pte[0].PFN;
+  tlb_entry.D0   = pte[0].D;
+  tlb_entry.V0   = pte[0].V;
+  tlb_entry.PFN1 = pte[1].PFN;
+  tlb_entry.D1   = pte[1].D;
+  tlb_entry.V1   = pte[1].V;
+
+  /* The pair may already be in the TLB with the other page
+     invalid or write-protected, or as part of a large page.
+     Overwrite that entry, duplicate entries are not allowed. The
+     probe and the write must happen on the same CPU. */
+  intr_status = _interrupt_disable();
+  tlb_entry.ASID = pagetable->asid[_interrupt_getcpu()];
+  index = _tlb_probe(&tlb_entry);
+  if (index >= 0) {
+    _tlb_write(&tlb_entry, index, 1);
+  } else {
+    _tlb_write_random(&tlb_entry);
+  }
+  _interrupt_set_state(intr_status);
+}
+
+/**
+ * Handles a TLB modified exception, i.e. a write to a write-protected
+ * page. Pages shared copy-on-write are copied here, writes to
+ * read-only pages kill the process.
+ *
+ * @param may_sleep Whether interrupts may be enabled while handling
+ * the exception, i.e. they were enabled when the exception occured.
+ */
+void tlb_modified_exception(int may_sleep)
 {
   thread_table_t *current_thread = thread_get_current_thread_entry();
+  tlb_exception_state_t tlb_exc_state;
+  uint32_t start = timer_get_ticks();
 
   /* This shouldn't happen if we are a kernel thread. */
   if (current_thread->pagetable == NULL) {
     KERNEL_PANIC("Unhandled TLB modified exception");
   }
 
-  /* If this is a user process, we 'kill' the user process. */
-  process_finish(-6);
+  _tlb_get_exception_state(&tlb_exc_state);
+
+  if (tlb_exc_state.badvaddr >= USERLAND_END ||
+      process_write_fault(tlb_exc_state.badvaddr, may_sleep) < 0) {
+    kprintf("TLB modified exception: invalid write to 0x%8.8x by thread %d\n",
+            tlb_exc_state.badvaddr, thread_get_current_thread());
+    /* If this is a user process, we 'kill' the user process. */
+    if (may_sleep)
+      process_finish(PROCESS_SEGFAULT);
+    KERNEL_PANIC("Unhandled TLB modified exception");
+  }
+
+  tlb_update(current_thread->pagetable, tlb_exc_state.badvaddr);
+
+  vmstat_add(VMSTAT_TLB_MODIFIED, 1);
+  vmstat_add(VMSTAT_TLB_CYCLES, timer_get_ticks() - start);
 }
 
 /* Is called by tlb_load_exception and tlb_store_exception. */
-void tlb_help_exception_handling(char *type)
+void tlb_help_exception_handling(char *type, int may_sleep)
 {  
   tlb_exception_state_t tlb_exc_state;
   thread_table_t *current_thread;
-  int i;
-  tlb_entry_t tlb_entry;
-  tlb_entry_t tmp;
+  pagetable_t *pagetable;
+  pte_t *pte = NULL;
+  uint32_t start = timer_get_ticks();
 
   current_thread = thread_get_current_thread_entry();
+  pagetable = current_thread->pagetable;
 
   /* This exception should not happen if this is a kernel thread. */
-  if (current_thread->pagetable == NULL) {
+  if (pagetable == NULL) {
     KERNEL_PANIC("TLB load/store exception, cannot be in kernel mode");
   }
   
   /* Get the exception state */
   _tlb_get_exception_state(&tlb_exc_state);
 
-  /* Search for the page that was looked up. */
-  for (i=0; i < PAGETABLE_ENTRIES; i++) {
-    tmp = current_thread->pagetable->entries[i];
-    if ((unsigned int)tmp.VPN2 == (unsigned int)tlb_exc_state.badvpn2) {
-      DEBUG("debug_G4", "tlb_%s_exception: Found match at index %d\n",type,i);
-      tlb_entry = tmp;
-      break;
-    }
+  if (tlb_exc_state.badvaddr < USERLAND_END) {
+    pte = vm_get_pte(pagetable, tlb_exc_state.badvaddr);
   }
-  
-  /* If we looped through the whole look without finding a page,
-     then the requested page does not exist. */
-  if (i == PAGETABLE_ENTRIES) {
-    KERNEL_PANIC("TLB load/store exception, page does not exist");
+
+  if (pte == NULL || pte->V == 0) {
+    /* Not mapped yet, the page is filled on demand. */
+    if (tlb_exc_state.badvaddr >= USERLAND_END ||
+        process_page_fault(tlb_exc_state.badvaddr, may_sleep) < 0) {
+      kprintf("TLB %s exception: invalid access to 0x%8.8x by thread %d\n",
+              type, tlb_exc_state.badvaddr, thread_get_current_thread());
+      if (may_sleep)
+        process_finish(PROCESS_SEGFAULT);
+      KERNEL_PANIC("TLB load/store exception, page does not exist");
+    }
   }
-  
-  /* Else write the page into the TLB. */
-  _tlb_write_random(&tlb_entry);
-}
 
-void tlb_load_exception(void)
-{
-  tlb_help_exception_handling("load");
+  DEBUG("debug_G4", "tlb_%s_exception: Found mapping for 0x%8.8x\n",
+        type, tlb_exc_state.badvaddr);
+
+  tlb_update(pagetable, tlb_exc_state.badvaddr);
+
+  vmstat_add(VMSTAT_TLB_MISSES, 1);
+  vmstat_add(VMSTAT_TLB_CYCLES, timer_get_ticks() - start);
 }
 
-void tlb_store_exception(void)
+/**
+ * Handles a TLB load exception (TLB refill or invalid entry).
+ *
+ * @param may_sleep Whether interrupts may be enabled while filling
+ * the page, i.e. they were enabled when the exception occured.
+ */
+void tlb_load_exception(int may_sleep)
 {
-  tlb_help_exception_handling("store");
+  tlb_help_exception_handling("load", may_sleep);
 }
 
 /**
- * Fill TLB with given pagetable. This function is used to set memory
- * mappings in CP0's TLB before we have a proper TLB handling system.
- * This approach limits the maximum mapping size to 128kB.
- *
- * @param pagetable Mappings to write to TLB.
+ * Handles a TLB store exception (TLB refill or invalid entry).
  *
+ * @param may_sleep Whether interrupts may be enabled while filling
+ * the page, i.e. they were enabled when the exception occured.
  */
-/* Note: tlb_fill is not used anymore */
-void tlb_fill(pagetable_t *pagetable)
+void tlb_store_exception(int may_sleep)
 {
-    if(pagetable == NULL)
-	return;
-
-    /* Check that the pagetable can fit into TLB. This is needed until
-     we have proper VM system, because the whole pagetable must fit
-     into TLB. */
-    KERNEL_ASSERT(pagetable->valid_count <= (_tlb_get_maxindex()+1));
-
-    _tlb_write(pagetable->entries, 0, pagetable->valid_count);
-
-    /* Set ASID field in Co-Processor 0 to match thread ID so that
-       only entries with the ASID of the current thread will match in
-       the TLB hardware. */
-    _tlb_set_asid(pagetable->ASID);
+  tlb_help_exception_handling("store", may_sleep);
 }
+
+/** @} */
@@ -38,6 +38,7 @@
 #define BUENOS_VM_TLB_H
 
 #include "lib/libc.h"
+#include "kernel/config.h"
 
 /* TLB-entry. These fields match CP0 registers, which means
    they should not be modified. Any extensions should be made into
@@ -50,7 +51,8 @@ typedef struct {
     unsigned int VPN2:19    __attribute__ ((packed));
     unsigned int dummy1:5   __attribute__ ((packed));
     /* Address space identifier. When ASID matches CP0 setted ASID
-       this entry is valid. In Buenos, we use mapping ASID = Thread Id. */
+       this entry is valid. ASIDs are given to pagetables by
+       tlb_activate, ASID 0 is used by kernel threads. */
     unsigned int ASID:8     __attribute__ ((packed));
 
     unsigned int dummy2:6   __attribute__ ((packed));
@@ -90,13 +92,41 @@ typedef struct {
     uint32_t asid; /* ASID of the causing process, only 8 lowest bits used */
 } tlb_exception_state_t;
 
-/* exception handlers */
-void tlb_modified_exception(void);
-void tlb_load_exception(void);
-void tlb_store_exception(void);
+/* Maximum number of pages whose TLB entries are invalidated one by
+   one in a shootdown. Larger requests flush the whole address space. */
+#define TLB_SHOOTDOWN_BATCH 16
+
+/* CP0 PageMask of the large pages (64k, see PAGETABLE_LARGE_PAGES).
+   Zero is the mask of normal 4k pages. */
+#define TLB_LARGE_PAGEMASK 0x0001e000
+
+/* Number of hardware ASIDs */
+#define TLB_NUM_ASIDS 256
+
+/* The ASIDs of an address space on each CPU, negative on CPUs where
+   the address space has no ASID of the current generation */
+typedef struct {
+    int asid[CONFIG_MAX_CPUS];
+} tlb_asids_t;
 
 /* Forward declare pagetable_t (== struct pagetable_struct_t) */
 struct pagetable_struct_t;
+
+void tlb_init(void);
+void tlb_activate(struct pagetable_struct_t *pagetable);
+
+/* TLB invalidation on all CPUs */
+void tlb_get_asids(struct pagetable_struct_t *pagetable, tlb_asids_t *asids);
+void tlb_shootdown(struct pagetable_struct_t *pagetable,
+                   uint32_t *vaddrs, int count);
+void tlb_shootdown_asids(tlb_asids_t *asids, uint32_t *vaddrs, int count);
+void tlb_shootdown_interrupt(void);
+
+/* exception handlers */
+void tlb_modified_exception(int may_sleep);
+void tlb_load_exception(int may_sleep);
+void tlb_store_exception(int may_sleep);
+
 /*void tlb_fill(struct pagetable_struct_t *pagetable);
  */
 /* assembler function wrappers */
@@ -108,6 +138,10 @@ int _tlb_probe(tlb_entry_t *entry);
 int _tlb_read(tlb_entry_t *entries, uint32_t index, uint32_t num);
 int _tlb_write(tlb_entry_t *entries, uint32_t index, uint32_t num);
 void _tlb_write_random(tlb_entry_t *entry);
+void _tlb_write_random_large(tlb_entry_t *entry, uint32_t pagemask);
+
+/* Code to be inserted to the TLB refill vector */
+void _tlb_refill_vector_code(void);
 
 
 #endif /* BUENOS_VM_TLB_H */
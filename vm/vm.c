@@ -37,8 +37,11 @@
 #include "vm/pagetable.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
+#include "vm/swap.h"
+#include "vm/vmstat.h"
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
+#include "kernel/thread.h"
 
 /** @name Virtual memory system
  *
@@ -48,16 +51,10 @@
  */
 
 
-/* Check whether given (virtual) address is even or odd mapping
-   in a pair of mappings for TLB. */
-#define ADDR_IS_ON_ODD_PAGE(addr)  ((addr) & 0x00001000)  
-#define ADDR_IS_ON_EVEN_PAGE(addr) (!((addr) & 0x00001000))  
-
-
 /**
  * Initializes virtual memory system. Initialization consists of page
- * pool initialization and disabling static memory reservation. After
- * this kmalloc() may not be used anymore.
+ * pool and swap initialization and disabling static memory
+ * reservation. After this kmalloc() may not be used anymore.
  */ 
 void vm_init(void)
 {
@@ -68,26 +65,43 @@ void vm_init(void)
        in this form. */
     KERNEL_ASSERT(sizeof(tlb_entry_t) == 12);
 
+    /* Page table entries are written to EntryLo registers as such, and
+       one second level table must fill exactly one page. The page
+       directory must fit on one page. */
+    KERNEL_ASSERT(sizeof(pte_t) == 4);
+    KERNEL_ASSERT(PAGETABLE_PTES * sizeof(pte_t) == PAGE_SIZE);
+    KERNEL_ASSERT(sizeof(pagetable_t) <= PAGE_SIZE);
+
+    /* The TLB refill handler (_tlb_refill) finds the pagetable of the
+       current thread and the page directory by these offsets. */
+    KERNEL_ASSERT((uint32_t)&((thread_table_t *)0)->pagetable == 16);
+    KERNEL_ASSERT((uint32_t)&((pagetable_t *)0)->directory == 4);
+
+    vmstat_init();
     pagepool_init();
+    swap_init();
     kmalloc_disable();
+
+    tlb_init();
 }
 
 /**
- *  Creates a new page table. Reserves memory (one page) for the table
- *  and sets the address space identifier for the created page table.
- *
- *  @param asid Address space identifier
+ *  Creates a new page table. Reserves memory (one page) for the page
+ *  directory. Second level tables are reserved by vm_map when needed,
+ *  and address space identifiers by tlb_activate.
  *
  *  @return The created page table
  *
  */
 
-pagetable_t *vm_create_pagetable(uint32_t asid)
+pagetable_t *vm_create_pagetable(void)
 {
     pagetable_t *table;
     uint32_t addr;
 
-    addr = pagepool_get_phys_page();
+    /* A zeroed page has all directory entries set to NULL, and no
+       ASIDs of a valid generation. */
+    addr = pagepool_get_zeroed_page();
     if(addr == 0) {
 	return NULL;
     }
@@ -98,28 +112,180 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
        physical memory. */
     table = (pagetable_t *) (ADDR_PHYS_TO_KERNEL(addr));
 
-    table->ASID        = asid;
     table->valid_count = 0;
 
     return table;
 }
 
 /**
- * Destroys given pagetable. Frees the memory (one page) allocated for
- * the pagetable. Does not remove mappings from the TLB.
+ * Destroys given pagetable and the address space it describes. All
+ * entries of the address space are flushed from the TLBs of all CPUs,
+ * after which the mapped pages, the second level tables and the page
+ * directory are returned to the page pool and the swap slots of
+ * evicted pages are freed. The caller must be able to sleep and must
+ * not hold any spinlocks.
  *
  * @param pagetable Page table to destroy
  *
+ * @return Number of mapped pages freed
  */
 
-void vm_destroy_pagetable(pagetable_t *pagetable)
+int vm_destroy_pagetable(pagetable_t *pagetable)
 {
+    interrupt_status_t intr_status;
+    uint32_t *frames;
+    pte_t *table;
+    int freed = 0;
+    int count;
+    int i, j;
+
+    tlb_shootdown(pagetable, NULL, 0);
+
+    for (i = 0; i < PAGETABLE_DIRECTORY_ENTRIES; i++) {
+        table = pagetable->directory[i];
+        if (table == NULL)
+            continue;
+
+        /* The table is not needed anymore, so the physical addresses
+           of the mapped pages are collected over it and freed at
+           once. */
+        frames = (uint32_t *)table;
+        count = 0;
+        intr_status = swap_lock();
+        for (j = 0; j < PAGETABLE_PTES; j++) {
+            if (table[j].S) {
+                swap_free_slot(table[j].PFN);
+            } else if (table[j].PFN != 0) {
+                swap_clear_owner(table[j].PFN << 12, pagetable);
+                frames[count++] = table[j].PFN << 12;
+            }
+        }
+        swap_unlock(intr_status);
+        pagepool_free_phys_pages(frames, count);
+        freed += count;
+
+        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) table));
+    }
+
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) pagetable));
+
+    return freed;
+}
+
+/**
+ * Copies the mappings of a pagetable to another, empty pagetable for
+ * a copy-on-write fork. The pages are shared, and they are
+ * write-protected in both pagetables, so the first write to a page
+ * takes a TLB modified exception where the page is copied. Pages
+ * evicted to swap share the swap slot instead. The TLB entries of the
+ * parent are not flushed here.
+ *
+ * @param parent Pagetable to copy
+ *
+ * @param child The new pagetable
+ *
+ * @return 0 on success, -1 if no memory was left for the second level
+ * tables. The child may contain some of the mappings in that case.
+ */
+
+int vm_fork_pagetable(pagetable_t *parent, pagetable_t *child)
+{
+    interrupt_status_t intr_status;
+    pte_t *table;
+    pte_t *copy;
+    uint32_t addr;
+    int i, j;
+
+    for (i = 0; i < PAGETABLE_DIRECTORY_ENTRIES; i++) {
+        table = parent->directory[i];
+        if (table == NULL)
+            continue;
+
+        addr = pagepool_get_zeroed_page();
+        if (addr == 0)
+            return -1;
+        copy = (pte_t *) ADDR_PHYS_TO_KERNEL(addr);
+        child->directory[i] = copy;
+
+        /* The clock hand may be changing the entries of the parent. */
+        intr_status = swap_lock();
+        for (j = 0; j < PAGETABLE_PTES; j++) {
+            if (table[j].S) {
+                swap_ref_slot(table[j].PFN);
+            } else if (table[j].PFN != 0) {
+                table[j].D = 0;
+                pagepool_ref_phys_page(table[j].PFN << 12);
+            } else {
+                continue;
+            }
+            copy[j] = table[j];
+            child->valid_count++;
+        }
+        swap_unlock(intr_status);
+    }
+
+    return 0;
+}
+
+/**
+ * Finds the page table entry of the given virtual address.
+ *
+ * @param pagetable Page table to search
+ *
+ * @param vaddr Userland virtual address
+ *
+ * @return Pointer to the entry, or NULL if the second level table
+ * covering vaddr has not been allocated.
+ */
+
+pte_t *vm_get_pte(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pte_t *table;
+
+    KERNEL_ASSERT(vaddr < USERLAND_END);
+
+    table = pagetable->directory[PAGETABLE_DIRECTORY_INDEX(vaddr)];
+    if (table == NULL)
+        return NULL;
+
+    return &table[PAGETABLE_PTE_INDEX(vaddr)];
+}
+
+/**
+ * Allocates the second level table covering the given address, if it
+ * has not been allocated yet.
+ *
+ * @param pagetable Page table
+ *
+ * @param vaddr Userland virtual address
+ *
+ * @return 0 on success, -1 if no memory was left for the table.
+ */
+static int vm_alloc_table(pagetable_t *pagetable, uint32_t vaddr)
+{
+    uint32_t addr;
+
+    if (pagetable->directory[PAGETABLE_DIRECTORY_INDEX(vaddr)] != NULL)
+        return 0;
+
+    /* A zeroed table has all its entries invalid. */
+    addr = pagepool_get_zeroed_page();
+    if (addr == 0) {
+        kprintf("Thread %d run out of memory for pagetables\n",
+                thread_get_current_thread());
+        return -1;
+    }
+    pagetable->directory[PAGETABLE_DIRECTORY_INDEX(vaddr)] =
+        (pte_t *) ADDR_PHYS_TO_KERNEL(addr);
+
+    return 0;
 }
 
 /**
  * Maps given virtual address to given physical address in given page
  * table. Does not modify TLB. The mapping is done in 4k chunks (pages).
+ * A second level table is allocated if this is the first mapping in
+ * its 4MB region.
  *
  * @param pagetable Page table in which to do the mapping
  *
@@ -133,82 +299,114 @@ void vm_destroy_pagetable(pagetable_t *pagetable)
  * page is not dirty (write-protected). The terminology comes
  * from hardware, in reality, this is write enabling bit.
  *
+ * @return 0 on success, -1 if no memory was left for the second
+ * level table.
  */
 
-void vm_map(pagetable_t *pagetable, 
-	    uint32_t physaddr, 
-	    uint32_t vaddr,
-            int dirty)
+int vm_map(pagetable_t *pagetable, 
+           uint32_t physaddr, 
+           uint32_t vaddr,
+           int dirty)
 {
-    unsigned int i;
+    interrupt_status_t intr_status;
+    pte_t *pte;
 
     KERNEL_ASSERT(dirty == 0 || dirty == 1);
+    KERNEL_ASSERT(vaddr < USERLAND_END);
 
-    for(i=0; i<pagetable->valid_count; i++) {
-	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-	    /* TLB has separate mappings for even and odd 
-	       virtual pages. Let's handle them separately here,
-	       and we have much more fun when updating the TLB later.*/
-	    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-		if(pagetable->entries[i].V0 == 1) {
-		    KERNEL_PANIC("Tried to re-map same virtual page");
-		} else {
-		    /* Map the page on a pair entry */
-		    pagetable->entries[i].PFN0 = physaddr >> 12;
-		    pagetable->entries[i].V0 = 1;
-		    pagetable->entries[i].G0 = 0;
-		    pagetable->entries[i].D0 = dirty;
-		    return;
-		}
-	    } else {
-		if(pagetable->entries[i].V1 == 1) {
-		    KERNEL_PANIC("Tried to re-map same virtual page");
-		} else {
-		    /* Map the page on a pair entry */
-		    pagetable->entries[i].PFN1 = physaddr >> 12;
-		    pagetable->entries[i].V1 = 1;
-		    pagetable->entries[i].G1 = 0;
-		    pagetable->entries[i].D1 = dirty;
-		    return;
-		}
-	    }
-	}
-    }
-    /* No previous or pairing mapping was found */
-
-    /* Make sure that pagetable is not full */
-    if(pagetable->valid_count >= PAGETABLE_ENTRIES) {
-	kprintf("Thread with ASID=%d run out of pagetable mapping entries\n",
-		pagetable->ASID);
-	kprintf("during an attempt to map vaddr 0x%8.8x => phys 0x%8.8x.\n",
-		vaddr, physaddr);
-	KERNEL_PANIC("Thread run out of pagetable mapping entries.");
-    }
+    if (vm_alloc_table(pagetable, vaddr) < 0)
+        return -1;
+
+    intr_status = swap_lock();
 
-    /* Map the page on a new entry */
-
-    pagetable->entries[pagetable->valid_count].VPN2 = vaddr >> 13;
-    pagetable->entries[pagetable->valid_count].ASID = pagetable->ASID;
-
-    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-	pagetable->entries[pagetable->valid_count].PFN0 = physaddr >> 12;
-	pagetable->entries[pagetable->valid_count].D0   = dirty;
-	pagetable->entries[pagetable->valid_count].V0   = 1;
-	pagetable->entries[pagetable->valid_count].G0   = 0;
-	pagetable->entries[pagetable->valid_count].V1   = 0;
-    } else {
-	pagetable->entries[pagetable->valid_count].PFN1 = physaddr >> 12;
-	pagetable->entries[pagetable->valid_count].D1   = dirty;
-	pagetable->entries[pagetable->valid_count].V1   = 1;
-	pagetable->entries[pagetable->valid_count].G1   = 0;
-	pagetable->entries[pagetable->valid_count].V0   = 0;
+    pte = vm_get_pte(pagetable, vaddr);
+
+    if (pte->V == 1 || pte->S == 1 || pte->PFN != 0) {
+        KERNEL_PANIC("Tried to re-map same virtual page");
     }
 
+    pte->PFN = physaddr >> 12;
+    pte->D   = dirty;
+    pte->V   = 1;
+    pte->G   = 0;
+
+    /* The page can be evicted while this is its only mapping. */
+    swap_set_owner(physaddr, pagetable, vaddr);
+
+    swap_unlock(intr_status);
+
     pagetable->valid_count++;
+
+    return 0;
 }
 
 /**
- * Unmaps given virtual address from given pagetable.
+ * Maps a large page, PAGETABLE_LARGE_PAGES contiguous physical pages
+ * from pagepool_get_phys_pages, to the given virtual address. The
+ * pages are mapped one by one like with vm_map and stay separate
+ * pages in every other respect: each of them has its own reference
+ * and can be unmapped, evicted or copied on write by itself. Their
+ * entries are marked with the L bit, which makes tlb_update map the
+ * whole large page with one TLB entry as long as it stays intact.
+ *
+ * @param pagetable Page table in which to do the mapping
+ *
+ * @param physaddr Physical address of the first page, aligned to
+ * PAGETABLE_LARGE_SIZE.
+ *
+ * @param vaddr Virtual address of the first page, aligned to
+ * PAGETABLE_LARGE_SIZE. None of the pages may be mapped.
+ *
+ * @param dirty 1 if the pages are writable, 0 if not.
+ *
+ * @return 0 on success, -1 if no memory was left for the second
+ * level table. Nothing is mapped in that case.
+ */
+int vm_map_large(pagetable_t *pagetable, uint32_t physaddr,
+                 uint32_t vaddr, int dirty)
+{
+    interrupt_status_t intr_status;
+    pte_t *pte;
+    int i;
+
+    KERNEL_ASSERT(dirty == 0 || dirty == 1);
+    KERNEL_ASSERT(vaddr < USERLAND_END);
+    KERNEL_ASSERT((physaddr & (PAGETABLE_LARGE_SIZE - 1)) == 0);
+    KERNEL_ASSERT((vaddr & (PAGETABLE_LARGE_SIZE - 1)) == 0);
+
+    /* A large page never crosses a second level table. */
+    if (vm_alloc_table(pagetable, vaddr) < 0)
+        return -1;
+
+    intr_status = swap_lock();
+
+    pte = vm_get_pte(pagetable, vaddr);
+
+    for (i = 0; i < PAGETABLE_LARGE_PAGES; i++) {
+        if (pte[i].V == 1 || pte[i].S == 1 || pte[i].PFN != 0) {
+            KERNEL_PANIC("Tried to re-map same virtual page");
+        }
+
+        pte[i].PFN = (physaddr >> 12) + i;
+        pte[i].D   = dirty;
+        pte[i].V   = 1;
+        pte[i].G   = 0;
+        pte[i].L   = 1;
+
+        swap_set_owner(physaddr + i * PAGE_SIZE, pagetable,
+                       vaddr + i * PAGE_SIZE);
+    }
+
+    swap_unlock(intr_status);
+
+    pagetable->valid_count += PAGETABLE_LARGE_PAGES;
+
+    return 0;
+}
+
+/**
+ * Unmaps given virtual address from given pagetable and frees the
+ * physical page. The TLB entry is invalidated on all CPUs.
  *
  * @param pagetable Page table to operate on
  *
@@ -218,10 +416,83 @@ void vm_map(pagetable_t *pagetable,
 
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
 {
-    pagetable = pagetable;
-    vaddr     = vaddr;
-    
-    /* Not implemented */
+    vm_unmap_range(pagetable, vaddr & PAGE_SIZE_MASK,
+                   (vaddr & PAGE_SIZE_MASK) + PAGE_SIZE);
+}
+
+/**
+ * Unmaps all mapped pages in the given range of virtual addresses and
+ * frees the physical pages and the swap slots of evicted pages. The
+ * TLB entries are invalidated on all CPUs with a single shootdown.
+ * The caller must be able to sleep and must not hold any spinlocks.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param start First virtual address of the range, page aligned
+ *
+ * @param end End of the range (exclusive), page aligned
+ *
+ * @return Number of pages unmapped
+ */
+
+int vm_unmap_range(pagetable_t *pagetable, uint32_t start, uint32_t end)
+{
+    uint32_t vaddrs[TLB_SHOOTDOWN_BATCH];
+    interrupt_status_t intr_status;
+    uint32_t vaddr;
+    pte_t *pte;
+    int invalidated = 0;
+    int count = 0;
+
+    KERNEL_ASSERT(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+    KERNEL_ASSERT(start <= end && end <= USERLAND_END);
+
+    /* Invalidate the entries first, the pages may be freed only after
+       no CPU can have them in its TLB anymore. Pages invalidated by
+       the clock hand are flushed as well, since the hand may not have
+       done its shootdown yet. */
+    intr_status = swap_lock();
+    for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        pte = vm_get_pte(pagetable, vaddr);
+        if (pte == NULL) {
+            /* Skip to the last page of the 4MB region */
+            vaddr |= (PAGETABLE_PTES - 1) * PAGE_SIZE;
+            continue;
+        }
+        if (!pte->S && pte->PFN != 0) {
+            pte->V = 0;
+            if (invalidated < TLB_SHOOTDOWN_BATCH)
+                vaddrs[invalidated] = vaddr;
+            invalidated++;
+        }
+    }
+    swap_unlock(intr_status);
+
+    if (invalidated > 0)
+        tlb_shootdown(pagetable, vaddrs, invalidated);
+
+    intr_status = swap_lock();
+    for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+        pte = vm_get_pte(pagetable, vaddr);
+        if (pte == NULL) {
+            vaddr |= (PAGETABLE_PTES - 1) * PAGE_SIZE;
+            continue;
+        }
+        if (pte->S) {
+            swap_free_slot(pte->PFN);
+        } else if (pte->PFN != 0) {
+            swap_clear_owner(pte->PFN << 12, pagetable);
+            pagepool_free_phys_page(pte->PFN << 12);
+        } else {
+            continue;
+        }
+        memoryset(pte, 0, sizeof(pte_t));
+        pagetable->valid_count--;
+        count++;
+    }
+    swap_unlock(intr_status);
+
+    return count;
 }
 
 /**
@@ -238,35 +509,57 @@ void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
  */
 void vm_set_dirty(pagetable_t *pagetable, uint32_t vaddr, int dirty)
 {
-    unsigned int i;
+    interrupt_status_t intr_status;
+    pte_t *pte;
 
     KERNEL_ASSERT(dirty == 0 || dirty == 1);
 
-    for(i=0; i<pagetable->valid_count; i++) {
-	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-            /* Check whether this is an even or odd page */
-	    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-		if(pagetable->entries[i].V0 == 0) {
-		    KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                                 "entry");
-		} else {
-		    pagetable->entries[i].D0 = dirty;
-		    return;
-		}
-	    } else {
-		if(pagetable->entries[i].V1 == 0) {
-		    KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                                 "entry");
-		} else {
-		    pagetable->entries[i].D1 = dirty;
-		    return;
-		}
-	    }
-	}
+    intr_status = swap_lock();
+
+    pte = vm_get_pte(pagetable, vaddr);
+
+    if (pte == NULL || pte->V == 0) {
+        KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+    }
+
+    pte->D = dirty;
+
+    swap_unlock(intr_status);
+}
+
+/**
+ * Pins the physical page mapped at the given virtual address, so that
+ * the kernel can access it through its physical address. A pinned
+ * page has an extra reference and is therefore not evicted until it
+ * is released with pagepool_free_phys_page.
+ *
+ * @param pagetable The pagetable where the mapping resides.
+ *
+ * @param vaddr The virtual address of the page.
+ *
+ * @param write Whether the page is going to be written.
+ *
+ * @return Physical address of the page, 0 if the page is not mapped
+ * (or not writable when write is set) and must be faulted in first.
+ */
+uint32_t vm_pin_page(pagetable_t *pagetable, uint32_t vaddr, int write)
+{
+    interrupt_status_t intr_status;
+    uint32_t phys = 0;
+    pte_t *pte;
+
+    intr_status = swap_lock();
+
+    pte = vm_get_pte(pagetable, vaddr);
+
+    if (pte != NULL && pte->V && (!write || pte->D)) {
+        phys = pte->PFN << 12;
+        pagepool_ref_phys_page(phys);
     }
-    /* No mapping was found */
 
-    KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+    swap_unlock(intr_status);
+
+    return phys;
 }
 
 /** @} */
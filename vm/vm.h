@@ -41,13 +41,23 @@
 
 void vm_init(void);
 
-pagetable_t *vm_create_pagetable(uint32_t asid);
-void vm_destroy_pagetable(pagetable_t *pagetable);
+pagetable_t *vm_create_pagetable(void);
+int vm_destroy_pagetable(pagetable_t *pagetable);
+int vm_fork_pagetable(pagetable_t *parent, pagetable_t *child);
 
-void vm_map(pagetable_t *pagetable, uint32_t physaddr, 
-	    uint32_t vaddr, int dirty);
+/* End of the userland (kuseg) segment */
+#define USERLAND_END 0x80000000
+
+pte_t *vm_get_pte(pagetable_t *pagetable, uint32_t vaddr);
+
+int vm_map(pagetable_t *pagetable, uint32_t physaddr, 
+           uint32_t vaddr, int dirty);
+int vm_map_large(pagetable_t *pagetable, uint32_t physaddr,
+                 uint32_t vaddr, int dirty);
 void vm_unmap(pagetable_t *pagetable, uint32_t vaddr);
+int vm_unmap_range(pagetable_t *pagetable, uint32_t start, uint32_t end);
 
 void vm_set_dirty(pagetable_t *pagetable, uint32_t vaddr, int dirty);
+uint32_t vm_pin_page(pagetable_t *pagetable, uint32_t vaddr, int write);
 
 #endif /* BUENOS_VM_VM_H */
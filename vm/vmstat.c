@@ -0,0 +1,182 @@
+/*
+ * VM and TLB statistics
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+#include "lib/libc.h"
+#include "vm/vmstat.h"
+#include "vm/pagepool.h"
+#include "vm/swap.h"
+#include "kernel/interrupt.h"
+#include "kernel/thread.h"
+#include "proc/process.h"
+#include "drivers/metadev.h"
+#include "kernel/assert.h"
+#include "drivers/bootargs.h"
+
+/** @name VM statistics
+ *
+ * Counters of TLB exceptions, page faults and page allocations, kept
+ * for each CPU and each process. They can be read with the vmstat
+ * system call, and they are printed when a process exits if the
+ * kernel was booted with the boot argument "vmstat".
+ *
+ * @{
+ */
+
+/* Counters of each CPU. The TLB refills are counted separately by the
+   assembler refill handler, which can use only two registers. */
+static vmstat_t vmstat_cpu[CONFIG_MAX_CPUS];
+uint32_t vmstat_tlb_refills[CONFIG_MAX_CPUS];
+
+/* Number of CPUs in the system */
+static int vmstat_num_cpus;
+
+/* Names of the counters, for vmstat_dump */
+static const char *vmstat_names[VMSTAT_COUNTERS] = {
+    "tlb_refills", "tlb_misses", "tlb_large", "tlb_modified",
+    "tlb_cycles", "page_faults", "pages_allocated", "pages_freed",
+    "evictions", "free_pages", "min_free_pages", "free_swap_slots"
+};
+
+/**
+ * Initializes the statistics. Must be called after devices have been
+ * initialized.
+ */
+void vmstat_init(void)
+{
+    vmstat_num_cpus = cpustatus_count();
+    memoryset(vmstat_cpu, 0, sizeof(vmstat_cpu));
+    memoryset(vmstat_tlb_refills, 0, sizeof(vmstat_tlb_refills));
+}
+
+/**
+ * Adds to a counter of this CPU and of the current process, if the
+ * current thread runs a process.
+ *
+ * @param counter The counter, one of VMSTAT_TLB_MISSES ..
+ * VMSTAT_EVICTIONS
+ *
+ * @param n Amount to add
+ */
+void vmstat_add(int counter, uint32_t n)
+{
+    interrupt_status_t intr_status;
+
+    KERNEL_ASSERT(counter > VMSTAT_TLB_REFILLS &&
+                  counter < VMSTAT_FREE_PAGES);
+
+    intr_status = _interrupt_disable();
+    vmstat_cpu[_interrupt_getcpu()].counter[counter] += n;
+    if (thread_get_current_thread_entry()->process_id >= 0)
+        process_get_current_process_entry()->vmstat.counter[counter] += n;
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Reads the counters of a CPU or of the current process, along with
+ * the current state of the page pool and the swap.
+ *
+ * @param cpu The CPU, or VMSTAT_PROCESS for the current process
+ *
+ * @param stats The statistics are returned here
+ *
+ * @return 0 on success, -1 if there is no such CPU or the current
+ * thread does not run a process.
+ */
+int vmstat_get(int cpu, vmstat_t *stats)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    if (cpu == VMSTAT_PROCESS &&
+        thread_get_current_thread_entry()->process_id >= 0) {
+        *stats = process_get_current_process_entry()->vmstat;
+    } else if (cpu >= 0 && cpu < vmstat_num_cpus) {
+        *stats = vmstat_cpu[cpu];
+        stats->counter[VMSTAT_TLB_REFILLS] = vmstat_tlb_refills[cpu];
+    } else {
+        _interrupt_set_state(intr_status);
+        return -1;
+    }
+    _interrupt_set_state(intr_status);
+
+    stats->counter[VMSTAT_FREE_PAGES] = pagepool_get_num_free_pages();
+    stats->counter[VMSTAT_MIN_FREE_PAGES] = pagepool_get_min_free_pages();
+    stats->counter[VMSTAT_FREE_SWAP_SLOTS] = swap_get_num_free_slots();
+
+    return 0;
+}
+
+/**
+ * Prints one set of statistics.
+ *
+ * @param name Whose statistics these are
+ *
+ * @param id Number of the CPU or process
+ *
+ * @param stats The statistics
+ */
+static void vmstat_print(const char *name, int id, vmstat_t *stats)
+{
+    int i;
+
+    kprintf("vmstat: %s %d:", name, id);
+    for (i = 0; i < VMSTAT_COUNTERS; i++)
+        kprintf(" %s %d", vmstat_names[i], stats->counter[i]);
+    kprintf("\n");
+}
+
+/**
+ * Prints the statistics of the current process and of all CPUs, if
+ * the kernel was booted with the boot argument "vmstat". Called when
+ * a process exits.
+ */
+void vmstat_dump(void)
+{
+    vmstat_t stats;
+    int cpu;
+
+    if (bootargs_get("vmstat") == NULL)
+        return;
+
+    if (vmstat_get(VMSTAT_PROCESS, &stats) == 0)
+        vmstat_print("process", process_get_current_process(), &stats);
+
+    for (cpu = 0; cpu < vmstat_num_cpus; cpu++) {
+        vmstat_get(cpu, &stats);
+        vmstat_print("cpu", cpu, &stats);
+    }
+}
+
+/** @} */
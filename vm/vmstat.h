@@ -0,0 +1,83 @@
+/*
+ * VM and TLB statistics
+ *
+ * Copyright (C) 2003 Juha Aatrokoski, Timo Lilja,
+ *   Leena Salmela, Teemu Takanen, Aleksi Virtanen.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef BUENOS_VM_VMSTAT_H
+#define BUENOS_VM_VMSTAT_H
+
+#include "lib/types.h"
+
+/* Indices of the VM and TLB counters in vmstat_t. The same counters
+   are kept for each CPU and each process. */
+
+/* TLB refills done by the assembler refill handler. Counted only per
+   CPU, the handler does not know the process. */
+#define VMSTAT_TLB_REFILLS       0
+/* TLB misses and invalid entries handled in C */
+#define VMSTAT_TLB_MISSES        1
+/* Large pages written to the TLB */
+#define VMSTAT_TLB_LARGE         2
+/* TLB modified exceptions (writes to write-protected pages) */
+#define VMSTAT_TLB_MODIFIED      3
+/* CPU cycles spent in the TLB exception handlers written in C */
+#define VMSTAT_TLB_CYCLES        4
+/* Faults on pages which were not mapped */
+#define VMSTAT_PAGE_FAULTS       5
+/* Physical pages allocated and freed */
+#define VMSTAT_PAGES_ALLOCATED   6
+#define VMSTAT_PAGES_FREED       7
+/* Pages evicted to swap */
+#define VMSTAT_EVICTIONS         8
+
+/* The rest are not counters but the state of the page pool and the
+   swap when the statistics were read by vmstat_get. */
+#define VMSTAT_FREE_PAGES        9
+#define VMSTAT_MIN_FREE_PAGES    10
+#define VMSTAT_FREE_SWAP_SLOTS   11
+
+#define VMSTAT_COUNTERS          12
+
+/* Statistics of one CPU or process */
+typedef struct {
+    uint32_t counter[VMSTAT_COUNTERS];
+} vmstat_t;
+
+/* vmstat_get argument selecting the current process */
+#define VMSTAT_PROCESS -1
+
+void vmstat_init(void);
+void vmstat_add(int counter, uint32_t n);
+int vmstat_get(int cpu, vmstat_t *stats);
+void vmstat_dump(void);
+
+#endif /* BUENOS_VM_VMSTAT_H */